@@ -80,6 +80,7 @@ Oid   BdrConflictHistoryRelId = InvalidOid;
 Oid   BdrLocksRelid = InvalidOid;
 Oid   BdrLocksByOwnerRelid = InvalidOid;
 Oid   BdrReplicationSetConfigRelid = InvalidOid;
+Oid   BdrNodeRelaysRelid = InvalidOid;
 Oid   BdrSeqamOid = InvalidOid;
 Oid   BdrSupervisorDbOid = InvalidOid;
 
@@ -95,6 +96,16 @@ bool bdr_discard_mismatched_row_attributes;
 bool bdr_trace_replay;
 int bdr_trace_ddl_locks_level;
 char *bdr_extra_apply_connection_options;
+bool bdr_relation_dictionary;
+bool bdr_changed_columns_only;
+int bdr_compression;
+int bdr_batch_messages;
+int bdr_value_chunk_size;
+bool bdr_negotiate_type_transfer;
+int bdr_batch_inserts;
+int bdr_parallel_apply_workers;
+int bdr_receive_buffer_size;
+int bdr_prefetch_depth;
 
 PG_MODULE_MAGIC;
 
@@ -152,6 +163,14 @@ static const struct config_enum_entry bdr_trace_ddl_locks_level_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry bdr_compression_options[] = {
+	{"none", BDR_COMPRESSION_NONE, false},
+#ifdef HAVE_LIBZ
+	{"zlib", BDR_COMPRESSION_ZLIB, false},
+#endif
+	{NULL, 0, false}
+};
+
 void
 bdr_sigterm(SIGNAL_ARGS)
 {
@@ -492,6 +511,16 @@ bdr_bgworker_init(uint32 worker_arg, BdrWorkerType worker_type)
 	bdr_worker_slot->worker_proc = MyProc;
 	LWLockRelease(BdrWorkerCtl->lock);
 
+	bdr_bgworker_init_session(worker_type);
+}
+
+/*
+ * Set up the session of a bdr worker connected to its database, also used by
+ * parallel apply workers, which don't have a shmem slot of their own.
+ */
+void
+bdr_bgworker_init_session(BdrWorkerType worker_type)
+{
 	/* make sure BDR extension is up2date */
 	bdr_executor_always_allow_writes(true);
 	StartTransactionCommand();
@@ -628,6 +657,13 @@ bdr_establish_connection_and_slot(const char *dsn,
 						out_replication_identifier, out_snapshot);
 	}
 
+	/*
+	 * The identifier's number may have belonged to another node before, make
+	 * sure bdr_fetch_sysid_via_node_id() doesn't return a stale identity.
+	 */
+	bdr_node_identity_store(*out_replication_identifier, *out_sysid,
+							*out_timeline, *out_dboid, MyDatabaseId);
+
 	pfree(remote_ident);
 	remote_ident = NULL;
 
@@ -870,6 +906,105 @@ _PG_init(void)
 							   0,
 							   NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("bdr.relation_dictionary",
+							 "Refer to relations by id instead of by name in the replication stream",
+							 "Only takes effect for newly established apply connections. "
+							 "All upstream nodes must support it.",
+							 &bdr_relation_dictionary,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("bdr.changed_columns_only",
+							 "Only replicate changed columns of UPDATEs to tables with REPLICA IDENTITY FULL",
+							 "Only takes effect for newly established apply connections. "
+							 "All upstream nodes must support it.",
+							 &bdr_changed_columns_only,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.batch_messages",
+							"Maximum number of messages upstream nodes send in one batch",
+							"0 or 1 disables batching. Only takes effect for newly established "
+							"apply connections. All upstream nodes must support it.",
+							&bdr_batch_messages,
+							0, 0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("bdr.compression",
+							 "Compress the replication stream from upstream nodes",
+							 "Only takes effect for newly established apply connections. "
+							 "All upstream nodes must support it.",
+							 &bdr_compression,
+							 BDR_COMPRESSION_NONE,
+							 bdr_compression_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.value_chunk_size",
+							"Send column values larger than this in pieces of this size",
+							"0 disables sending values in pieces. Only takes effect for "
+							"newly established apply connections. All upstream nodes "
+							"must support it.",
+							&bdr_value_chunk_size,
+							0, 0, MaxAllocSize / 1024,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("bdr.negotiate_type_transfer",
+							 "Let upstream nodes decide per data type whether to send values in binary",
+							 "Only takes effect for newly established apply connections. "
+							 "All upstream nodes must support it.",
+							 &bdr_negotiate_type_transfer,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.batch_inserts",
+							"Maximum number of consecutive INSERTs into a table to apply at once",
+							"0 or 1 applies each INSERT on its own.",
+							&bdr_batch_inserts,
+							0, 0, 65536,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.parallel_apply_workers",
+							"Number of workers each apply worker hands remote transactions to",
+							"0 applies the transactions in the apply worker itself. "
+							"Only takes effect for newly started apply workers.",
+							&bdr_parallel_apply_workers,
+							0, 0, 64,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.receive_buffer_size",
+							"Amount of changes an apply worker receives ahead while waiting for parallel apply workers",
+							"0 stops receiving while waiting.",
+							&bdr_receive_buffer_size,
+							8192, 0, MaxAllocSize / 1024,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("bdr.prefetch_depth",
+							"Number of upcoming remote changes apply workers prefetch the rows of",
+							"Experimental. 0 disables prefetching.",
+							&bdr_prefetch_depth,
+							0, 0, 1024,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
 	EmitWarningsOnPlaceholders("bdr");
 
 	bdr_label_init();
@@ -991,6 +1126,8 @@ bdr_maintain_schema(bool update_extensions)
 		bdr_lookup_relid("bdr_global_locks", schema_oid);
 	BdrLocksByOwnerRelid =
 		bdr_lookup_relid("bdr_global_locks_byowner", schema_oid);
+	BdrNodeRelaysRelid =
+		bdr_lookup_relid("bdr_node_relays", schema_oid);
 	BdrSeqamOid = get_seqam_oid("bdr", false);
 	BdrSupervisorDbOid = bdr_get_supervisordb_oid(false);
 
@@ -131,6 +131,19 @@ enum BdrDDLLockTraceLevel {
 	DDL_LOCK_TRACE_NONE
 };
 
+/*
+ * Compression of the replication stream, see bdr.compression.
+ *
+ * A compressed message is marked with a 'Z' action byte, followed by the
+ * uncompressed length and the compressed original message. All compressed
+ * messages of a connection are part of one compression stream.
+ */
+typedef enum BdrCompression
+{
+	BDR_COMPRESSION_NONE,
+	BDR_COMPRESSION_ZLIB
+} BdrCompression;
+
 /*
  * This structure is for caching relation specific information, such as
  * conflict handlers.
@@ -152,10 +165,65 @@ typedef struct BDRRelation
 	/* -1 for no configured set */
 	int			num_replication_sets;
 
+	/* row filter expressions, row_filters[i] applies to row_filter_sets[i] */
+	char	  **row_filter_sets;
+	char	  **row_filters;
+	int			num_row_filters;
+
+	/* replicated columns, column_lists[i] is a List of column names */
+	char	  **column_list_sets;
+	List	  **column_lists;
+	int			num_column_lists;
+
 	bool		computed_repl_valid;
 	bool		computed_repl_insert;
 	bool		computed_repl_update;
 	bool		computed_repl_delete;
+
+	/*
+	 * Row filters of the replicated sets that replicate the respective
+	 * action; NIL if the action is replicated for all rows.
+	 */
+	List	   *computed_filter_insert;
+	List	   *computed_filter_update;
+	List	   *computed_filter_delete;
+
+	/* attnums of the replicated columns; NULL if all columns are replicated */
+	struct Bitmapset *computed_columns;
+
+	/*
+	 * Per-attribute encoding decisions of the output plugin, built on first
+	 * use inside a walsender; see bdr_output.c. Everything hangs off
+	 * output_plan_cxt so invalidation can release it in one go.
+	 */
+	MemoryContext output_plan_cxt;
+	struct BDRAttOutputPlan *output_plan;
+	/* all columns are sent in binary, see write_tuple_binary() */
+	bool		output_plan_binary;
+	/* composite column types the plan depends on, by pg_type.typrelid */
+	List	   *output_plan_typrelids;
+
+	/* relation metadata has been sent to the client, see write_relmeta() */
+	bool		output_relmeta_sent;
+
+	/* computed_filter_* compiled by the output plugin, in output_plan_cxt */
+	bool		output_filters_valid;
+	struct ExprState *output_filter_insert;
+	struct ExprState *output_filter_update;
+	struct ExprState *output_filter_delete;
+	/* columns the update/delete filters reference, see should_forward_row() */
+	struct Bitmapset *output_filter_update_attrs;
+	struct Bitmapset *output_filter_delete_attrs;
+	struct TupleTableSlot *output_filter_slot;
+
+	/*
+	 * Index scan keys and column input function lookups of the apply worker,
+	 * built on first use; see build_index_scan_key() and bdr_apply.c. Kept
+	 * until the relation is invalidated, in apply_plan_cxt.
+	 */
+	MemoryContext apply_plan_cxt;
+	List	   *apply_index_keys;
+	struct BDRAttInputPlan *apply_att_input;
 } BDRRelation;
 
 typedef struct BDRTupleData
@@ -198,6 +266,13 @@ typedef struct BdrApplyWorker
 	/* Request that the remote forward all changes from other nodes */
 	bool forward_changesets;
 
+	/*
+	 * Transactions up to this commit LSN were in progress in parallel apply
+	 * workers when the apply worker last exited. They're replayed by the
+	 * apply worker itself, see bdr_apply_parallel.c.
+	 */
+	XLogRecPtr parallel_resume_lsn;
+
 	/*
 	 * The apply worker's latch from the PROC array, for use from other backends
 	 *
@@ -231,6 +306,13 @@ typedef struct BdrPerdbWorker
 	Oid				database_oid;
 } BdrPerdbWorker;
 
+/*
+ * Number of buckets of the transaction histograms in BdrWalsenderWorker.
+ * Bucket 0 counts transactions with a value of 0, bucket n > 0 those with a
+ * value in [2^(n-1), 2^n), and the last bucket everything above as well.
+ */
+#define BDR_TXN_HISTOGRAM_BUCKETS 32
+
 /*
  * Walsender worker. These are only allocated while a output plugin is active.
  */
@@ -244,6 +326,31 @@ typedef struct BdrWalsenderWorker
 	TimeLineID	remote_timeline;
 	Oid			remote_dboid;
 
+	/*
+	 * Output plugin statistics, see bdr.pg_stat_bdr_walsender. Only written
+	 * by the walsender itself, so it doesn't need to lock.
+	 */
+	int64		nr_txn_decoded;
+	int64		nr_txn_filtered_origin;
+	int64		nr_change_decoded;
+	int64		nr_change_filtered_origin;
+	int64		nr_change_filtered_repset;
+	int64		nr_change_filtered_row;
+	int64		nr_bytes_sent;
+	int64		nr_columns_binary;
+	int64		nr_columns_sendrecv;
+	int64		nr_columns_text;
+	/* in microseconds */
+	int64		write_tuple_time;
+
+	/*
+	 * Histograms of the transactions sent: number of changes, bytes sent, and
+	 * microseconds from commit to having been sent. See
+	 * bdr.pg_stat_bdr_walsender_txn.
+	 */
+	int64		txn_changes_hist[BDR_TXN_HISTOGRAM_BUCKETS];
+	int64		txn_bytes_hist[BDR_TXN_HISTOGRAM_BUCKETS];
+	int64		txn_latency_hist[BDR_TXN_HISTOGRAM_BUCKETS];
 } BdrWalsenderWorker;
 
 /*
@@ -308,6 +415,16 @@ extern int bdr_ddl_lock_timeout;
 extern bool bdr_trace_replay;
 extern int bdr_trace_ddl_locks_level;
 extern char *bdr_extra_apply_connection_options;
+extern bool bdr_relation_dictionary;
+extern bool bdr_changed_columns_only;
+extern int bdr_compression;
+extern int bdr_batch_messages;
+extern int bdr_value_chunk_size;
+extern bool bdr_negotiate_type_transfer;
+extern int bdr_batch_inserts;
+extern int bdr_parallel_apply_workers;
+extern int bdr_receive_buffer_size;
+extern int bdr_prefetch_depth;
 
 static const char * const bdr_default_apply_connection_options =
         "connect_timeout=30 "
@@ -359,6 +476,7 @@ extern Oid	QueuedDropsRelid;
 extern Oid	BdrSequenceValuesRelid;
 extern Oid	BdrSequenceElectionsRelid;
 extern Oid	BdrVotesRelid;
+extern Oid	BdrNodeRelaysRelid;
 extern Oid	BdrSeqamOid;
 extern Oid  BdrSupervisorDbOid;
 
@@ -386,6 +504,13 @@ typedef struct BDRNodeInfo
 	bool		read_only;
 } BDRNodeInfo;
 
+/* Structure representing bdr_node_relays record */
+typedef struct BDRNodeRelay
+{
+	BDRNodeId	node;
+	BDRNodeId	relay;
+} BDRNodeRelay;
+
 extern Oid bdr_lookup_relid(const char *relname, Oid schema_oid);
 
 extern void bdr_sequencer_set_nnodes(Size nnodes);
@@ -394,7 +519,38 @@ extern void bdr_sequencer_set_nnodes(Size nnodes);
 /* apply support */
 extern void bdr_fetch_sysid_via_node_id(RepNodeId node_id, uint64 *sysid,
 										TimeLineID *tli, Oid *remote_dboid);
+extern void bdr_node_identity_shmem_init(Size nentries);
+extern void bdr_node_identity_store(RepNodeId node_id, uint64 sysid,
+									TimeLineID tli, Oid dboid,
+									Oid local_dboid);
 extern RepNodeId bdr_fetch_node_id_via_sysid(uint64 sysid, TimeLineID tli, Oid dboid);
+extern char bdr_process_remote_action(StringInfo s);
+extern List *bdr_remote_relation_messages(void);
+extern int bdr_apply_wait(long timeout);
+extern void bdr_read_remote_relation(StringInfo s, const char **nspname,
+									 const char **relname);
+extern void bdr_apply_init_parallel_worker(BdrApplyWorker *apply,
+										   RepNodeId upstream_origin_id,
+										   uint64 sysid, TimeLineID tli,
+										   Oid dboid,
+										   bool relation_dictionary,
+										   bool value_chunks);
+
+/* parallel apply, see bdr_apply_parallel.c */
+extern bool bdr_is_parallel_apply_worker;
+extern void bdr_apply_parallel_init(BdrApplyWorker *apply, int apply_slot,
+									RepNodeId upstream_origin_id,
+									uint64 sysid, TimeLineID tli, Oid dboid,
+									bool relation_dictionary,
+									bool value_chunks);
+extern char bdr_apply_parallel_dispatch(StringInfo s);
+extern bool bdr_apply_parallel_pending(void);
+extern bool bdr_apply_parallel_progress(XLogRecPtr *remote_end,
+										XLogRecPtr *local_end);
+extern void bdr_apply_parallel_xact_started(void);
+extern void bdr_apply_parallel_wait_turn(void);
+extern void bdr_apply_parallel_commit_done(XLogRecPtr remote_end,
+										   XLogRecPtr local_end);
 
 /* Index maintenance, heap access, etc */
 extern struct EState * bdr_create_rel_estate(Relation rel);
@@ -402,15 +558,18 @@ extern void UserTableUpdateIndexes(struct EState *estate,
 								   struct TupleTableSlot *slot);
 extern void UserTableUpdateOpenIndexes(struct EState *estate,
 									   struct TupleTableSlot *slot);
-extern void build_index_scan_keys(struct EState *estate,
+extern void build_index_scan_keys(BDRRelation *rel, struct EState *estate,
 								  struct ScanKeyData **scan_keys,
 								  BDRTupleData *tup);
-extern bool build_index_scan_key(struct ScanKeyData *skey, Relation rel,
+extern bool build_index_scan_key(struct ScanKeyData *skey, BDRRelation *rel,
 								 Relation idxrel,
 								 BDRTupleData *tup);
 extern bool find_pkey_tuple(struct ScanKeyData *skey, BDRRelation *rel,
 							Relation idxrel, struct TupleTableSlot *slot,
 							bool lock, enum LockTupleMode mode);
+extern void bdr_prefetch_index_key(Relation rel, Relation idxrel,
+								   Datum *values, bool *isnull, bool heap);
+extern Oid bdr_replident_index(Relation rel);
 
 /* conflict logging (usable in apply only) */
 
@@ -496,6 +655,23 @@ extern bool bdr_get_float4byval(void);
 extern bool bdr_get_float8byval(void);
 extern bool bdr_get_integer_timestamps(void);
 extern bool bdr_get_bigendian(void);
+extern int bdr_typalign_bytes(char typalign);
+extern char *bdr_type_capabilities(void);
+
+/* application message channels */
+typedef void (*BdrMessageHandler) (const char *channel, uint64 origin_sysid,
+								   TimeLineID origin_tli, Oid origin_dboid,
+								   bool transactional, const char *payload,
+								   Size len);
+
+extern void bdr_validate_message_channel_name(const char *channel);
+extern void bdr_register_message_handler(const char *channel,
+										 BdrMessageHandler handler);
+extern char *bdr_message_channels(void);
+extern void bdr_dispatch_message(const char *channel, uint64 origin_sysid,
+								 TimeLineID origin_tli, Oid origin_dboid,
+								 bool transactional, const char *payload,
+								 Size len);
 
 /* initialize a new bdr member */
 extern void bdr_init_replica(BDRNodeInfo *local_node);
@@ -535,10 +711,12 @@ extern void bdr_locks_check_dml(void);
 
 /* background workers and supporting functions for them */
 PGDLLEXPORT extern void bdr_apply_main(Datum main_arg);
+PGDLLEXPORT extern void bdr_apply_parallel_worker_main(Datum main_arg);
 PGDLLEXPORT extern void bdr_perdb_worker_main(Datum main_arg);
 PGDLLEXPORT extern void bdr_supervisor_worker_main(Datum main_arg);
 
 extern void bdr_bgworker_init(uint32 worker_arg, BdrWorkerType worker_type);
+extern void bdr_bgworker_init_session(BdrWorkerType worker_type);
 extern void bdr_supervisor_register(void);
 
 extern Oid bdr_get_supervisordb_oid(bool missing_ok);
@@ -564,7 +742,12 @@ extern BDRNodeInfo * bdr_nodes_get_local_info(uint64 sysid, TimeLineID tli,
 										  Oid dboid);
 extern void bdr_bdr_node_free(BDRNodeInfo *node);
 extern void bdr_nodes_set_local_status(char status);
+extern void bdr_set_relayed_progress(uint64 sysid, TimeLineID tli, Oid dboid,
+									 XLogRecPtr lsn);
+extern XLogRecPtr bdr_get_relayed_progress(uint64 sysid, TimeLineID tli,
+										   Oid dboid);
 extern List* bdr_read_connection_configs(void);
+extern List* bdr_read_node_relays(void);
 
 extern Oid GetSysCacheOidError(int cacheId, Datum key1, Datum key2, Datum key3,
 							   Datum key4);
@@ -620,13 +803,20 @@ extern void bdr_cleanup_conn_close(int code, Datum offset);
 /* use instead of heap_open()/heap_close() */
 extern BDRRelation *bdr_heap_open(Oid reloid, LOCKMODE lockmode);
 extern void bdr_heap_close(BDRRelation * rel, LOCKMODE lockmode);
+extern MemoryContext bdr_apply_plan_context(BDRRelation *rel);
+extern void bdr_relcache_add_type_dependency(BDRRelation *entry, Oid typrelid);
 extern void bdr_heap_compute_replication_settings(
 	BDRRelation *rel,
 	int			num_replication_sets,
 	char	  **replication_sets);
+extern void bdr_replication_set_config_changed(Relation rel,
+	HeapTuple oldtuple, HeapTuple newtuple);
+extern void bdr_replication_set_config_reset(void);
 extern void BDRRelcacheHashInvalidateCallback(Datum arg, Oid relid);
 
 extern void bdr_parse_relation_options(const char *label, BDRRelation *rel);
+extern void bdr_validate_relation_options(Oid relid, const char *label);
+extern Node *bdr_row_filter_expr(Relation rel, const char *filter);
 extern void bdr_parse_database_options(const char *label, bool *is_active);
 
 /* conflict handlers API */
@@ -14,6 +14,10 @@
  */
 #include "postgres.h"
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #include "bdr.h"
 #include "bdr_locks.h"
 
@@ -23,6 +27,7 @@
 #include "pgstat.h"
 
 #include "access/committs.h"
+#include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/relscan.h"
 #include "access/xact.h"
@@ -41,10 +46,13 @@
 
 #include "mb/pg_wchar.h"
 
+#include "nodes/makefuncs.h"
+
 #include "parser/parse_type.h"
 
 #include "replication/logical.h"
 #include "replication/replication_identifier.h"
+#include "replication/walreceiver.h"
 
 #include "storage/ipc.h"
 #include "storage/lmgr.h"
@@ -58,6 +66,7 @@
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/datetime.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
@@ -91,6 +100,8 @@ static Oid				remote_origin_dboid = InvalidOid;
 static XLogRecPtr		remote_origin_lsn = InvalidXLogRecPtr;
 /* The local identifier for the remote's origin, if any. */
 static RepNodeId		remote_origin_id = InvalidRepNodeId;
+/* The local identifier for the upstream we're replaying from. */
+static RepNodeId		upstream_origin_id = InvalidRepNodeId;
 
 /*
  * A message counter for the xact, for debugging. We don't send
@@ -109,6 +120,154 @@ static BdrConnectionConfig *bdr_apply_config = NULL;
 
 dlist_head bdr_lsn_association = DLIST_STATIC_INIT(bdr_lsn_association);
 
+/*
+ * Whether the upstream refers to relations by id, i.e. whether we asked for
+ * the relation dictionary when starting replication. bdr.relation_dictionary
+ * may change at SIGHUP, this may not.
+ */
+static bool apply_relation_dictionary = false;
+
+/*
+ * Relation dictionary, mapping upstream relation ids to the names sent in
+ * the upstream's relation metadata messages and, once resolved, the local
+ * relation.
+ */
+typedef struct BDRRemoteRelation
+{
+	uint32		remote_relid;	/* hash key */
+	char	   *nspname;
+	char	   *relname;
+	/* local relation or InvalidOid if it needs to be looked up by name */
+	Oid			local_relid;
+} BDRRemoteRelation;
+
+static HTAB *BDRRemoteRelHash = NULL;
+
+/* Compression requested when starting replication, see bdr.compression */
+static BdrCompression apply_compression = BDR_COMPRESSION_NONE;
+
+/* Whether batches of messages have been requested, see bdr.batch_messages */
+static bool apply_batch_messages = false;
+
+/* Whether large values may be sent in chunks, see bdr.value_chunk_size */
+static bool apply_value_chunks = false;
+
+/*
+ * Whether transactions are handed to parallel apply workers rather than
+ * applied here, see bdr.parallel_apply_workers and bdr_apply_parallel.c.
+ */
+static bool apply_parallel = false;
+
+/*
+ * A message from the upstream that's been received ahead, while waiting for
+ * parallel apply workers so the upstream isn't held up by a full socket, see
+ * bdr_apply_receive(), or to prefetch the rows upcoming changes affect, see
+ * bdr_prefetch_queued(). The queue holds at most bdr.receive_buffer_size.
+ *
+ * Each message holds a single action, messages with several are split up
+ * when they're queued, see bdr_queue_received().
+ */
+typedef struct BdrReceivedMessage
+{
+	dlist_node	node;
+	/* how far prefetching for the action got, BDR_PREFETCH_* */
+	int			prefetched;
+	int			len;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} BdrReceivedMessage;
+
+#define BDR_PREFETCH_NONE		0
+#define BDR_PREFETCH_INDEX		1
+#define BDR_PREFETCH_HEAP		2
+
+/* 'w', start and end LSN and send time */
+#define BDR_WAL_HEADER_LEN		(1 + 8 + 8 + 8)
+
+static dlist_head bdr_receive_queue = DLIST_STATIC_INIT(bdr_receive_queue);
+static Size bdr_receive_queue_bytes = 0;
+static int	bdr_receive_queue_len = 0;
+
+/* for the short-lived allocations of prefetching */
+static MemoryContext PrefetchContext = NULL;
+
+/* The connection to the upstream, and the last position received on it */
+static PGconn *apply_conn = NULL;
+static XLogRecPtr apply_last_received = InvalidXLogRecPtr;
+
+/*
+ * A column value sent in chunks ahead of the change using it. Kept in
+ * ValueChunkContext until that change has been applied, as MessageContext is
+ * only reset at commit.
+ */
+typedef struct BDRChunkedValue
+{
+	char	   *data;
+	Size		len;
+	Size		received;
+} BDRChunkedValue;
+
+static MemoryContext ValueChunkContext = NULL;
+
+/* values received for the next change, in column order */
+static List *apply_chunked_values = NIL;
+/* index of the next value in apply_chunked_values to use */
+static int	apply_chunked_next = 0;
+
+/*
+ * Executor state for a local relation, set up by the first change applied to
+ * the relation in a transaction and kept until the transaction ends, so the
+ * following changes don't each need their own EState and have to open all
+ * indexes again. See get_apply_rel_state().
+ */
+typedef struct BDRApplyRelState
+{
+	Oid			relid;
+	/* our own reference, the relation is closed after each change */
+	Relation	rel;
+	/* with the relation's indexes opened */
+	EState	   *estate;
+	TupleTableSlot *oldslot;
+	TupleTableSlot *newslot;
+	/* for writing out batched INSERTs, see flush_insert_batch() */
+	TupleTableSlot *batchslot;
+	/* the replica identity index among the opened ones, or NULL */
+	Relation	idxrel;
+	/* per column, fn_oid is InvalidOid until first used */
+	FmgrInfo   *input_fns;
+	FmgrInfo   *recv_fns;
+} BDRApplyRelState;
+
+/* in TopTransactionContext, released by release_apply_rel_states() */
+static List *apply_rel_states = NIL;
+
+/*
+ * Remote INSERTs into one relation that didn't conflict with any local row,
+ * not written yet; see bdr.batch_inserts. The array and the tuples are
+ * allocated in TopTransactionContext: the batch can outlive MessageContext,
+ * which the main loop resets whenever it runs out of data, even in the middle
+ * of a transaction.
+ */
+static BDRApplyRelState *insert_batch_state = NULL;
+static HeapTuple *insert_batch_tuples = NULL;
+static int	insert_batch_size = 0;
+static int	insert_batch_ntuples = 0;
+
+/*
+ * Input function lookups for a column of a local relation, kept with the
+ * relation's apply plan across transactions; see get_att_input_fn().
+ */
+typedef struct BDRAttInputPlan
+{
+	Oid			typinput;
+	Oid			typreceive;
+	Oid			typioparam;
+} BDRAttInputPlan;
+
+#ifdef HAVE_LIBZ
+/* decompression state, all compressed messages are part of one stream */
+static z_stream *apply_zstream = NULL;
+#endif
+
 struct ActionErrCallbackArg
 {
 	const char * action_name;
@@ -119,7 +278,14 @@ struct ActionErrCallbackArg
 };
 
 static BDRRelation *read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg);
-static void read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup);
+static void read_tuple_parts(StringInfo s, BDRRelation *rel,
+							 BDRApplyRelState *state, BDRTupleData *tup);
+static BDRApplyRelState *get_apply_rel_state(BDRRelation *rel);
+static void release_apply_rel_states(void);
+static void reset_apply_rel_state(BDRApplyRelState *state);
+static void queue_insert(BDRApplyRelState *state);
+static bool insert_batch_has_key(IndexInfo *ii, ScanKey skey, TupleDesc desc);
+static void flush_insert_batch(void);
 
 static void check_apply_update(BdrConflictType conflict_type,
 							   RepNodeId local_node_id, TimestampTz local_ts,
@@ -139,6 +305,29 @@ static void process_remote_insert(StringInfo s);
 static void process_remote_update(StringInfo s);
 static void process_remote_delete(StringInfo s);
 static void process_remote_message(StringInfo s);
+static void process_remote_relation(StringInfo s);
+static void process_remote_value_chunk(StringInfo s);
+static Datum bdr_next_chunked_value(int len);
+
+static void bdr_decompress_action(StringInfo s, StringInfo out);
+static void bdr_push_flush_position(XLogRecPtr remote_end,
+									XLogRecPtr local_end);
+static int	bdr_get_copy_data(PGconn *conn, char **buf);
+static void bdr_read_wal_header(StringInfo s);
+static void bdr_handle_copy_data(PGconn *conn, char *data, int len);
+static void bdr_queue_received(char *data, int len);
+static void bdr_queue_action(const char *header, const char *action, int len);
+static void bdr_read_ahead(int max_queued);
+static void bdr_apply_receive(void);
+static void bdr_prefetch_queued(void);
+static bool bdr_prefetch_action(BdrReceivedMessage *msg, int stage);
+static BDRRelation *prefetch_read_rel(StringInfo s, bool *barrier);
+static bool read_index_key_parts(StringInfo s, BDRRelation *rel,
+								 BDRApplyRelState *state, Relation idxrel,
+								 Datum *values, bool *isnull);
+static Datum input_column_value(BDRRelation *rel, BDRApplyRelState *state,
+								int attoff, char kind, const char *data,
+								int len);
 
 static void get_local_tuple_origin(HeapTuple tuple,
 								   TimestampTz *commit_ts,
@@ -323,9 +512,30 @@ process_remote_begin(StringInfo s)
 
 		old_ctx = CurrentMemoryContext;
 		StartTransactionCommand();
-		remote_origin_id = GetReplicationIdentifier(remote_ident, false);
+		remote_origin_id = GetReplicationIdentifier(remote_ident,
+									!bdr_apply_worker->forward_changesets);
 		CommitTransactionCommand();
 		(void) MemoryContextSwitchTo(old_ctx);
+
+		/*
+		 * Outside catchup mode the upstream is a relay node forwarding a
+		 * transaction from another node. Replay it as that node's, with its
+		 * commit LSN, so commit timestamps, conflict handling and the origin
+		 * node's replay progress are the same as on the nodes connected to
+		 * it directly. The commit record then doesn't advance the upstream's
+		 * identifier, so its position is recorded in the same transaction,
+		 * see bdr_set_relayed_progress().
+		 *
+		 * If we were never connected to the origin directly there's no
+		 * identifier for it and the transaction is replayed as the
+		 * upstream's.
+		 */
+		if (!bdr_apply_worker->forward_changesets &&
+			remote_origin_id != InvalidRepNodeId)
+		{
+			replication_origin_id = remote_origin_id;
+			replication_origin_lsn = remote_origin_lsn;
+		}
 	}
 
 	if (bdr_trace_replay)
@@ -472,26 +682,36 @@ process_remote_commit(StringInfo s)
 	 * BDR 2.0 compatibility, see d96d8bb5d and 2ndQuadrant/bdr-private#73
 	 */
 	Assert(replication_origin_lsn == end_lsn /* bdr 2.0 msg */
-		   || replication_origin_lsn == commit_lsn); /* bdr 1.0 msg */
+		   || replication_origin_lsn == commit_lsn /* bdr 1.0 msg */
+		   || replication_origin_id != upstream_origin_id); /* relayed */
+
 
+	/* commit in the order the upstream did, see bdr_apply_parallel.c */
+	if (bdr_is_parallel_apply_worker)
+		bdr_apply_parallel_wait_turn();
 
 	if (started_transaction)
 	{
-		BdrFlushPosition *flushpos;
+		/*
+		 * A transaction forwarded by a relay node is committed under the
+		 * identifier of the node it originated on, which the commit record
+		 * advances. Record how far we got with the relay itself in the same
+		 * transaction, so that survives a crash as well.
+		 */
+		if (replication_origin_id != upstream_origin_id)
+			bdr_set_relayed_progress(origin_sysid, origin_timeline,
+									 origin_dboid, end_lsn);
 
 		CommitTransactionCommand();
 		(void) MemoryContextSwitchTo(MessageContext);
 
 		/*
 		 * Associate the end of the remote commit lsn with the local end of
-		 * the commit record.
+		 * the commit record. Parallel apply workers leave that to the apply
+		 * worker, which reports the flush position to the upstream.
 		 */
-		flushpos = (BdrFlushPosition *)
-			MemoryContextAlloc(TopMemoryContext, sizeof(BdrFlushPosition));
-		flushpos->local_end = XactLastCommitEnd;
-		flushpos->remote_end = end_lsn;
-
-		dlist_push_tail(&bdr_lsn_association, &flushpos->node);
+		if (!bdr_is_parallel_apply_worker)
+			bdr_push_flush_position(end_lsn, XactLastCommitEnd);
 
 		/* report stats, only relevant if something was actually written */
 		pgstat_report_stat(false);
@@ -507,13 +727,34 @@ process_remote_commit(StringInfo s)
 	 * even if we're really replaying a commit that's been forwarded from
 	 * another node (per remote_origin_id below). This is necessary to make
 	 * sure we don't replay the same forwarded commit multiple times.
+	 *
+	 * Only the apply worker has set up the identifier for caching.
+	 */
+	if (bdr_is_parallel_apply_worker)
+		AdvanceReplicationIdentifier(upstream_origin_id, end_lsn,
+									 XactLastCommitEnd);
+	else
+		AdvanceCachedReplicationIdentifier(end_lsn, XactLastCommitEnd);
+
+	/*
+	 * A relayed transaction's commit record also carries the identifier of
+	 * the node it originated on, keep that node's progress in memory in sync
+	 * with it. The next transaction may come from the upstream itself.
 	 */
-	AdvanceCachedReplicationIdentifier(end_lsn, XactLastCommitEnd);
+	if (replication_origin_id != upstream_origin_id)
+	{
+		AdvanceReplicationIdentifier(replication_origin_id, remote_origin_lsn,
+									 XactLastCommitEnd);
+		replication_origin_id = upstream_origin_id;
+	}
 
 	CurrentResourceOwner = bdr_saved_resowner;
 
 	bdr_count_commit();
 
+	if (bdr_is_parallel_apply_worker)
+		bdr_apply_parallel_commit_done(end_lsn, XactLastCommitEnd);
+
 	replication_origin_xid = InvalidTransactionId;
 	replication_origin_lsn = InvalidXLogRecPtr;
 	replication_origin_timestamp = 0;
@@ -564,6 +805,7 @@ static void
 process_remote_insert(StringInfo s)
 {
 	char		action;
+	BDRApplyRelState *state;
 	EState	   *estate;
 	BDRTupleData new_tuple;
 	TupleTableSlot *newslot;
@@ -611,13 +853,16 @@ process_remote_insert(StringInfo s)
 		elog(ERROR, "expected new tuple but got %d",
 			 action);
 
-	estate = bdr_create_rel_estate(rel->rel);
-	newslot = ExecInitExtraTupleSlot(estate);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(newslot, RelationGetDescr(rel->rel));
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel->rel));
+	state = get_apply_rel_state(rel);
+	estate = state->estate;
+	newslot = state->newslot;
+	oldslot = state->oldslot;
+
+	/* rows for another relation go first */
+	if (insert_batch_state != NULL && insert_batch_state != state)
+		flush_insert_batch();
 
-	read_tuple_parts(s, rel, &new_tuple);
+	read_tuple_parts(s, rel, state, &new_tuple);
 	{
 		HeapTuple tup;
 		tup = heap_form_tuple(RelationGetDescr(rel->rel),
@@ -637,12 +882,11 @@ process_remote_insert(StringInfo s)
 	/*
 	 * Search for conflicting tuples.
 	 */
-	ExecOpenIndices(estate->es_result_relation_info);
 	relinfo = estate->es_result_relation_info;
 	index_keys = palloc0(relinfo->ri_NumIndices * sizeof(ScanKeyData*));
 	conflicts = palloc0(relinfo->ri_NumIndices * sizeof(ItemPointerData));
 
-	build_index_scan_keys(estate, index_keys, &new_tuple);
+	build_index_scan_keys(rel, estate, index_keys, &new_tuple);
 
 	/* do a SnapshotDirty search for conflicting tuples */
 	for (i = 0; i < relinfo->ri_NumIndices; i++)
@@ -665,6 +909,11 @@ process_remote_insert(StringInfo s)
 
 		Assert(ii->ii_Expressions == NIL);
 
+		/* rows still in the batch aren't in the index yet */
+		if (insert_batch_state == state &&
+			insert_batch_has_key(ii, index_keys[i], RelationGetDescr(rel->rel)))
+			flush_insert_batch();
+
 		/* if conflict: wait */
 		found = find_pkey_tuple(index_keys[i],
 								rel, relinfo->ri_IndexRelationDescs[i],
@@ -698,11 +947,15 @@ process_remote_insert(StringInfo s)
 		CHECK_FOR_INTERRUPTS();
 	}
 
+	/* resolve conflicts one row at a time, after the preceding rows */
+	if (conflict)
+		flush_insert_batch();
+
 	PushActiveSnapshot(GetTransactionSnapshot());
 
 	/*
 	 * If there's a conflict use the version created later, otherwise do a
-	 * plain insert.
+	 * plain insert, or leave it to flush_insert_batch() if we're batching.
 	 */
 	if (conflict)
 	{
@@ -716,6 +969,22 @@ process_remote_insert(StringInfo s)
 
 		get_local_tuple_origin(oldslot->tts_tuple, &local_ts, &local_node_id);
 
+		/*
+		 * Columns left out by the sender's column lists arrive as unchanged.
+		 * Keep the local row's values for them rather than replacing them
+		 * with NULLs, like an UPDATE would.
+		 */
+		{
+			HeapTuple	remote_tuple;
+
+			remote_tuple = heap_modify_tuple(oldslot->tts_tuple,
+											 RelationGetDescr(rel->rel),
+											 new_tuple.values,
+											 new_tuple.isnull,
+											 new_tuple.changed);
+			ExecStoreTuple(remote_tuple, newslot, InvalidBuffer, true);
+		}
+
 		/*
 		 * Use conflict triggers and/or last-update-wins to decide which tuple
 		 * to retain.
@@ -773,8 +1042,17 @@ process_remote_insert(StringInfo s)
 			bdr_conflict_logging_cleanup();
 		}
 	}
+	else if (bdr_batch_inserts > 1 &&
+			 RelationGetNamespace(rel->rel) != BdrSchemaOid)
+	{
+		queue_insert(state);
+		bdr_count_insert();
+	}
 	else
 	{
+		/* in case bdr.batch_inserts was just turned off */
+		flush_insert_batch();
+
 		simple_heap_insert(rel->rel, newslot->tts_tuple);
 		UserTableUpdateOpenIndexes(estate, newslot);
 		bdr_count_insert();
@@ -782,8 +1060,6 @@ process_remote_insert(StringInfo s)
 
 	PopActiveSnapshot();
 
-	ExecCloseIndices(estate->es_result_relation_info);
-
 	check_bdr_wakeups(rel);
 
 	/* execute DDL if insertion was into the ddl command queue */
@@ -810,8 +1086,8 @@ process_remote_insert(StringInfo s)
 		LockRelationIdForSession(&lockid, RowExclusiveLock);
 		bdr_heap_close(rel, NoLock);
 
-		ExecResetTupleTable(estate->es_tupleTable, true);
-		FreeExecutorState(estate);
+		/* the DDL might alter or drop relations we hold open */
+		release_apply_rel_states();
 
 		if (relid == QueuedDDLCommandsRelid)
 		{
@@ -840,8 +1116,7 @@ process_remote_insert(StringInfo s)
 	else
 	{
 		bdr_heap_close(rel, NoLock);
-		ExecResetTupleTable(estate->es_tupleTable, true);
-		FreeExecutorState(estate);
+		reset_apply_rel_state(state);
 	}
 
 	CommandCounterIncrement();
@@ -854,6 +1129,7 @@ static void
 process_remote_update(StringInfo s)
 {
 	char		action;
+	BDRApplyRelState *state;
 	EState	   *estate;
 	TupleTableSlot *newslot;
 	TupleTableSlot *oldslot;
@@ -861,7 +1137,6 @@ process_remote_update(StringInfo s)
 	bool		found_tuple;
 	BDRTupleData old_tuple;
 	BDRTupleData new_tuple;
-	Oid			idxoid;
 	BDRRelation	*rel;
 	Relation	idxrel;
 	ScanKeyData skey[INDEX_MAX_KEYS];
@@ -900,16 +1175,15 @@ process_remote_update(StringInfo s)
 		elog(ERROR, "expected action 'N' or 'K', got %c",
 			 action);
 
-	estate = bdr_create_rel_estate(rel->rel);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel->rel));
-	newslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(newslot, RelationGetDescr(rel->rel));
+	state = get_apply_rel_state(rel);
+	estate = state->estate;
+	oldslot = state->oldslot;
+	newslot = state->newslot;
 
 	if (action == 'K')
 	{
 		pkey_sent = true;
-		read_tuple_parts(s, rel, &old_tuple);
+		read_tuple_parts(s, rel, state, &old_tuple);
 		action = pq_getmsgbyte(s);
 	}
 	else
@@ -925,26 +1199,21 @@ process_remote_update(StringInfo s)
 			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
 
 	/* read new tuple */
-	read_tuple_parts(s, rel, &new_tuple);
+	read_tuple_parts(s, rel, state, &new_tuple);
 
-	/* lookup index to build scankey */
-	if (rel->rel->rd_indexvalid == 0)
-		RelationGetIndexList(rel->rel);
-	idxoid = rel->rel->rd_replidindex;
-	if (!OidIsValid(idxoid))
+	/* index to build scankey with, opened along with the others */
+	idxrel = state->idxrel;
+	if (idxrel == NULL)
 	{
 		elog(ERROR, "could not find primary key for table with oid %u",
 			 RelationGetRelid(rel->rel));
 		return;
 	}
 
-	/* open index, so we can build scan key for row */
-	idxrel = index_open(idxoid, RowExclusiveLock);
-
 	Assert(idxrel->rd_index->indisunique);
 
 	/* Use columns from the new tuple if the key didn't change. */
-	build_index_scan_key(skey, rel->rel, idxrel,
+	build_index_scan_key(skey, rel, idxrel,
 						 pkey_sent ? &old_tuple : &new_tuple);
 
 	PushActiveSnapshot(GetTransactionSnapshot());
@@ -1024,7 +1293,7 @@ process_remote_update(StringInfo s)
 			}
 
 			simple_heap_update(rel->rel, &oldslot->tts_tuple->t_self, newslot->tts_tuple);
-			UserTableUpdateIndexes(estate, newslot);
+			UserTableUpdateOpenIndexes(estate, newslot);
 			bdr_count_update();
 		}
 
@@ -1056,6 +1325,13 @@ process_remote_update(StringInfo s)
 		BdrApplyConflict *apply_conflict;
 		BdrConflictResolution resolution;
 
+		/*
+		 * Columns the upstream didn't send, unchanged toasted ones or with
+		 * changed_columns_only all unchanged ones, can't be filled in from a
+		 * local row here, so they're NULL in what conflict handlers and the
+		 * conflict log see. The docs on UPDATE/DELETE conflicts tell handler
+		 * authors so.
+		 */
 		remote_tuple = heap_form_tuple(RelationGetDescr(rel->rel),
 									   new_tuple.values,
 									   new_tuple.isnull);
@@ -1107,11 +1383,9 @@ process_remote_update(StringInfo s)
 	check_bdr_wakeups(rel);
 
 	/* release locks upon commit */
-	index_close(idxrel, NoLock);
 	bdr_heap_close(rel, NoLock);
 
-	ExecResetTupleTable(estate->es_tupleTable, true);
-	FreeExecutorState(estate);
+	reset_apply_rel_state(state);
 
 	CommandCounterIncrement();
 
@@ -1123,10 +1397,9 @@ static void
 process_remote_delete(StringInfo s)
 {
 	char		action;
-	EState	   *estate;
+	BDRApplyRelState *state;
 	BDRTupleData oldtup;
 	TupleTableSlot *oldslot;
-	Oid			idxoid;
 	BDRRelation	*rel;
 	Relation	idxrel;
 	ScanKeyData skey[INDEX_MAX_KEYS];
@@ -1171,26 +1444,20 @@ process_remote_delete(StringInfo s)
 		return;
 	}
 
-	estate = bdr_create_rel_estate(rel->rel);
-	oldslot = ExecInitExtraTupleSlot(estate);
-	ExecSetSlotDescriptor(oldslot, RelationGetDescr(rel->rel));
+	state = get_apply_rel_state(rel);
+	oldslot = state->oldslot;
 
-	read_tuple_parts(s, rel, &oldtup);
+	read_tuple_parts(s, rel, state, &oldtup);
 
-	/* lookup index to build scankey */
-	if (rel->rel->rd_indexvalid == 0)
-		RelationGetIndexList(rel->rel);
-	idxoid = rel->rel->rd_replidindex;
-	if (!OidIsValid(idxoid))
+	/* primary key index, opened along with the others */
+	idxrel = state->idxrel;
+	if (idxrel == NULL)
 	{
 		elog(ERROR, "could not find primary key for table with oid %u",
 			 RelationGetRelid(rel->rel));
 		return;
 	}
 
-	/* Now open the primary key index */
-	idxrel = index_open(idxoid, RowExclusiveLock);
-
 	if (rel->rel->rd_rel->relkind != RELKIND_RELATION)
 		elog(ERROR, "unexpected relkind '%c' rel \"%s\"",
 			 rel->rel->rd_rel->relkind, RelationGetRelationName(rel->rel));
@@ -1207,7 +1474,7 @@ process_remote_delete(StringInfo s)
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	build_index_scan_key(skey, rel->rel, idxrel, &oldtup);
+	build_index_scan_key(skey, rel, idxrel, &oldtup);
 
 	/* try to find tuple via a (candidate|primary) key */
 	found_old = find_pkey_tuple(skey, rel, idxrel, oldslot, true, LockTupleExclusive);
@@ -1281,11 +1548,9 @@ process_remote_delete(StringInfo s)
 
 	check_bdr_wakeups(rel);
 
-	index_close(idxrel, NoLock);
 	bdr_heap_close(rel, NoLock);
 
-	ExecResetTupleTable(estate->es_tupleTable, true);
-	FreeExecutorState(estate);
+	reset_apply_rel_state(state);
 
 	CommandCounterIncrement();
 
@@ -1504,6 +1769,60 @@ check_apply_update(BdrConflictType conflict_type,
 								  resolution);
 }
 
+/*
+ * Hand a message on an application channel to the handler for the channel,
+ * see bdr_messages.c.
+ *
+ * Transactional messages are handled in the transaction they arrived in, so
+ * that the handler's effects commit along with the transaction's changes.
+ * Others get a transaction of their own.
+ */
+static void
+process_remote_channel_message(const char *channel, bool transactional,
+							   StringInfo message)
+{
+	uint64		origin_sysid;
+	TimeLineID	origin_tlid;
+	Oid			origin_datid;
+	int			payload_len;
+	const char *payload;
+
+	/* not every message outside BDR's channel need come from bdr_send_message */
+	if (message->len - message->cursor < 8 + 4 + 4 + 4)
+	{
+		elog(LOG, "ignoring malformed message in channel %s", channel);
+		return;
+	}
+
+	origin_sysid = pq_getmsgint64(message);
+	origin_tlid = pq_getmsgint(message, 4);
+	origin_datid = pq_getmsgint(message, 4);
+	payload_len = pq_getmsgint(message, 4);
+	if (payload_len < 0 || payload_len != message->len - message->cursor)
+	{
+		elog(LOG, "ignoring malformed message in channel %s", channel);
+		return;
+	}
+	payload = pq_getmsgbytes(message, payload_len);
+
+	if (transactional)
+	{
+		bdr_performing_work();
+		/* handlers may run DDL on relations we hold open */
+		release_apply_rel_states();
+		bdr_dispatch_message(channel, origin_sysid, origin_tlid, origin_datid,
+							 true, payload, payload_len);
+	}
+	else
+	{
+		StartTransactionCommand();
+		bdr_dispatch_message(channel, origin_sysid, origin_tlid, origin_datid,
+							 false, payload, payload_len);
+		CommitTransactionCommand();
+		MemoryContextSwitchTo(MessageContext);
+	}
+}
+
 static void
 process_remote_message(StringInfo s)
 {
@@ -1529,10 +1848,13 @@ process_remote_message(StringInfo s)
 	chanlen = pq_getmsgint(&message, 4);
 	chan = pq_getmsgbytes(&message, chanlen);
 
-	if (strncmp(chan, "bdr", chanlen) != 0)
+	if (chanlen != 3 || strncmp(chan, "bdr", chanlen) != 0)
 	{
-		elog(LOG, "ignoring message in channel %s",
-			 pnstrdup(chan, chanlen));
+		process_remote_channel_message(pnstrdup(chan, chanlen),
+									   transactional, &message);
+
+		if (!transactional)
+			AdvanceCachedReplicationIdentifier(lsn, InvalidXLogRecPtr);
 		return;
 	}
 
@@ -2102,6 +2424,10 @@ bdr_performing_work(void)
 	started_transaction = true;
 	StartTransactionCommand();
 	MemoryContextSwitchTo(MessageContext);
+
+	if (bdr_is_parallel_apply_worker)
+		bdr_apply_parallel_xact_started();
+
 	return true;
 }
 
@@ -2115,7 +2441,8 @@ check_bdr_wakeups(BDRRelation *rel)
 		return;
 
 	/* has the node/connection state been changed on another system? */
-	if (reloid == BdrNodesRelid || reloid == BdrConnectionsRelid)
+	if (reloid == BdrNodesRelid || reloid == BdrConnectionsRelid ||
+		reloid == BdrNodeRelaysRelid)
 		bdr_connections_changed(NULL);
 
 	if (reloid == BdrSequenceValuesRelid ||
@@ -2125,171 +2452,486 @@ check_bdr_wakeups(BDRRelation *rel)
 }
 
 static void
-read_tuple_parts_error_badatts(BDRRelation *rel, TupleDesc desc, int rnatts)
+apply_rel_states_xact_callback(XactEvent event, void *arg)
 {
-	ereport(ERROR,
-			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-			 errmsg("remote tuple has different column count to local table"),
-			 errdetail("Table \"%s\".\"%s\" (oid %u) has %u columns on local node "BDR_LOCALID_FORMAT" vs %u on remote node "BDR_LOCALID_FORMAT,
-				 get_namespace_name(RelationGetNamespace(rel->rel)), RelationGetRelationName(rel->rel),
-				 RelationGetRelid(rel->rel),
-				 desc->natts,
-				 BDR_LOCALID_FORMAT_ARGS,
-				 rnatts,
-				 origin_sysid, origin_timeline, origin_dboid, EMPTY_REPLICATION_NAME),
-			 errhint("This error arises if the number of columns on two nodes differ. This is most commonly caused by unsafe use of the bdr.skip_ddl_replication and/or bdr.skip_ddl_locking settings.")));
+	if (event == XACT_EVENT_PRE_COMMIT)
+		release_apply_rel_states();
+	else if (event == XACT_EVENT_ABORT)
+	{
+		/* aborting released the relations and memory already */
+		apply_rel_states = NIL;
+		insert_batch_state = NULL;
+		insert_batch_tuples = NULL;
+		insert_batch_size = 0;
+		insert_batch_ntuples = 0;
+	}
 }
 
-static void
-read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
+/*
+ * Get the executor state to apply a change to 'rel' with, setting it up if
+ * this is the first change to the relation in the current transaction.
+ *
+ * Holding on to the indexes for the whole transaction is what the executor
+ * does for a statement, too; CREATE INDEX CONCURRENTLY waits for us before
+ * the new index needs maintaining. Replaying DDL, which might alter or drop
+ * the relation, requires calling release_apply_rel_states() first.
+ */
+static BDRApplyRelState *
+get_apply_rel_state(BDRRelation *rel)
 {
-	TupleDesc	desc = RelationGetDescr(rel->rel);
+	static bool callback_registered = false;
+	BDRApplyRelState *state;
+	ResultRelInfo *relinfo;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+	Oid			idxoid;
+	int			natts;
 	int			i;
-	int			rnatts;
-	char		action;
 
-	action = pq_getmsgbyte(s);
-
-	if (action != 'T')
-		elog(ERROR, "expected TUPLE, got %c", action);
+	foreach(lc, apply_rel_states)
+	{
+		state = lfirst(lc);
 
-	memset(tup->isnull, 1, sizeof(tup->isnull));
-	memset(tup->changed, 1, sizeof(tup->changed));
+		if (state->relid != RelationGetRelid(rel->rel))
+			continue;
 
-	rnatts = pq_getmsgint(s, 4);
+		/*
+		 * The slots pin the descriptor they were set up with. Should the
+		 * relation have changed nonetheless, start over.
+		 */
+		if (state->oldslot->tts_tupleDescriptor == RelationGetDescr(rel->rel))
+			return state;
 
-	/* FIXME: unaligned data accesses */
+		release_apply_rel_states();
+		break;
+	}
 
-	/* Consume remote data as long as there's a local column to put it in */
-	for (i = 0; i < Min(desc->natts, rnatts); i++)
+	if (!callback_registered)
 	{
-		Form_pg_attribute att = desc->attrs[i];
-		char		kind;
-		const char *data;
-		int			len;
+		RegisterXactCallback(apply_rel_states_xact_callback, NULL);
+		callback_registered = true;
+	}
 
-		kind = pq_getmsgbyte(s);
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
 
-		switch (kind)
-		{
-			case 'n': /* null */
-				/* already marked as null */
-				tup->values[i] = 0xdeadbeef;
-				break;
-			case 'u': /* unchanged column */
-				tup->isnull[i] = true;
-				tup->changed[i] = false;
-				tup->values[i] = 0xdeadbeef; /* make bad usage more obvious */
+	natts = RelationGetNumberOfAttributes(rel->rel);
 
-				break;
+	state = palloc0(sizeof(BDRApplyRelState));
+	state->relid = RelationGetRelid(rel->rel);
+	state->rel = heap_open(state->relid, NoLock);
+	state->estate = bdr_create_rel_estate(state->rel);
+	state->oldslot = ExecInitExtraTupleSlot(state->estate);
+	ExecSetSlotDescriptor(state->oldslot, RelationGetDescr(state->rel));
+	state->newslot = ExecInitExtraTupleSlot(state->estate);
+	ExecSetSlotDescriptor(state->newslot, RelationGetDescr(state->rel));
+	state->batchslot = ExecInitExtraTupleSlot(state->estate);
+	ExecSetSlotDescriptor(state->batchslot, RelationGetDescr(state->rel));
+	state->input_fns = palloc0(Max(natts, 1) * sizeof(FmgrInfo));
+	state->recv_fns = palloc0(Max(natts, 1) * sizeof(FmgrInfo));
 
-			case 'b': /* binary format */
-				tup->isnull[i] = false;
-				len = pq_getmsgint(s, 4); /* read length */
+	relinfo = state->estate->es_result_relation_info;
+	ExecOpenIndices(relinfo);
 
-				data = pq_getmsgbytes(s, len);
+	idxoid = bdr_replident_index(state->rel);
+	for (i = 0; i < relinfo->ri_NumIndices; i++)
+	{
+		if (RelationGetRelid(relinfo->ri_IndexRelationDescs[i]) == idxoid)
+			state->idxrel = relinfo->ri_IndexRelationDescs[i];
+	}
 
-				/* and data */
-				if (att->attbyval)
-					tup->values[i] = fetch_att(data, true, len);
-				else
-					tup->values[i] = PointerGetDatum(data);
-				break;
-			case 's': /* send/recv format */
-				{
-					Oid typreceive;
-					Oid typioparam;
-					StringInfoData buf;
-
-					tup->isnull[i] = false;
-					len = pq_getmsgint(s, 4); /* read length */
-
-					getTypeBinaryInputInfo(att->atttypid,
-										   &typreceive, &typioparam);
-
-					/* create StringInfo pointing into the bigger buffer */
-					initStringInfo(&buf);
-					/* and data */
-					buf.data = (char *) pq_getmsgbytes(s, len);
-					buf.len = len;
-					tup->values[i] = OidReceiveFunctionCall(
-						typreceive, &buf, typioparam, att->atttypmod);
-
-					if (buf.len != buf.cursor)
-						ereport(ERROR,
-								(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
-								 errmsg("incorrect binary data format")));
-					break;
-				}
-			case 't': /* text format */
-				{
-					Oid typinput;
-					Oid typioparam;
+	apply_rel_states = lappend(apply_rel_states, state);
 
-					tup->isnull[i] = false;
-					len = pq_getmsgint(s, 4); /* read length */
+	MemoryContextSwitchTo(oldcxt);
 
-					getTypeInputInfo(att->atttypid, &typinput, &typioparam);
-					/* and data */
-					data = (char *) pq_getmsgbytes(s, len);
-					tup->values[i] = OidInputFunctionCall(
-						typinput, (char *) data, typioparam, att->atttypmod);
-				}
-				break;
-			default:
-				elog(ERROR, "unknown column type '%c'", kind);
-		}
+	return state;
+}
 
-		if (att->attisdropped && !tup->isnull[i])
-			elog(ERROR, "data for dropped column");
+/*
+ * Release the executor state of all relations changes have been applied to in
+ * the current transaction.
+ */
+static void
+release_apply_rel_states(void)
+{
+	ListCell   *lc;
+
+	flush_insert_batch();
+
+	if (insert_batch_tuples != NULL)
+	{
+		pfree(insert_batch_tuples);
+		insert_batch_tuples = NULL;
+		insert_batch_size = 0;
 	}
 
-	/*
-	 * Handle some remote rows that are narrower than the local table. Hotfix
-	 * for RT#61148 and other schema de-sync issues; see RM#2814
-	 */
-	for (i = rnatts; i < desc->natts; i++)
+	foreach(lc, apply_rel_states)
 	{
-		Form_pg_attribute att = desc->attrs[i];
+		BDRApplyRelState *state = lfirst(lc);
+
+		ExecResetTupleTable(state->estate->es_tupleTable, true);
+		ExecCloseIndices(state->estate->es_result_relation_info);
+		FreeExecutorState(state->estate);
+		heap_close(state->rel, NoLock);
+		pfree(state->input_fns);
+		pfree(state->recv_fns);
+		pfree(state);
+	}
 
-		/*
-		 * If the remote-missing attribute(s) are locally dropped or nullable,
-		 * we can right-pad the local tuple with nulls. Attnos can never be
-		 * *inserted* in a Pg table only *appended* so this is ... fairly safe.
-		 * You could get in situations where the same attno meant something
-		 * different on different nodes, but you can do the same when the attno
-		 * count matches, so it's no worse doing the right padding than any
-		 * other time.
-		 */
-		if (!att->attisdropped && att->attnotnull)
-		{
-			/*
-			 * Theoretically we could fill DEFAULTs for NOT NULL local columns
-			 * here too, at least with bdr.ignore_mismatched_rows enabled. See
-			 * pglogical's `fill_missing_defaults` for how. But it's not meant
-			 * to be necessary anyway, so we don't. The user can recover by
-			 * ALTERing the table to be NULLable with a non-replicated DDL.
-			 */
-			elog(WARNING, "cannot right-pad mismatched attributes; attno %u is missing in remote data and local attribute is not-dropped and not nullable",
-				 i);
-			read_tuple_parts_error_badatts(rel, desc, rnatts);
-		}
+	list_free(apply_rel_states);
+	apply_rel_states = NIL;
+}
 
-		/*
-		 * Flag it null, and put some garbage in so we crash clearly if we
-		 * try to use it anyway.
-		 */
-		tup->isnull[i] = true;
-		tup->values[i] = 0xdeadbeef;
-	}
+/*
+ * Finish applying a change with 'state', getting it ready for the next one.
+ */
+static void
+reset_apply_rel_state(BDRApplyRelState *state)
+{
+	ExecClearTuple(state->oldslot);
+	ExecClearTuple(state->newslot);
+	ResetPerTupleExprContext(state->estate);
+}
 
-	/*
-	 * Discard trailing nulls on a too-wide remote tuple. See RM#2814.
-	 *
-	 * There are too many attributes in the incoming tuple. We can accept
-	 * this if we can confirm that the incoming attributes are all null,
-	 * since we're not discarding anything interesting then, and the outcome
-	 * will be the same when the missing col is added locally since we disallow
+/*
+ * Add the new row in state->newslot to the INSERTs to write out together,
+ * writing them out if the batch is full.
+ *
+ * The caller has to have made sure the batch is for the same relation and
+ * that the row doesn't conflict with a local one.
+ */
+static void
+queue_insert(BDRApplyRelState *state)
+{
+	MemoryContext oldcontext;
+
+	Assert(insert_batch_state == NULL || insert_batch_state == state);
+
+	if (insert_batch_tuples == NULL)
+	{
+		insert_batch_size = bdr_batch_inserts;
+		insert_batch_tuples = MemoryContextAlloc(TopTransactionContext,
+												 insert_batch_size * sizeof(HeapTuple));
+	}
+
+	/* the slot's tuple goes away after the change */
+	insert_batch_state = state;
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	insert_batch_tuples[insert_batch_ntuples++] =
+		ExecCopySlotTuple(state->newslot);
+	MemoryContextSwitchTo(oldcontext);
+
+	if (insert_batch_ntuples >= Min(insert_batch_size, bdr_batch_inserts))
+		flush_insert_batch();
+}
+
+/*
+ * Does a row in the batch of INSERTs have the key 'skey' of the unique index
+ * 'ii'? The SnapshotDirty search for conflicts doesn't find those, as they're
+ * not in the index yet.
+ */
+static bool
+insert_batch_has_key(IndexInfo *ii, ScanKey skey, TupleDesc desc)
+{
+	int			i;
+	int			attoff;
+
+	for (i = 0; i < insert_batch_ntuples; i++)
+	{
+		HeapTuple	tup = insert_batch_tuples[i];
+
+		for (attoff = 0; attoff < ii->ii_NumIndexAttrs; attoff++)
+		{
+			Datum		value;
+			bool		isnull;
+
+			value = heap_getattr(tup, ii->ii_KeyAttrNumbers[attoff], desc,
+								 &isnull);
+
+			if (isnull ||
+				!DatumGetBool(FunctionCall2Coll(&skey[attoff].sk_func,
+												skey[attoff].sk_collation,
+												value,
+												skey[attoff].sk_argument)))
+				break;
+		}
+
+		if (attoff == ii->ii_NumIndexAttrs)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Write out the batched INSERTs, with heap_multi_insert() and then the index
+ * entries for each row, as COPY does.
+ */
+static void
+flush_insert_batch(void)
+{
+	BDRApplyRelState *state = insert_batch_state;
+	TupleTableSlot *slot;
+	int			i;
+
+	if (insert_batch_ntuples == 0)
+		return;
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	heap_multi_insert(state->rel, insert_batch_tuples, insert_batch_ntuples,
+					  GetCurrentCommandId(true), 0, NULL);
+
+	slot = state->batchslot;
+	for (i = 0; i < insert_batch_ntuples; i++)
+	{
+		/* races will be resolved by abort/retry */
+		ExecStoreTuple(insert_batch_tuples[i], slot, InvalidBuffer, true);
+		UserTableUpdateOpenIndexes(state->estate, slot);
+		ExecClearTuple(slot);
+		ResetPerTupleExprContext(state->estate);
+	}
+
+	PopActiveSnapshot();
+
+	insert_batch_state = NULL;
+	insert_batch_ntuples = 0;
+
+	CommandCounterIncrement();
+}
+
+/*
+ * Look up the input or receive function of a column the first time a value
+ * in the respective format arrives for it. The lookups are kept with the
+ * relation until it's invalidated; the FmgrInfos only for the transaction,
+ * in 'state', as some input functions cache information about the type,
+ * e.g. domain constraints, that we wouldn't notice changing.
+ */
+static FmgrInfo *
+get_att_input_fn(BDRRelation *rel, BDRApplyRelState *state, int attoff,
+				 bool binary, Oid *typioparam)
+{
+	BDRAttInputPlan *attplan;
+	FmgrInfo   *fn;
+
+	if (rel->apply_att_input == NULL)
+		rel->apply_att_input =
+			MemoryContextAllocZero(bdr_apply_plan_context(rel),
+								   Max(RelationGetNumberOfAttributes(rel->rel), 1) *
+								   sizeof(BDRAttInputPlan));
+
+	attplan = &rel->apply_att_input[attoff];
+	fn = binary ? &state->recv_fns[attoff] : &state->input_fns[attoff];
+
+	if (OidIsValid(fn->fn_oid))
+	{
+		*typioparam = attplan->typioparam;
+		return fn;
+	}
+
+	if (binary && !OidIsValid(attplan->typreceive))
+		getTypeBinaryInputInfo(RelationGetDescr(rel->rel)->attrs[attoff]->atttypid,
+							   &attplan->typreceive, &attplan->typioparam);
+	else if (!binary && !OidIsValid(attplan->typinput))
+		getTypeInputInfo(RelationGetDescr(rel->rel)->attrs[attoff]->atttypid,
+						 &attplan->typinput, &attplan->typioparam);
+
+	fmgr_info_cxt(binary ? attplan->typreceive : attplan->typinput, fn,
+				  TopTransactionContext);
+
+	*typioparam = attplan->typioparam;
+	return fn;
+}
+
+static void
+read_tuple_parts_error_badatts(BDRRelation *rel, TupleDesc desc, int rnatts)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("remote tuple has different column count to local table"),
+			 errdetail("Table \"%s\".\"%s\" (oid %u) has %u columns on local node "BDR_LOCALID_FORMAT" vs %u on remote node "BDR_LOCALID_FORMAT,
+				 get_namespace_name(RelationGetNamespace(rel->rel)), RelationGetRelationName(rel->rel),
+				 RelationGetRelid(rel->rel),
+				 desc->natts,
+				 BDR_LOCALID_FORMAT_ARGS,
+				 rnatts,
+				 origin_sysid, origin_timeline, origin_dboid, EMPTY_REPLICATION_NAME),
+			 errhint("This error arises if the number of columns on two nodes differ. This is most commonly caused by unsafe use of the bdr.skip_ddl_replication and/or bdr.skip_ddl_locking settings.")));
+}
+
+/*
+ * Convert a column value sent in binary, send/recv or text format to a value
+ * of the local column.
+ */
+static Datum
+input_column_value(BDRRelation *rel, BDRApplyRelState *state, int attoff,
+				   char kind, const char *data, int len)
+{
+	Form_pg_attribute att = RelationGetDescr(rel->rel)->attrs[attoff];
+	Datum		value;
+
+	switch (kind)
+	{
+		case 'b': /* binary format */
+			if (att->attbyval)
+				value = fetch_att(data, true, len);
+			else
+				value = PointerGetDatum(data);
+			break;
+		case 's': /* send/recv format */
+			{
+				FmgrInfo *typreceive;
+				Oid typioparam;
+				StringInfoData buf;
+
+				typreceive = get_att_input_fn(rel, state, attoff, true,
+											  &typioparam);
+
+				/* create StringInfo pointing into the bigger buffer */
+				initStringInfo(&buf);
+				buf.data = (char *) data;
+				buf.len = len;
+				value = ReceiveFunctionCall(
+					typreceive, &buf, typioparam, att->atttypmod);
+
+				if (buf.len != buf.cursor)
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							 errmsg("incorrect binary data format")));
+				break;
+			}
+		case 't': /* text format */
+			{
+				FmgrInfo *typinput;
+				Oid typioparam;
+
+				typinput = get_att_input_fn(rel, state, attoff, false,
+											&typioparam);
+				value = InputFunctionCall(
+					typinput, (char *) data, typioparam, att->atttypmod);
+				break;
+			}
+		default:
+			elog(ERROR, "unknown column type '%c'", kind);
+	}
+
+	return value;
+}
+
+static void
+read_tuple_parts(StringInfo s, BDRRelation *rel, BDRApplyRelState *state,
+				 BDRTupleData *tup)
+{
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	int			i;
+	int			rnatts;
+	char		action;
+
+	action = pq_getmsgbyte(s);
+
+	if (action != 'T')
+		elog(ERROR, "expected TUPLE, got %c", action);
+
+	memset(tup->isnull, 1, sizeof(tup->isnull));
+	memset(tup->changed, 1, sizeof(tup->changed));
+
+	rnatts = pq_getmsgint(s, 4);
+
+	/* FIXME: unaligned data accesses */
+
+	/* Consume remote data as long as there's a local column to put it in */
+	for (i = 0; i < Min(desc->natts, rnatts); i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+		char		kind;
+		const char *data;
+		int			len;
+
+		kind = pq_getmsgbyte(s);
+
+		switch (kind)
+		{
+			case 'n': /* null */
+				/* already marked as null */
+				tup->values[i] = 0xdeadbeef;
+				break;
+			case 'u': /* unchanged column */
+				tup->isnull[i] = true;
+				tup->changed[i] = false;
+				tup->values[i] = 0xdeadbeef; /* make bad usage more obvious */
+
+				break;
+
+			case 'c': /* binary format, sent in chunks before */
+				tup->isnull[i] = false;
+				len = pq_getmsgint(s, 4); /* read length */
+
+				tup->values[i] = bdr_next_chunked_value(len);
+				break;
+			case 'b': /* binary format */
+			case 's': /* send/recv format */
+			case 't': /* text format */
+				tup->isnull[i] = false;
+				len = pq_getmsgint(s, 4); /* read length */
+
+				/* and data */
+				data = pq_getmsgbytes(s, len);
+				tup->values[i] = input_column_value(rel, state, i, kind,
+													data, len);
+				break;
+			default:
+				elog(ERROR, "unknown column type '%c'", kind);
+		}
+
+		if (att->attisdropped && !tup->isnull[i])
+			elog(ERROR, "data for dropped column");
+	}
+
+	/*
+	 * Handle some remote rows that are narrower than the local table. Hotfix
+	 * for RT#61148 and other schema de-sync issues; see RM#2814
+	 */
+	for (i = rnatts; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+
+		/*
+		 * If the remote-missing attribute(s) are locally dropped or nullable,
+		 * we can right-pad the local tuple with nulls. Attnos can never be
+		 * *inserted* in a Pg table only *appended* so this is ... fairly safe.
+		 * You could get in situations where the same attno meant something
+		 * different on different nodes, but you can do the same when the attno
+		 * count matches, so it's no worse doing the right padding than any
+		 * other time.
+		 */
+		if (!att->attisdropped && att->attnotnull)
+		{
+			/*
+			 * Theoretically we could fill DEFAULTs for NOT NULL local columns
+			 * here too, at least with bdr.ignore_mismatched_rows enabled. See
+			 * pglogical's `fill_missing_defaults` for how. But it's not meant
+			 * to be necessary anyway, so we don't. The user can recover by
+			 * ALTERing the table to be NULLable with a non-replicated DDL.
+			 */
+			elog(WARNING, "cannot right-pad mismatched attributes; attno %u is missing in remote data and local attribute is not-dropped and not nullable",
+				 i);
+			read_tuple_parts_error_badatts(rel, desc, rnatts);
+		}
+
+		/*
+		 * Flag it null, and put some garbage in so we crash clearly if we
+		 * try to use it anyway.
+		 */
+		tup->isnull[i] = true;
+		tup->values[i] = 0xdeadbeef;
+	}
+
+	/*
+	 * Discard trailing nulls on a too-wide remote tuple. See RM#2814.
+	 *
+	 * There are too many attributes in the incoming tuple. We can accept
+	 * this if we can confirm that the incoming attributes are all null,
+	 * since we're not discarding anything interesting then, and the outcome
+	 * will be the same when the missing col is added locally since we disallow
 	 * table rewrites like ALTER TABLE ... ADD COLUMN ... DEFAULT .
 	 *
 	 * Note that there's no storage for this attribute in 'tup' since it's only
@@ -2300,385 +2942,1394 @@ read_tuple_parts(StringInfo s, BDRRelation *rel, BDRTupleData *tup)
 	{
 		char		kind;
 
-		kind = pq_getmsgbyte(s);
-		if (kind != 'n' && bdr_discard_mismatched_row_attributes)
+		kind = pq_getmsgbyte(s);
+		if (kind != 'n' && bdr_discard_mismatched_row_attributes)
+		{
+			/*
+			 * User has overridden behaviour and forced discarding of row data.
+			 * This can be useful to recover from broken replication, but it's
+			 * a bad idea since it results in divergence on these values.
+			 *
+			 * LOG is stronger than WARNING for server log and this is
+			 * important to record. Log flooding could be an issue, but this
+			 * shouldn't be used anyway, and we really want to be able to
+			 * diagnose it.
+			 */
+			elog(LOG, "WARNING: discarding non-null remote value for attribute %u on relation \"%s\".\"%s\" (%u) due to bdr.discard_mismatched_row_attributes setting. Remote natts = %u, local natts = %u",
+				 i, get_namespace_name(RelationGetNamespace(rel->rel)),
+				 RelationGetRelationName(rel->rel), RelationGetRelid(rel->rel),
+				 rnatts, desc->natts);
+		}
+		else if (kind != 'n')
+		{
+			elog(WARNING, "cannot right-pad mismatched attributes; attno %u is missing in local table and remote row has non-null, non-dropped value for this attribute",
+				 i);
+			read_tuple_parts_error_badatts(rel, desc, rnatts);
+		}
+	}
+
+	/* Don't test pq_getmsgend, there might be another message chunk */
+}
+
+/*
+ * Relcache invalidation callback for the relation dictionary.
+ *
+ * Forget the local relation any remote relation has been resolved to if the
+ * local relation changed, it might since have been renamed or dropped. The
+ * next change for it will look it up by name again.
+ */
+static void
+bdr_remote_relation_inval_cb(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	BDRRemoteRelation *entry;
+
+	if (BDRRemoteRelHash == NULL)
+		return;
+
+	hash_seq_init(&status, BDRRemoteRelHash);
+
+	while ((entry = (BDRRemoteRelation *) hash_seq_search(&status)) != NULL)
+	{
+		if (relid == InvalidOid || entry->local_relid == relid)
+			entry->local_relid = InvalidOid;
+	}
+}
+
+/*
+ * Handle a relation metadata message, remembering which name the upstream
+ * relation id refers to for subsequent changes.
+ *
+ * Can be sent at any time, also outside of transactions. The upstream sends
+ * it again whenever the relation changed on its side, so it replaces
+ * whatever we knew about the id before.
+ */
+static void
+process_remote_relation(StringInfo s)
+{
+	uint32		remote_relid;
+	int			nspnamelen;
+	const char *nspname;
+	int			relnamelen;
+	const char *relname;
+	BDRRemoteRelation *entry;
+	bool		found;
+
+	if (!apply_relation_dictionary)
+		elog(ERROR, "unexpected relation metadata message, relation dictionary has not been requested");
+
+	remote_relid = pq_getmsgint(s, 4);
+
+	nspnamelen = pq_getmsgint(s, 2);
+	nspname = pq_getmsgbytes(s, nspnamelen);
+
+	relnamelen = pq_getmsgint(s, 2);
+	relname = pq_getmsgbytes(s, relnamelen);
+
+	if (BDRRemoteRelHash == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(BDRRemoteRelation);
+		ctl.hash = oid_hash;
+		ctl.hcxt = TopMemoryContext;
+
+		BDRRemoteRelHash = hash_create("BDR remote relation dictionary", 128,
+									   &ctl,
+									   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(bdr_remote_relation_inval_cb,
+									  (Datum) 0);
+	}
+
+	entry = hash_search(BDRRemoteRelHash, &remote_relid, HASH_ENTER, &found);
+
+	if (found)
+	{
+		pfree(entry->nspname);
+		pfree(entry->relname);
+	}
+
+	entry->nspname = MemoryContextStrdup(TopMemoryContext, nspname);
+	entry->relname = MemoryContextStrdup(TopMemoryContext, relname);
+	entry->local_relid = InvalidOid;
+
+	elog(DEBUG2, "upstream relation %u is %s.%s",
+		 remote_relid, entry->nspname, entry->relname);
+}
+
+/*
+ * Build a relation metadata message ('R'), as the upstream sends it, for each
+ * entry of the relation dictionary. Returns a list of StringInfos, allocated
+ * in the current memory context.
+ *
+ * The upstream only sends the metadata of a relation once per session, so
+ * parallel apply workers started after that need to be told what it sent.
+ */
+List *
+bdr_remote_relation_messages(void)
+{
+	HASH_SEQ_STATUS status;
+	BDRRemoteRelation *entry;
+	List	   *msgs = NIL;
+
+	if (BDRRemoteRelHash == NULL)
+		return NIL;
+
+	hash_seq_init(&status, BDRRemoteRelHash);
+
+	while ((entry = (BDRRemoteRelation *) hash_seq_search(&status)) != NULL)
+	{
+		StringInfo	msg = makeStringInfo();
+		int			nspnamelen = strlen(entry->nspname) + 1;
+		int			relnamelen = strlen(entry->relname) + 1;
+
+		pq_sendbyte(msg, 'R');
+		pq_sendint(msg, entry->remote_relid, 4);
+		pq_sendint(msg, nspnamelen, 2);
+		appendBinaryStringInfo(msg, entry->nspname, nspnamelen);
+		pq_sendint(msg, relnamelen, 2);
+		appendBinaryStringInfo(msg, entry->relname, relnamelen);
+
+		msgs = lappend(msgs, msg);
+	}
+
+	return msgs;
+}
+
+/*
+ * Handle a chunk of a large column value ('V').
+ *
+ * The upstream sends values larger than bdr.value_chunk_size in several
+ * messages ahead of the change they belong to, so neither side has to hold
+ * the whole change in one buffer. The chunks are copied into a buffer of the
+ * value's full size, allocated once with the first chunk; the change then
+ * refers to the completed values in order, see read_tuple_parts().
+ */
+static void
+process_remote_value_chunk(StringInfo s)
+{
+	BDRChunkedValue *value = NULL;
+	MemoryContext oldcontext;
+	uint32		len;
+	uint32		chunklen;
+
+	if (!apply_value_chunks)
+		elog(ERROR, "unexpected value chunk, chunked values have not been requested");
+
+	len = pq_getmsgint(s, 4);
+	chunklen = pq_getmsgint(s, 4);
+
+	if (ValueChunkContext == NULL)
+		ValueChunkContext = AllocSetContextCreate(TopMemoryContext,
+												  "BDR value chunks",
+												  ALLOCSET_DEFAULT_MINSIZE,
+												  ALLOCSET_DEFAULT_INITSIZE,
+												  ALLOCSET_DEFAULT_MAXSIZE);
+
+	oldcontext = MemoryContextSwitchTo(ValueChunkContext);
+
+	/* continue the last value unless that's complete */
+	if (apply_chunked_values != NIL)
+	{
+		value = llast(apply_chunked_values);
+		if (value->received == value->len)
+			value = NULL;
+	}
+
+	if (value == NULL)
+	{
+		if (len == 0 || !AllocSizeIsValid(len))
+			elog(ERROR, "invalid chunked value length %u", len);
+
+		value = palloc(sizeof(BDRChunkedValue));
+		value->data = palloc(len);
+		value->len = len;
+		value->received = 0;
+		apply_chunked_values = lappend(apply_chunked_values, value);
+	}
+	else if (value->len != len)
+		elog(ERROR, "value chunk for a value of length %u, expected %zu",
+			 len, value->len);
+
+	if (chunklen > value->len - value->received)
+		elog(ERROR, "value chunk of length %u exceeds the remaining %zu bytes of the value",
+			 chunklen, value->len - value->received);
+
+	memcpy(value->data + value->received, pq_getmsgbytes(s, chunklen),
+		   chunklen);
+	value->received += chunklen;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Return the next chunked value for a column marked as such ('c'),
+ * verifying that it's been received completely.
+ */
+static Datum
+bdr_next_chunked_value(int len)
+{
+	BDRChunkedValue *value;
+
+	if (apply_chunked_next >= list_length(apply_chunked_values))
+		elog(ERROR, "no chunked value received for column");
+
+	value = list_nth(apply_chunked_values, apply_chunked_next++);
+
+	if (value->received != value->len || value->len != len)
+		elog(ERROR, "chunked value has length %zu of %zu received, expected %d",
+			 value->received, value->len, len);
+
+	return PointerGetDatum(value->data);
+}
+
+/*
+ * Read the name of the relation a change refers to, without looking up the
+ * local relation. Used by the dispatcher of parallel apply, which looks at
+ * the changes before handing them on.
+ */
+void
+bdr_read_remote_relation(StringInfo s, const char **nspname,
+						 const char **relname)
+{
+	int			relnamelen;
+	int			nspnamelen;
+
+	if (apply_relation_dictionary)
+	{
+		uint32		remote_relid = pq_getmsgint(s, 4);
+		BDRRemoteRelation *entry = NULL;
+
+		if (BDRRemoteRelHash != NULL)
+			entry = hash_search(BDRRemoteRelHash, &remote_relid,
+								HASH_FIND, NULL);
+		if (entry == NULL)
+			elog(ERROR, "change for unknown upstream relation %u",
+				 remote_relid);
+
+		*nspname = entry->nspname;
+		*relname = entry->relname;
+	}
+	else
+	{
+		nspnamelen = pq_getmsgint(s, 2);
+		*nspname = pq_getmsgbytes(s, nspnamelen);
+
+		relnamelen = pq_getmsgint(s, 2);
+		*relname = pq_getmsgbytes(s, relnamelen);
+	}
+}
+
+/*
+ * Look up and lock the local relation a change refers to.
+ *
+ * With the relation dictionary only the upstream's id for the relation is
+ * sent. Once we've resolved that to a local relation we just need to lock
+ * it; the name lookup is only repeated after the local relation has been
+ * invalidated.
+ */
+static BDRRelation *
+read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg)
+{
+	int			relnamelen;
+	int			nspnamelen;
+	RangeVar*	rv;
+	Oid			relid;
+	BDRRemoteRelation *entry = NULL;
+
+	rv = makeNode(RangeVar);
+
+	if (apply_relation_dictionary)
+	{
+		uint32		remote_relid = pq_getmsgint(s, 4);
+
+		if (BDRRemoteRelHash != NULL)
+			entry = hash_search(BDRRemoteRelHash, &remote_relid,
+								HASH_FIND, NULL);
+		if (entry == NULL)
+			elog(ERROR, "change for unknown upstream relation %u",
+				 remote_relid);
+
+		rv->schemaname = entry->nspname;
+		rv->relname = entry->relname;
+	}
+	else
+	{
+		nspnamelen = pq_getmsgint(s, 2);
+		rv->schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
+
+		relnamelen = pq_getmsgint(s, 2);
+		rv->relname = (char *) pq_getmsgbytes(s, relnamelen);
+	}
+
+	cbarg->remote_nspname = rv->schemaname;
+	cbarg->remote_relname = rv->relname;
+
+	relid = InvalidOid;
+
+	if (entry != NULL && OidIsValid(entry->local_relid))
+	{
+		relid = entry->local_relid;
+
+		/*
+		 * Acquiring the lock processes pending invalidations. If the relation
+		 * has been changed concurrently our inval callback has reset the
+		 * entry and we need to look it up by name after all.
+		 */
+		LockRelationOid(relid, mode);
+		if (entry->local_relid != relid)
+		{
+			UnlockRelationOid(relid, mode);
+			relid = InvalidOid;
+		}
+	}
+
+	if (!OidIsValid(relid))
+	{
+		relid = RangeVarGetRelidExtended(rv, mode, false, false, NULL, NULL);
+
+		if (entry != NULL)
+			entry->local_relid = relid;
+	}
+
+	/*
+	 * Acquire sequencer lock if any of the sequencer relations are
+	 * modified. We used to rely on relation locks, but that had problems with
+	 * deadlocks and interrupting auto-analyze/vacuum.
+	 */
+	if (relid == BdrSequenceValuesRelid ||
+		relid == BdrSequenceElectionsRelid ||
+		relid == BdrVotesRelid)
+		bdr_sequencer_lock();
+
+	return bdr_heap_open(relid, NoLock);
+}
+
+/*
+ * Read a remote action type and process the action record.
+ *
+ * May set got_SIGTERM to stop processing before next record.
+ *
+ * Returns the action processed.
+ */
+char
+bdr_process_remote_action(StringInfo s)
+{
+	char action = pq_getmsgbyte(s);
+	Assert(CurrentMemoryContext == MessageContext);
+
+	/* anything but more INSERTs ends a batch of them */
+	if (action != 'I' && action != 'V')
+		flush_insert_batch();
+
+	switch (action)
+	{
+			/* BEGIN */
+		case 'B':
+			process_remote_begin(s);
+			break;
+			/* COMMIT */
+		case 'C':
+			process_remote_commit(s);
+			break;
+			/* INSERT */
+		case 'I':
+			process_remote_insert(s);
+			break;
+			/* UPDATE */
+		case 'U':
+			process_remote_update(s);
+			break;
+			/* DELETE */
+		case 'D':
+			process_remote_delete(s);
+			break;
+		case 'M':
+			process_remote_message(s);
+			break;
+			/* relation metadata */
+		case 'R':
+			process_remote_relation(s);
+			break;
+			/* chunk of a large value */
+		case 'V':
+			process_remote_value_chunk(s);
+			break;
+		default:
+			elog(ERROR, "unknown action of type %c", action);
+	}
+	Assert(CurrentMemoryContext == MessageContext);
+
+	/* chunked values are only valid for the change following them */
+	if (ValueChunkContext != NULL && action != 'V' &&
+		apply_chunked_values != NIL)
+	{
+		apply_chunked_values = NIL;
+		apply_chunked_next = 0;
+		MemoryContextReset(ValueChunkContext);
+	}
+
+	return action;
+}
+
+/*
+ * Apply a remote action, or hand it to a parallel apply worker.
+ */
+static char
+bdr_handle_remote_action(StringInfo s)
+{
+	if (apply_parallel)
+		return bdr_apply_parallel_dispatch(s);
+
+	return bdr_process_remote_action(s);
+}
+
+/*
+ * Process the payload of a CopyData message from the upstream.
+ *
+ * That's normally a single action, but it may be compressed ('Z') and/or a
+ * batch of several actions ('P'), see bdr_write() in bdr_output.c.
+ */
+static void
+bdr_process_remote_frame(StringInfo s)
+{
+	StringInfoData raw;
+	bool		committed = false;
+
+	if (s->cursor < s->len && s->data[s->cursor] == 'Z')
+	{
+		pq_getmsgbyte(s);
+		bdr_decompress_action(s, &raw);
+		s = &raw;
+	}
+
+	if (s->cursor < s->len && s->data[s->cursor] == 'P')
+	{
+		uint32		nmsgs;
+		uint32		i;
+
+		if (!apply_batch_messages)
+			elog(ERROR, "unexpected batch of messages, batching has not been requested");
+
+		pq_getmsgbyte(s);
+		nmsgs = pq_getmsgint(s, 4);
+
+		for (i = 0; i < nmsgs; i++)
+		{
+			StringInfoData msg;
+
+			msg.len = pq_getmsgint(s, 4);
+			msg.data = (char *) pq_getmsgbytes(s, msg.len);
+			msg.maxlen = -1;
+			msg.cursor = 0;
+
+			if (bdr_handle_remote_action(&msg) == 'C')
+				committed = true;
+		}
+	}
+	else if (bdr_handle_remote_action(s) == 'C')
+		committed = true;
+
+	if (committed)
+	{
+		/*
+		 * We clobber MessageContext on commit. It doesn't matter much when we
+		 * do it so long as we do so periodically, to prevent the context from
+		 * growing too much.
+		 */
+		MemoryContextReset(MessageContext);
+	}
+}
+
+
+/*
+ * Decompress a compressed message ('Z') into 'out', so its contents can be
+ * processed like an uncompressed message.
+ *
+ * See compress_message() in bdr_output.c for the format.
+ */
+static void
+bdr_decompress_action(StringInfo s, StringInfo out)
+{
+#ifdef HAVE_LIBZ
+	int			rawlen;
+	int			ret;
+
+	if (apply_compression != BDR_COMPRESSION_ZLIB)
+		elog(ERROR, "unexpected compressed message, compression has not been requested");
+
+	rawlen = pq_getmsgint(s, 4);
+
+	if (apply_zstream == NULL)
+	{
+		apply_zstream = MemoryContextAllocZero(TopMemoryContext,
+											   sizeof(z_stream));
+		if (inflateInit(apply_zstream) != Z_OK)
+			elog(ERROR, "could not initialize decompression: %s",
+				 apply_zstream->msg ? apply_zstream->msg : "unknown error");
+	}
+
+	/* leave room for more than the expected data, to detect bogus input */
+	initStringInfo(out);
+	enlargeStringInfo(out, rawlen + 1);
+
+	apply_zstream->next_in = (Bytef *) s->data + s->cursor;
+	apply_zstream->avail_in = s->len - s->cursor;
+	apply_zstream->next_out = (Bytef *) out->data;
+	apply_zstream->avail_out = rawlen + 1;
+
+	ret = inflate(apply_zstream, Z_SYNC_FLUSH);
+	if (ret != Z_OK)
+		elog(ERROR, "could not decompress data: %s",
+			 apply_zstream->msg ? apply_zstream->msg : "unknown error");
+
+	out->len = (char *) apply_zstream->next_out - out->data;
+	out->data[out->len] = '\0';
+
+	if (out->len != rawlen || apply_zstream->avail_in != 0)
+		elog(ERROR, "compressed message of %d bytes decompressed to %d bytes with %u bytes left",
+			 rawlen, out->len, apply_zstream->avail_in);
+
+	s->cursor = s->len;
+#else
+	elog(ERROR, "unexpected compressed message, compression is not supported");
+#endif
+}
+
+/*
+ * Converts an int64 to network byte order.
+ */
+static void
+bdr_sendint64(int64 i, char *buf)
+{
+	uint32		n32;
+
+	/* High order half first, since we're doing MSB-first */
+	n32 = (uint32) (i >> 32);
+	n32 = htonl(n32);
+	memcpy(&buf[0], &n32, 4);
+
+	/* Now the low order half */
+	n32 = (uint32) i;
+	n32 = htonl(n32);
+	memcpy(&buf[4], &n32, 4);
+}
+
+/*
+ * Associate the end of a remote commit with the end of the local commit
+ * record, see bdr_get_flush_position().
+ */
+static void
+bdr_push_flush_position(XLogRecPtr remote_end, XLogRecPtr local_end)
+{
+	BdrFlushPosition *flushpos;
+
+	flushpos = (BdrFlushPosition *)
+		MemoryContextAlloc(TopMemoryContext, sizeof(BdrFlushPosition));
+	flushpos->local_end = local_end;
+	flushpos->remote_end = remote_end;
+
+	dlist_push_tail(&bdr_lsn_association, &flushpos->node);
+}
+
+/*
+ * Figure out which write/flush positions to report to the walsender process.
+ *
+ * We can't simply report back the last LSN the walsender sent us because the
+ * local transaction might not yet be flushed to disk locally. Instead we
+ * build a list that associates local with remote LSNs for every commit. When
+ * reporting back the flush position to the sender we iterate that list and
+ * check which entries on it are already locally flushed. Those we can report
+ * as having been flushed.
+ *
+ * Returns true if there's no outstanding transactions that need to be
+ * flushed.
+ */
+static bool
+bdr_get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
+{
+	dlist_mutable_iter iter;
+	XLogRecPtr	local_flush = GetFlushRecPtr();
+	XLogRecPtr	remote_end;
+	XLogRecPtr	local_end;
+
+	*write = InvalidXLogRecPtr;
+	*flush = InvalidXLogRecPtr;
+
+	/* parallel apply workers commit on our behalf */
+	if (apply_parallel && bdr_apply_parallel_progress(&remote_end, &local_end))
+		bdr_push_flush_position(remote_end, local_end);
+
+	dlist_foreach_modify(iter, &bdr_lsn_association)
+	{
+		BdrFlushPosition *pos =
+			dlist_container(BdrFlushPosition, node, iter.cur);
+
+		*write = pos->remote_end;
+
+		if (pos->local_end <= local_flush)
+		{
+			*flush = pos->remote_end;
+			dlist_delete(iter.cur);
+			pfree(pos);
+		}
+		else
+		{
+			/*
+			 * Don't want to uselessly iterate over the rest of the list which
+			 * could potentially be long. Instead get the last element and
+			 * grab the write position from there.
+			 */
+			pos = dlist_tail_element(BdrFlushPosition, node,
+									 &bdr_lsn_association);
+			*write = pos->remote_end;
+			return false;
+		}
+	}
+
+	/* transactions still being applied in parallel aren't on the list yet */
+	if (apply_parallel && bdr_apply_parallel_pending())
+		return false;
+
+	/* nor those only received so far */
+	if (!dlist_is_empty(&bdr_receive_queue))
+		return false;
+
+	return dlist_is_empty(&bdr_lsn_association);
+}
+
+/*
+ * Send a Standby Status Update message to server.
+ *
+ * 'recvpos' is the latest LSN we've received data to, force is set if we need
+ * to send a response to avoid timeouts.
+ */
+static bool
+bdr_send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
+{
+	char		replybuf[1 + 8 + 8 + 8 + 8 + 1];
+	int			len = 0;
+
+	static XLogRecPtr last_recvpos = InvalidXLogRecPtr;
+	static XLogRecPtr last_writepos = InvalidXLogRecPtr;
+	static XLogRecPtr last_flushpos = InvalidXLogRecPtr;
+
+	XLogRecPtr writepos;
+	XLogRecPtr flushpos;
+
+	/* It's legal to not pass a recvpos */
+	if (recvpos < last_recvpos)
+		recvpos = last_recvpos;
+
+	if (bdr_get_flush_position(&writepos, &flushpos))
+	{
+		/*
+		 * No outstanding transactions to flush, we can report the latest
+		 * received position. This is important for synchronous replication.
+		 */
+		flushpos = writepos = recvpos;
+	}
+
+	if (writepos < last_writepos)
+		writepos = last_writepos;
+
+	if (flushpos < last_flushpos)
+		flushpos = last_flushpos;
+
+	/* if we've already reported everything we're good */
+	if (!force &&
+		writepos == last_writepos &&
+		flushpos == last_flushpos)
+		return true;
+
+	replybuf[len] = 'r';
+	len += 1;
+	bdr_sendint64(recvpos, &replybuf[len]);			/* write */
+	len += 8;
+	bdr_sendint64(flushpos, &replybuf[len]);		/* flush */
+	len += 8;
+	bdr_sendint64(writepos, &replybuf[len]);		/* apply */
+	len += 8;
+	bdr_sendint64(now, &replybuf[len]);				/* sendTime */
+	len += 8;
+	replybuf[len] = false;							/* replyRequested */
+	len += 1;
+
+	elog(DEBUG2, "sending feedback (force %d) to recv %X/%X, write %X/%X, flush %X/%X",
+		 force,
+		 (uint32) (recvpos >> 32), (uint32) recvpos,
+		 (uint32) (writepos >> 32), (uint32) writepos,
+		 (uint32) (flushpos >> 32), (uint32) flushpos
+		);
+
+
+	if (PQputCopyData(conn, replybuf, len) <= 0 || PQflush(conn))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not send feedback packet: %s",
+						PQerrorMessage(conn))));
+		return false;
+	}
+
+	if (recvpos > last_recvpos)
+		last_recvpos = recvpos;
+	if (writepos > last_writepos)
+		last_writepos = writepos;
+	if (flushpos > last_flushpos)
+		last_flushpos = flushpos;
+
+	return true;
+}
+
+/*
+ * abs_timestamp_difference -- convert the difference between two timestamps
+ *		into integer seconds and microseconds
+ *
+ * The result is always the absolute (pozitive difference), so the order
+ * of input is not important.
+ *
+ * If either input is not finite, we return zeroes.
+ */
+static void
+abs_timestamp_difference(TimestampTz start_time, TimestampTz stop_time,
+					long *secs, int *microsecs)
+{
+	if (TIMESTAMP_NOT_FINITE(start_time) || TIMESTAMP_NOT_FINITE(stop_time))
+	{
+		*secs = 0;
+		*microsecs = 0;
+	}
+	else
+	{
+		TimestampTz diff = abs(stop_time - start_time);
+#ifdef HAVE_INT64_TIMESTAMP
+		*secs = (long) (diff / USECS_PER_SEC);
+		*microsecs = (int) (diff % USECS_PER_SEC);
+#else
+		*secs = (long) diff;
+		*microsecs = (int) ((diff - *secs) * 1000000.0);
+#endif
+	}
+}
+
+#if defined(VERBOSE_INSERT) || defined(VERBOSE_UPDATE) || defined(VERBOSE_DELETE)
+static void
+log_tuple(const char *format, TupleDesc desc, HeapTuple tup)
+{
+	StringInfoData o;
+
+	initStringInfo(&o);
+	tuple_to_stringinfo(&o, desc, tup);
+	elog(DEBUG1, format, o.data);
+	resetStringInfo(&o);
+
+}
+#endif
+
+/*
+ * Read the configuration of the connection we're applying changes from.
+ */
+static BdrConnectionConfig *
+bdr_apply_load_config(void)
+{
+	BdrConnectionConfig *new_apply_config;
+
+	/* Fetch our config from the DB */
+	new_apply_config = bdr_get_connection_config(
+		bdr_apply_worker->remote_sysid,
+		bdr_apply_worker->remote_timeline,
+		bdr_apply_worker->remote_dboid,
+		false);
+
+	Assert(new_apply_config->sysid == bdr_apply_worker->remote_sysid &&
+		   new_apply_config->timeline == bdr_apply_worker->remote_timeline &&
+		   new_apply_config->dboid == bdr_apply_worker->remote_dboid);
+
+	/*
+	 * Got default remote connection info, read also local defaults.
+	 * Otherwise we would be using replication sets and apply delay from the
+	 * remote node instead of the local one.
+	 *
+	 * Note: this is slightly hacky and we should probably use the bdr_nodes
+	 * for this instead.
+	 */
+	if (!new_apply_config->origin_is_my_id)
+	{
+		BdrConnectionConfig *cfg =
+			bdr_get_connection_config(GetSystemIdentifier(), ThisTimeLineID,
+									  MyDatabaseId, false);
+
+		new_apply_config->apply_delay = cfg->apply_delay;
+		pfree(new_apply_config->replication_sets);
+		new_apply_config->replication_sets = pstrdup(cfg->replication_sets);
+		bdr_free_connection_config(cfg);
+	}
+
+	return new_apply_config;
+}
+
+/*
+ * When the apply worker's latch is set it reloads its configuration
+ * from the database, checking for new replication sets, connection
+ * strings, etc.
+ *
+ * At this time many changes simply force the apply worker to exit and restart,
+ * since we'd have to reconnect to apply most kinds of change anyway.
+ */
+static void
+bdr_apply_reload_config()
+{
+	BdrConnectionConfig *new_apply_config = bdr_apply_load_config();
+
+	if (bdr_apply_config == NULL)
+	{
+		/* First run, carry on loading */
+		bdr_apply_config = new_apply_config;
+	}
+	else
+	{
+		/* If the DSN or replication sets changed we must restart */
+		if (strcmp(bdr_apply_config->dsn, new_apply_config->dsn) != 0)
 		{
-			/*
-			 * User has overridden behaviour and forced discarding of row data.
-			 * This can be useful to recover from broken replication, but it's
-			 * a bad idea since it results in divergence on these values.
-			 *
-			 * LOG is stronger than WARNING for server log and this is
-			 * important to record. Log flooding could be an issue, but this
-			 * shouldn't be used anyway, and we really want to be able to
-			 * diagnose it.
-			 */
-			elog(LOG, "WARNING: discarding non-null remote value for attribute %u on relation \"%s\".\"%s\" (%u) due to bdr.discard_mismatched_row_attributes setting. Remote natts = %u, local natts = %u",
-				 i, get_namespace_name(RelationGetNamespace(rel->rel)),
-				 RelationGetRelationName(rel->rel), RelationGetRelid(rel->rel),
-				 rnatts, desc->natts);
+			elog(DEBUG1, "Apply worker exiting to apply new DSN configuration");
+			proc_exit(1);
 		}
-		else if (kind != 'n')
+
+		if (strcmp(bdr_apply_config->replication_sets, new_apply_config->replication_sets) != 0)
 		{
-			elog(WARNING, "cannot right-pad mismatched attributes; attno %u is missing in local table and remote row has non-null, non-dropped value for this attribute",
-				 i);
-			read_tuple_parts_error_badatts(rel, desc, rnatts);
+			elog(DEBUG1, "Apply worker exiting to apply new replication set configuration");
+			proc_exit(1);
 		}
+
 	}
 
-	/* Don't test pq_getmsgend, there might be another message chunk */
+	/*
+	 * Changes from the remote node now reach us through a relay node, so stop
+	 * replaying them directly. Catchup mode is only used to join the node and
+	 * always has to run to completion.
+	 */
+	if (new_apply_config->relayed && !bdr_apply_worker->forward_changesets)
+	{
+		elog(LOG, "unregistering worker, changes from the remote node are exchanged through a relay node");
+		bdr_worker_shmem_free(bdr_worker_slot, NULL);
+		bdr_worker_slot = NULL;
+		proc_exit(0); /* unregister */
+	}
 }
 
-static BDRRelation *
-read_rel(StringInfo s, LOCKMODE mode, struct ActionErrCallbackArg *cbarg)
+/*
+ * Read a CopyData message from the upstream without waiting.
+ *
+ * Returns its length, or 0 if there's none yet.
+ */
+static int
+bdr_get_copy_data(PGconn *conn, char **buf)
 {
-	int			relnamelen;
-	int			nspnamelen;
-	RangeVar*	rv;
-	Oid			relid;
+	int			r;
 
-	rv = makeNode(RangeVar);
+	r = PQgetCopyData(conn, buf, 1);
 
-	nspnamelen = pq_getmsgint(s, 2);
-	rv->schemaname = (char *) pq_getmsgbytes(s, nspnamelen);
-	cbarg->remote_nspname = rv->schemaname;
+	if (r == -1)
+		elog(ERROR, "data stream ended");
+	else if (r == -2)
+		elog(ERROR, "could not read COPY data: %s",
+			 PQerrorMessage(conn));
+	else if (r < 0)
+		elog(ERROR, "invalid COPY status %d", r);
 
-	relnamelen = pq_getmsgint(s, 2);
-	rv->relname = (char *) pq_getmsgbytes(s, relnamelen);
-	cbarg->remote_relname = rv->relname;
+	return r;
+}
+
+/*
+ * Read the header of a replication data message, noting the position
+ * received.
+ */
+static void
+bdr_read_wal_header(StringInfo s)
+{
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	end_lsn;
 
-	relid = RangeVarGetRelidExtended(rv, mode, false, false, NULL, NULL);
+	start_lsn = pq_getmsgint64(s);
+	end_lsn = pq_getmsgint64(s);
+	pq_getmsgint64(s); /* sendTime */
 
-	/*
-	 * Acquire sequencer lock if any of the sequencer relations are
-	 * modified. We used to rely on relation locks, but that had problems with
-	 * deadlocks and interrupting auto-analyze/vacuum.
-	 */
-	if (relid == BdrSequenceValuesRelid ||
-		relid == BdrSequenceElectionsRelid ||
-		relid == BdrVotesRelid)
-		bdr_sequencer_lock();
+	if (apply_last_received < start_lsn)
+		apply_last_received = start_lsn;
 
-	return bdr_heap_open(relid, NoLock);
+	if (apply_last_received < end_lsn)
+		apply_last_received = end_lsn;
 }
 
 /*
- * Read a remote action type and process the action record.
+ * Process a CopyData message from the upstream, i.e. replication data or a
+ * keepalive.
+ */
+static void
+bdr_handle_copy_data(PGconn *conn, char *data, int len)
+{
+	StringInfoData s;
+	int			c;
+
+	s.data = data;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 0;
+
+	c = pq_getmsgbyte(&s);
+
+	if (c == 'w')
+	{
+		bdr_read_wal_header(&s);
+		bdr_process_remote_frame(&s);
+	}
+	else if (c == 'k')
+	{
+		XLogRecPtr endpos;
+		bool reply_requested;
+
+		endpos = pq_getmsgint64(&s);
+		/* timestamp = */ pq_getmsgint64(&s);
+		reply_requested = pq_getmsgbyte(&s);
+
+		bdr_send_feedback(conn, endpos,
+						  GetCurrentTimestamp(),
+						  reply_requested);
+	}
+	/* other message types are purposefully ignored */
+}
+
+/*
+ * Queue a replication data message received ahead of processing it.
  *
- * May set got_SIGTERM to stop processing before next record.
+ * Compressed messages are decompressed right away, as that has to happen in
+ * the order they were sent, and batches of messages are split up, so the
+ * queue holds one action per message.
  */
 static void
-bdr_process_remote_action(StringInfo s)
+bdr_queue_received(char *data, int len)
 {
-	char action = pq_getmsgbyte(s);
-	Assert(CurrentMemoryContext == MessageContext);
-	switch (action)
+	StringInfoData s;
+	StringInfoData raw;
+	StringInfo	payload = &s;
+
+	s.data = data;
+	s.len = len;
+	s.maxlen = -1;
+	s.cursor = 1;
+
+	bdr_read_wal_header(&s);
+
+	if (s.cursor < s.len && s.data[s.cursor] == 'Z')
 	{
-			/* BEGIN */
-		case 'B':
-			process_remote_begin(s);
-			break;
-			/* COMMIT */
-		case 'C':
-			process_remote_commit(s);
-			break;
-			/* INSERT */
-		case 'I':
-			process_remote_insert(s);
-			break;
-			/* UPDATE */
-		case 'U':
-			process_remote_update(s);
-			break;
-			/* DELETE */
-		case 'D':
-			process_remote_delete(s);
-			break;
-		case 'M':
-			process_remote_message(s);
-			break;
-		default:
-			elog(ERROR, "unknown action of type %c", action);
+		pq_getmsgbyte(&s);
+		bdr_decompress_action(&s, &raw);
+		payload = &raw;
 	}
-	Assert(CurrentMemoryContext == MessageContext);
 
-	if (action == 'C')
+	if (payload->cursor < payload->len &&
+		payload->data[payload->cursor] == 'P')
 	{
-		/*
-		 * We clobber MessageContext on commit. It doesn't matter much when we
-		 * do it so long as we do so periodically, to prevent the context from
-		 * growing too much.
-		 */
-		MemoryContextReset(MessageContext);
+		uint32		nmsgs;
+		uint32		i;
+
+		if (!apply_batch_messages)
+			elog(ERROR, "unexpected batch of messages, batching has not been requested");
+
+		pq_getmsgbyte(payload);
+		nmsgs = pq_getmsgint(payload, 4);
+
+		for (i = 0; i < nmsgs; i++)
+		{
+			int			msglen = pq_getmsgint(payload, 4);
+
+			bdr_queue_action(data, pq_getmsgbytes(payload, msglen), msglen);
+		}
 	}
+	else
+		bdr_queue_action(data, payload->data + payload->cursor,
+						 payload->len - payload->cursor);
+
+	if (payload == &raw)
+		pfree(raw.data);
 }
 
+/*
+ * Add an action to the receive queue, with the header of the message it
+ * arrived in.
+ */
+static void
+bdr_queue_action(const char *header, const char *action, int len)
+{
+	BdrReceivedMessage *msg;
+
+	msg = MemoryContextAlloc(TopMemoryContext,
+							 offsetof(BdrReceivedMessage, data) +
+							 BDR_WAL_HEADER_LEN + len);
+	msg->prefetched = BDR_PREFETCH_NONE;
+	msg->len = BDR_WAL_HEADER_LEN + len;
+	memcpy(msg->data, header, BDR_WAL_HEADER_LEN);
+	memcpy(msg->data + BDR_WAL_HEADER_LEN, action, len);
+
+	dlist_push_tail(&bdr_receive_queue, &msg->node);
+	bdr_receive_queue_bytes += msg->len;
+	bdr_receive_queue_len++;
+}
 
 /*
- * Converts an int64 to network byte order.
+ * Read what's arrived from the upstream into the receive queue without
+ * waiting, until it holds 'max_queued' actions or bdr.receive_buffer_size.
+ * Keepalives are answered right away.
  */
 static void
-bdr_sendint64(int64 i, char *buf)
+bdr_read_ahead(int max_queued)
 {
-	uint32		n32;
+	char	   *copybuf = NULL;
+	int			r;
 
-	/* High order half first, since we're doing MSB-first */
-	n32 = (uint32) (i >> 32);
-	n32 = htonl(n32);
-	memcpy(&buf[0], &n32, 4);
+	PQconsumeInput(apply_conn);
 
-	/* Now the low order half */
-	n32 = (uint32) i;
-	n32 = htonl(n32);
-	memcpy(&buf[4], &n32, 4);
+	if (PQstatus(apply_conn) == CONNECTION_BAD)
+	{
+		bdr_count_disconnect();
+		elog(ERROR, "connection to other side has died");
+	}
+
+	while (bdr_receive_queue_len < max_queued &&
+		   bdr_receive_queue_bytes < bdr_receive_buffer_size * 1024L &&
+		   (r = bdr_get_copy_data(apply_conn, &copybuf)) > 0)
+	{
+		if (copybuf[0] == 'w')
+			bdr_queue_received(copybuf, r);
+		else
+			bdr_handle_copy_data(apply_conn, copybuf, r);
+
+		PQfreemem(copybuf);
+		copybuf = NULL;
+	}
 }
 
 /*
- * Figure out which write/flush positions to report to the walsender process.
- *
- * We can't simply report back the last LSN the walsender sent us because the
- * local transaction might not yet be flushed to disk locally. Instead we
- * build a list that associates local with remote LSNs for every commit. When
- * reporting back the flush position to the sender we iterate that list and
- * check which entries on it are already locally flushed. Those we can report
- * as having been flushed.
+ * Receive what the upstream sent meanwhile while the apply worker waits for
+ * parallel apply workers, without processing it, so the walsender doesn't
+ * stall on a full socket while a transaction is slow to apply.
  *
- * Returns true if there's no outstanding transactions that need to be
- * flushed.
+ * Replication data is queued for the main loop, up to
+ * bdr.receive_buffer_size. Keepalives are answered right away, and commits
+ * by parallel apply workers are confirmed; once the queue is full, feedback
+ * is still sent every wal_receiver_status_interval so the upstream doesn't
+ * time out the connection.
  */
-static bool
-bdr_get_flush_position(XLogRecPtr *write, XLogRecPtr *flush)
+static void
+bdr_apply_receive(void)
 {
-	dlist_mutable_iter iter;
-	XLogRecPtr	local_flush = GetFlushRecPtr();
+	static TimestampTz last_feedback = 0;
+	TimestampTz now;
+	bool		force = false;
 
-	*write = InvalidXLogRecPtr;
-	*flush = InvalidXLogRecPtr;
+	bdr_read_ahead(INT_MAX);
 
-	dlist_foreach_modify(iter, &bdr_lsn_association)
+	now = GetCurrentTimestamp();
+	if (wal_receiver_status_interval > 0 &&
+		TimestampDifferenceExceeds(last_feedback, now,
+								   wal_receiver_status_interval * 1000))
 	{
-		BdrFlushPosition *pos =
-			dlist_container(BdrFlushPosition, node, iter.cur);
-
-		*write = pos->remote_end;
-
-		if (pos->local_end <= local_flush)
-		{
-			*flush = pos->remote_end;
-			dlist_delete(iter.cur);
-			pfree(pos);
-		}
-		else
-		{
-			/*
-			 * Don't want to uselessly iterate over the rest of the list which
-			 * could potentially be long. Instead get the last element and
-			 * grab the write position from there.
-			 */
-			pos = dlist_tail_element(BdrFlushPosition, node,
-									 &bdr_lsn_association);
-			*write = pos->remote_end;
-			return false;
-		}
+		force = true;
+		last_feedback = now;
 	}
 
-	return dlist_is_empty(&bdr_lsn_association);
+	bdr_send_feedback(apply_conn, apply_last_received, now, force);
 }
 
 /*
- * Send a Standby Status Update message to server.
+ * Prefetch the index and heap pages of the rows the next bdr.prefetch_depth
+ * queued changes will look up, so they're read concurrently rather than one
+ * after the other as the changes are applied.
  *
- * 'recvpos' is the latest LSN we've received data to, force is set if we need
- * to send a response to avoid timeouts.
+ * Each change is visited twice: once it's among the next bdr.prefetch_depth
+ * changes its index leaf page is prefetched, and once it's among the next
+ * half of those its heap page, see bdr_prefetch_index_key().
+ *
+ * Changes after one to BDR's own tables aren't looked at until that has been
+ * applied, as it might replicate DDL changing the tables.
  */
-static bool
-bdr_send_feedback(PGconn *conn, XLogRecPtr recvpos, int64 now, bool force)
+static void
+bdr_prefetch_queued(void)
 {
-	char		replybuf[1 + 8 + 8 + 8 + 8 + 1];
-	int			len = 0;
+	dlist_iter	iter;
+	int			i = 0;
+	bool		started_xact = false;
+	MemoryContext oldcontext = CurrentMemoryContext;
+
+	if (PrefetchContext == NULL)
+		PrefetchContext = AllocSetContextCreate(TopMemoryContext,
+												"BDR prefetch",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+
+	dlist_foreach(iter, &bdr_receive_queue)
+	{
+		BdrReceivedMessage *msg =
+			dlist_container(BdrReceivedMessage, node, iter.cur);
+		int			stage;
 
-	static XLogRecPtr last_recvpos = InvalidXLogRecPtr;
-	static XLogRecPtr last_writepos = InvalidXLogRecPtr;
-	static XLogRecPtr last_flushpos = InvalidXLogRecPtr;
+		if (i >= bdr_prefetch_depth)
+			break;
 
-	XLogRecPtr writepos;
-	XLogRecPtr flushpos;
+		stage = i < (bdr_prefetch_depth + 1) / 2 ?
+			BDR_PREFETCH_HEAP : BDR_PREFETCH_INDEX;
+		i++;
 
-	/* It's legal to not pass a recvpos */
-	if (recvpos < last_recvpos)
-		recvpos = last_recvpos;
+		if (msg->prefetched >= stage)
+			continue;
 
-	if (bdr_get_flush_position(&writepos, &flushpos))
-	{
-		/*
-		 * No outstanding transactions to flush, we can report the latest
-		 * received position. This is important for synchronous replication.
-		 */
-		flushpos = writepos = recvpos;
+		/* looking up the relations needs a transaction */
+		if (!IsTransactionState())
+		{
+			StartTransactionCommand();
+			started_xact = true;
+		}
+
+		MemoryContextSwitchTo(PrefetchContext);
+
+		if (!bdr_prefetch_action(msg, stage))
+			break;
+
+		MemoryContextReset(PrefetchContext);
 	}
 
-	if (writepos < last_writepos)
-		writepos = last_writepos;
+	if (started_xact)
+	{
+		CommitTransactionCommand();
+		CurrentResourceOwner = bdr_saved_resowner;
+	}
 
-	if (flushpos < last_flushpos)
-		flushpos = last_flushpos;
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(PrefetchContext);
+}
 
-	/* if we've already reported everything we're good */
-	if (!force &&
-		writepos == last_writepos &&
-		flushpos == last_flushpos)
+/*
+ * Prefetch for a queued action, up to 'stage'.
+ *
+ * Returns false if the actions after it mustn't be looked at yet.
+ */
+static bool
+bdr_prefetch_action(BdrReceivedMessage *msg, int stage)
+{
+	StringInfoData s;
+	char		action;
+	char		kind;
+	bool		barrier = false;
+	BDRRelation *rel;
+	BDRApplyRelState *state;
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+
+	s.data = msg->data;
+	s.len = msg->len;
+	s.maxlen = -1;
+	s.cursor = BDR_WAL_HEADER_LEN;
+
+	/* nothing to do for anything but changes */
+	msg->prefetched = BDR_PREFETCH_HEAP;
+
+	if (s.cursor >= s.len)
 		return true;
 
-	replybuf[len] = 'r';
-	len += 1;
-	bdr_sendint64(recvpos, &replybuf[len]);			/* write */
-	len += 8;
-	bdr_sendint64(flushpos, &replybuf[len]);		/* flush */
-	len += 8;
-	bdr_sendint64(writepos, &replybuf[len]);		/* apply */
-	len += 8;
-	bdr_sendint64(now, &replybuf[len]);				/* sendTime */
-	len += 8;
-	replybuf[len] = false;							/* replyRequested */
-	len += 1;
+	action = pq_getmsgbyte(&s);
+	if (action != 'I' && action != 'U' && action != 'D')
+		return true;
 
-	elog(DEBUG2, "sending feedback (force %d) to recv %X/%X, write %X/%X, flush %X/%X",
-		 force,
-		 (uint32) (recvpos >> 32), (uint32) recvpos,
-		 (uint32) (writepos >> 32), (uint32) writepos,
-		 (uint32) (flushpos >> 32), (uint32) flushpos
-		);
+	rel = prefetch_read_rel(&s, &barrier);
+	if (barrier)
+	{
+		/* have another look once what's before has been applied */
+		msg->prefetched = BDR_PREFETCH_NONE;
+		return false;
+	}
+	if (rel == NULL)
+		return true;
 
+	state = get_apply_rel_state(rel);
 
-	if (PQputCopyData(conn, replybuf, len) <= 0 || PQflush(conn))
+	/* the row is looked up by the old key if it's sent, else the new one */
+	kind = pq_getmsgbyte(&s);
+	if (state->idxrel != NULL && (kind == 'K' || kind == 'N') &&
+		read_index_key_parts(&s, rel, state, state->idxrel, values, isnull))
 	{
-		ereport(ERROR,
-				(errcode(ERRCODE_CONNECTION_FAILURE),
-				 errmsg("could not send feedback packet: %s",
-						PQerrorMessage(conn))));
-		return false;
+		bdr_prefetch_index_key(rel->rel, state->idxrel, values, isnull,
+							   stage == BDR_PREFETCH_HEAP);
+		msg->prefetched = stage;
 	}
 
-	if (recvpos > last_recvpos)
-		last_recvpos = recvpos;
-	if (writepos > last_writepos)
-		last_writepos = writepos;
-	if (flushpos > last_flushpos)
-		last_flushpos = flushpos;
+	bdr_heap_close(rel, NoLock);
 
 	return true;
 }
 
 /*
- * abs_timestamp_difference -- convert the difference between two timestamps
- *		into integer seconds and microseconds
- *
- * The result is always the absolute (pozitive difference), so the order
- * of input is not important.
+ * Look up the local relation a queued change refers to like read_rel(), but
+ * without waiting for its lock, returning NULL if it can't be locked right
+ * away or doesn't exist.
  *
- * If either input is not finite, we return zeroes.
+ * Changes to BDR's own tables, and to relations the upstream hasn't sent the
+ * metadata of yet, set *barrier instead.
  */
-static void
-abs_timestamp_difference(TimestampTz start_time, TimestampTz stop_time,
-					long *secs, int *microsecs)
+static BDRRelation *
+prefetch_read_rel(StringInfo s, bool *barrier)
 {
-	if (TIMESTAMP_NOT_FINITE(start_time) || TIMESTAMP_NOT_FINITE(stop_time))
+	const char *nspname;
+	const char *relname;
+	Oid			relid = InvalidOid;
+
+	if (apply_relation_dictionary)
 	{
-		*secs = 0;
-		*microsecs = 0;
+		uint32		remote_relid = pq_getmsgint(s, 4);
+		BDRRemoteRelation *entry = NULL;
+
+		if (BDRRemoteRelHash != NULL)
+			entry = hash_search(BDRRemoteRelHash, &remote_relid,
+								HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			*barrier = true;
+			return NULL;
+		}
+
+		nspname = entry->nspname;
+		relname = entry->relname;
+		relid = entry->local_relid;
 	}
 	else
+		bdr_read_remote_relation(s, &nspname, &relname);
+
+	if (strcmp(nspname, "bdr") == 0)
 	{
-		TimestampTz diff = abs(stop_time - start_time);
-#ifdef HAVE_INT64_TIMESTAMP
-		*secs = (long) (diff / USECS_PER_SEC);
-		*microsecs = (int) (diff % USECS_PER_SEC);
-#else
-		*secs = (long) diff;
-		*microsecs = (int) ((diff - *secs) * 1000000.0);
-#endif
+		*barrier = true;
+		return NULL;
 	}
-}
 
-#if defined(VERBOSE_INSERT) || defined(VERBOSE_UPDATE) || defined(VERBOSE_DELETE)
-static void
-log_tuple(const char *format, TupleDesc desc, HeapTuple tup)
-{
-	StringInfoData o;
+	if (!OidIsValid(relid))
+		relid = RangeVarGetRelid(makeRangeVar(pstrdup(nspname),
+											  pstrdup(relname), -1),
+								 NoLock, true);
 
-	initStringInfo(&o);
-	tuple_to_stringinfo(&o, desc, tup);
-	elog(DEBUG1, format, o.data);
-	resetStringInfo(&o);
+	if (!OidIsValid(relid) ||
+		!ConditionalLockRelationOid(relid, AccessShareLock))
+		return NULL;
+
+	/* it might have been dropped before we got the lock */
+	if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relid)))
+	{
+		UnlockRelationOid(relid, AccessShareLock);
+		return NULL;
+	}
 
+	return bdr_heap_open(relid, NoLock);
 }
-#endif
 
 /*
- * When the apply worker's latch is set it reloads its configuration
- * from the database, checking for new replication sets, connection
- * strings, etc.
+ * Read a tuple of a change like read_tuple_parts(), but only convert the
+ * columns of the index 'idxrel', into 'values' in index column order.
  *
- * At this time many changes simply force the apply worker to exit and restart,
- * since we'd have to reconnect to apply most kinds of change anyway.
+ * Returns false if the key isn't known without applying the changes before,
+ * because a column of it has been sent in chunks, isn't there or is NULL.
+ * Also if a column of it would need a type's input function: that might fail
+ * for a value the change's own apply is about to reject, and an error while
+ * prefetching would abort the changes queued before it.
  */
-static void
-bdr_apply_reload_config()
+static bool
+read_index_key_parts(StringInfo s, BDRRelation *rel, BDRApplyRelState *state,
+					 Relation idxrel, Datum *values, bool *isnull)
 {
-	BdrConnectionConfig *new_apply_config;
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	int2vector *indkey = &idxrel->rd_index->indkey;
+	int			nkeys = RelationGetNumberOfAttributes(idxrel);
+	int			nfound = 0;
+	int			rnatts;
+	int			i;
+	int			k;
 
-	/* Fetch our config from the DB */
-	new_apply_config = bdr_get_connection_config(
-		bdr_apply_worker->remote_sysid,
-		bdr_apply_worker->remote_timeline,
-		bdr_apply_worker->remote_dboid,
-		false);
+	if (pq_getmsgbyte(s) != 'T')
+		return false;
 
-	Assert(new_apply_config->sysid == bdr_apply_worker->remote_sysid &&
-		   new_apply_config->timeline == bdr_apply_worker->remote_timeline &&
-		   new_apply_config->dboid == bdr_apply_worker->remote_dboid);
+	rnatts = pq_getmsgint(s, 4);
 
-	/*
-	 * Got default remote connection info, read also local defaults.
-	 * Otherwise we would be using replication sets and apply delay from the
-	 * remote node instead of the local one.
-	 *
-	 * Note: this is slightly hacky and we should probably use the bdr_nodes
-	 * for this instead.
-	 */
-	if (!new_apply_config->origin_is_my_id)
+	for (i = 0; i < Min(desc->natts, rnatts) && nfound < nkeys; i++)
 	{
-		BdrConnectionConfig *cfg =
-			bdr_get_connection_config(GetSystemIdentifier(), ThisTimeLineID,
-									  MyDatabaseId, false);
-
-		new_apply_config->apply_delay = cfg->apply_delay;
-		pfree(new_apply_config->replication_sets);
-		new_apply_config->replication_sets = pstrdup(cfg->replication_sets);
-		bdr_free_connection_config(cfg);
-	}
+		char		kind = pq_getmsgbyte(s);
+		const char *data = NULL;
+		int			len = 0;
 
-	if (bdr_apply_config == NULL)
-	{
-		/* First run, carry on loading */
-		bdr_apply_config = new_apply_config;
-	}
-	else
-	{
-		/* If the DSN or replication sets changed we must restart */
-		if (strcmp(bdr_apply_config->dsn, new_apply_config->dsn) != 0)
+		switch (kind)
 		{
-			elog(DEBUG1, "Apply worker exiting to apply new DSN configuration");
-			proc_exit(1);
+			case 'n': /* null */
+			case 'u': /* unchanged column */
+				break;
+			case 'c': /* binary format, sent in chunks before */
+				pq_getmsgint(s, 4);
+				break;
+			case 'b': /* binary format */
+			case 's': /* send/recv format */
+			case 't': /* text format */
+				len = pq_getmsgint(s, 4);
+				data = pq_getmsgbytes(s, len);
+				break;
+			default:
+				return false;
 		}
 
-		if (strcmp(bdr_apply_config->replication_sets, new_apply_config->replication_sets) != 0)
+		for (k = 0; k < nkeys; k++)
 		{
-			elog(DEBUG1, "Apply worker exiting to apply new replication set configuration");
-			proc_exit(1);
-		}
+			if (indkey->values[k] != i + 1)
+				continue;
 
+			if (data == NULL || kind != 'b')
+				return false;
+
+			values[k] = input_column_value(rel, state, i, kind, data, len);
+			isnull[k] = false;
+			nfound++;
+		}
 	}
+
+	return nfound == nkeys;
+}
+
+/*
+ * Wait for the latch to be set or the timeout to pass like WaitLatch(),
+ * receiving from the upstream meanwhile, see bdr_apply_receive().
+ *
+ * Used by the apply worker while waiting for parallel apply workers.
+ */
+int
+bdr_apply_wait(long timeout)
+{
+	int			events = WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH;
+	int			rc;
+
+	/* once the queue is full, there's only feedback to send */
+	if (apply_conn != NULL &&
+		bdr_receive_queue_bytes < bdr_receive_buffer_size * 1024L)
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   events | WL_SOCKET_READABLE,
+							   PQsocket(apply_conn), timeout);
+	else
+		rc = WaitLatch(&MyProc->procLatch, events, timeout);
+
+	if (apply_conn != NULL)
+		bdr_apply_receive();
+
+	/* emergency bailout if postmaster has died */
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	return rc;
 }
 
 /*
@@ -2689,9 +4340,9 @@ bdr_apply_work(PGconn* streamConn)
 {
 	int			fd;
 	char	   *copybuf = NULL;
-	XLogRecPtr	last_received = InvalidXLogRecPtr;
 
 	fd = PQsocket(streamConn);
+	apply_conn = streamConn;
 
 	MessageContext = AllocSetContextCreate(TopMemoryContext,
 										   "MessageContext",
@@ -2764,75 +4415,45 @@ bdr_apply_work(PGconn* streamConn)
 				copybuf = NULL;
 			}
 
-			r = PQgetCopyData(streamConn, &copybuf, 1);
-
-			if (r == -1)
-			{
-				elog(ERROR, "data stream ended");
-			}
-			else if (r == -2)
-			{
-				elog(ERROR, "could not read COPY data: %s",
-					 PQerrorMessage(streamConn));
-			}
-			else if (r < 0)
-				elog(ERROR, "invalid COPY status %d", r);
-			else if (r == 0)
+			/*
+			 * Parallel apply workers overlap the reads of different
+			 * transactions anyway, only the apply worker applying changes
+			 * itself has to look ahead.
+			 */
+			if (bdr_prefetch_depth > 0 && !apply_parallel)
 			{
-				/* need to wait for new data */
-				break;
+				bdr_read_ahead(bdr_prefetch_depth);
+				bdr_prefetch_queued();
 			}
-			else
-			{
-				int c;
-				StringInfoData s;
-
-				MemoryContextSwitchTo(MessageContext);
-
-				initStringInfo(&s);
-				s.data = copybuf;
-				s.len = r;
-				s.maxlen = -1;
-
-				c = pq_getmsgbyte(&s);
-
-				if (c == 'w')
-				{
-					XLogRecPtr	start_lsn;
-					XLogRecPtr	end_lsn;
-
-					start_lsn = pq_getmsgint64(&s);
-					end_lsn = pq_getmsgint64(&s);
-					pq_getmsgint64(&s); /* sendTime */
 
-					if (last_received < start_lsn)
-						last_received = start_lsn;
+			/* what's been received ahead comes first */
+			if (!dlist_is_empty(&bdr_receive_queue))
+			{
+				BdrReceivedMessage *msg;
 
-					if (last_received < end_lsn)
-						last_received = end_lsn;
+				msg = dlist_container(BdrReceivedMessage, node,
+									  dlist_pop_head_node(&bdr_receive_queue));
+				bdr_receive_queue_bytes -= msg->len;
+				bdr_receive_queue_len--;
 
-					bdr_process_remote_action(&s);
-				}
-				else if (c == 'k')
-				{
-					XLogRecPtr endpos;
-					bool reply_requested;
+				MemoryContextSwitchTo(MessageContext);
+				bdr_handle_copy_data(streamConn, msg->data, msg->len);
+				pfree(msg);
+				continue;
+			}
 
-					endpos = pq_getmsgint64(&s);
-					/* timestamp = */ pq_getmsgint64(&s);
-					reply_requested = pq_getmsgbyte(&s);
+			r = bdr_get_copy_data(streamConn, &copybuf);
 
-					bdr_send_feedback(streamConn, endpos,
-									  GetCurrentTimestamp(),
-									  reply_requested);
-				}
-				/* other message types are purposefully ignored */
-			}
+			/* need to wait for new data */
+			if (r == 0)
+				break;
 
+			MemoryContextSwitchTo(MessageContext);
+			bdr_handle_copy_data(streamConn, copybuf, r);
 		}
 
 		/* confirm all writes at once */
-		bdr_send_feedback(streamConn, last_received,
+		bdr_send_feedback(streamConn, apply_last_received,
 						  GetCurrentTimestamp(), false);
 
 		/*
@@ -2871,6 +4492,52 @@ bdr_apply_work(PGconn* streamConn)
 	}
 }
 
+/*
+ * Set up a parallel apply worker to apply changes on behalf of the apply
+ * worker 'apply', as bdr_apply_main() sets up the apply worker itself. The
+ * caller has connected to the database and set up a resource owner.
+ */
+void
+bdr_apply_init_parallel_worker(BdrApplyWorker *apply,
+							   RepNodeId upstream_id,
+							   uint64 sysid, TimeLineID tli, Oid dboid,
+							   bool relation_dictionary, bool value_chunks)
+{
+	StringInfoData appname;
+
+	bdr_apply_worker = apply;
+	bdr_saved_resowner = CurrentResourceOwner;
+
+	origin_sysid = sysid;
+	origin_timeline = tli;
+	origin_dboid = dboid;
+
+	bdr_apply_config = bdr_apply_load_config();
+
+	initStringInfo(&appname);
+	appendStringInfo(&appname, BDR_LOCALID_FORMAT": %s",
+					 BDR_LOCALID_FORMAT_ARGS, "parallel apply");
+	SetConfigOption("application_name", appname.data, PGC_USERSET,
+					PGC_S_SESSION);
+
+	apply_relation_dictionary = relation_dictionary;
+	apply_value_chunks = value_chunks;
+
+	bdr_count_set_current_node(upstream_id);
+
+	replication_origin_id = upstream_id;
+	upstream_origin_id = upstream_id;
+
+	bdr_conflict_logging_startup();
+
+	MessageContext = AllocSetContextCreate(TopMemoryContext,
+										   "MessageContext",
+										   ALLOCSET_DEFAULT_MINSIZE,
+										   ALLOCSET_DEFAULT_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
 
 /*
  * Entry point for a BDR apply worker.
@@ -2887,8 +4554,10 @@ bdr_apply_main(Datum main_arg)
 	char	   *sqlstate;
 	RepNodeId	replication_identifier;
 	XLogRecPtr	start_from;
+	XLogRecPtr	relayed_lsn;
 	NameData	slot_name;
 	char		status;
+	char	   *message_channels;
 
 	bdr_bgworker_init(DatumGetInt32(main_arg), BDR_WORKER_APPLY);
 
@@ -2983,6 +4652,15 @@ bdr_apply_main(Datum main_arg)
 
 	start_from = RemoteCommitFromCachedReplicationIdentifier();
 
+	/*
+	 * Transactions the remote node relayed to us from other nodes don't
+	 * advance its identifier, see process_remote_commit().
+	 */
+	relayed_lsn = bdr_get_relayed_progress(origin_sysid, origin_timeline,
+										   origin_dboid);
+	if (relayed_lsn > start_from)
+		start_from = relayed_lsn;
+
 	elog(INFO, "starting up replication from %u at %X/%X",
 		 replication_identifier,
 		 (uint32) (start_from >> 32), (uint32) start_from);
@@ -3014,6 +4692,44 @@ bdr_apply_main(Datum main_arg)
 	if (bdr_apply_worker->forward_changesets)
 		appendStringInfo(&query, ", forward_changesets 't'");
 
+	apply_relation_dictionary = bdr_relation_dictionary;
+	if (apply_relation_dictionary)
+		appendStringInfo(&query, ", relation_dictionary 't'");
+
+	if (bdr_changed_columns_only)
+		appendStringInfo(&query, ", changed_columns_only 't'");
+
+	apply_batch_messages = bdr_batch_messages > 1;
+	if (apply_batch_messages)
+		appendStringInfo(&query, ", batch_messages '%d'", bdr_batch_messages);
+
+	apply_compression = bdr_compression;
+	if (apply_compression == BDR_COMPRESSION_ZLIB)
+		appendStringInfo(&query, ", compression 'zlib'");
+
+	apply_value_chunks = bdr_value_chunk_size > 0;
+	if (apply_value_chunks)
+		appendStringInfo(&query, ", value_chunk_size '%d'",
+						 bdr_value_chunk_size * 1024);
+
+	if (bdr_negotiate_type_transfer)
+	{
+		StartTransactionCommand();
+		appendStringInfo(&query, ", type_capabilities '%s'",
+						 bdr_type_capabilities());
+		CommitTransactionCommand();
+	}
+
+	/*
+	 * Only ask for the messages there's a handler for. Without any handlers
+	 * the option isn't sent, so upstreams that don't know it still work.
+	 */
+	StartTransactionCommand();
+	message_channels = bdr_message_channels();
+	if (message_channels != NULL)
+		appendStringInfo(&query, ", message_channels '%s'", message_channels);
+	CommitTransactionCommand();
+
 	appendStringInfoChar(&query, ')');
 
 	elog(DEBUG3, "Sending replication command: %s", query.data);
@@ -3030,6 +4746,24 @@ bdr_apply_main(Datum main_arg)
 	PQclear(res);
 
 	replication_origin_id = replication_identifier;
+	upstream_origin_id = replication_identifier;
+
+	/*
+	 * Hand the transactions to parallel apply workers if so configured.
+	 * Catchup and replay up to a given point are left to the apply worker.
+	 */
+	if (bdr_parallel_apply_workers > 0 &&
+		!bdr_apply_worker->forward_changesets &&
+		bdr_apply_worker->replay_stop_lsn == InvalidXLogRecPtr)
+	{
+		bdr_apply_parallel_init(bdr_apply_worker,
+								bdr_worker_slot - BdrWorkerCtl->slots,
+								replication_identifier,
+								origin_sysid, origin_timeline, origin_dboid,
+								apply_relation_dictionary,
+								apply_value_chunks);
+		apply_parallel = true;
+	}
 
 	bdr_conflict_logging_startup();
 
@@ -0,0 +1,1552 @@
+/* -------------------------------------------------------------------------
+ *
+ * bdr_apply_parallel.c
+ *		Apply of remote transactions by several workers in parallel
+ *
+ * Copyright (C) 2012-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		bdr_apply_parallel.c
+ *
+ * With bdr.parallel_apply_workers set, the apply worker of a connection
+ * doesn't apply the upstream's transactions itself but hands each one to one
+ * of a pool of parallel apply workers, dynamic background workers it starts
+ * when the first transaction arrives. The changes are passed on unchanged
+ * through a shm_mq per worker and applied with the same code as otherwise,
+ * see bdr_apply.c.
+ *
+ * The transactions commit in the order the upstream committed them, each
+ * waiting for its predecessor to have committed first, so the replication
+ * identifier only ever advances past transactions that all have been
+ * applied. Besides that, before a change is applied, the transaction waits
+ * for the commit of the last earlier transaction that wrote a row with the
+ * same key in any of the relation's unique indexes, or any row of the
+ * relation if either change's keys aren't all known. Only the replica
+ * identity key of an old row is sent, so UPDATEs and DELETEs of relations
+ * with further unique indexes always count as the latter. Relations with
+ * unique indexes whose keys can't be hashed from the sent tuple, i.e. on
+ * expressions, or with exclusion constraints, are applied serially. The
+ * apply worker keeps track of those write sets as it hands out the changes,
+ * and tells the parallel apply worker what to wait for ahead of the change.
+ * Transactions that change BDR's catalogs, i.e. replicate DDL, or contain
+ * messages, are only applied once all earlier ones have committed, and no
+ * later transaction is handed out before they committed themselves.
+ *
+ * Waiting for a transaction that has started applying changes is done by
+ * waiting on its transaction lock. Any error stops the apply worker along
+ * with all parallel apply workers. The transactions that were in progress at
+ * that point are then applied by the restarted apply worker itself, see
+ * parallel_resume_lsn, before handing out transactions again.
+ *
+ * While the apply worker waits for parallel apply workers, to hand them a
+ * change or for a transaction to commit, it keeps receiving from the
+ * upstream into a buffer and answering keepalives, see bdr_apply_wait().
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "bdr.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_index.h"
+
+#include "libpq/pqformat.h"
+
+#include "nodes/makefuncs.h"
+
+#include "postmaster/bgworker.h"
+
+#include "storage/dsm.h"
+#include "storage/dsm_impl.h"
+#include "storage/ipc.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+
+#include "tcop/tcopprot.h"
+
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/syscache.h"
+
+#define BDR_APPLY_PARALLEL_MAGIC		0x42445241
+#define BDR_APPLY_PARALLEL_QUEUE_SIZE	(256 * 1024)
+
+/* remembered row writes beyond which committed ones are forgotten */
+#define BDR_APPLY_PARALLEL_MAX_WRITES	65536
+
+/* unique indexes tracked per relation, ones with more are applied serially */
+#define BDR_APPLY_PARALLEL_MAX_INDEXES	8
+
+/* A parallel apply worker, as seen by all participants */
+typedef struct BdrApplyParallelWorker
+{
+	/* for setting its latch, NULL until the worker attached */
+	PGPROC	   *proc;
+	/* the transaction it's applying, or 0 */
+	uint64		seq;
+	/* the local transaction it's been applied in, once started */
+	TransactionId xid;
+} BdrApplyParallelWorker;
+
+/*
+ * Shared state of an apply worker and its parallel apply workers, in the
+ * dynamic shared memory segment along with one queue per worker.
+ *
+ * Transactions are numbered from 1 in the order the upstream sent them.
+ */
+typedef struct BdrApplyParallelShared
+{
+	slock_t		mutex;
+
+	/* what the workers need to know to set up like the apply worker */
+	NameData	dbname;
+	int			apply_slot;
+	RepNodeId	upstream_origin_id;
+	uint64		origin_sysid;
+	TimeLineID	origin_timeline;
+	Oid			origin_dboid;
+	bool		relation_dictionary;
+	bool		value_chunks;
+	PGPROC	   *apply_proc;
+
+	/* the rest is protected by the mutex */
+	int			nattached;
+
+	/* set when a parallel apply worker exits */
+	bool		failed;
+
+	/* the transaction to commit next */
+	uint64		next_commit;
+
+	/* end of the last committed transaction on the upstream and locally */
+	XLogRecPtr	remote_end;
+	XLogRecPtr	local_end;
+
+	int			nworkers;
+	BdrApplyParallelWorker workers[FLEXIBLE_ARRAY_MEMBER];
+} BdrApplyParallelShared;
+
+/* The apply worker's handle on a parallel apply worker */
+typedef struct ParallelApplyWorker
+{
+	BackgroundWorkerHandle *handle;
+	shm_mq_handle *mqh;
+	/* the last transaction handed to it */
+	uint64		last_seq;
+} ParallelApplyWorker;
+
+/*
+ * What the apply worker knows about a relation changes arrive for, looked up
+ * by the name the upstream sent.
+ */
+typedef struct ParallelApplyRelKey
+{
+	NameData	nspname;
+	NameData	relname;
+} ParallelApplyRelKey;
+
+/* The columns of a unique index, 0-based */
+typedef struct ParallelApplyRelIndex
+{
+	int			nkeys;
+	AttrNumber	keys[INDEX_MAX_KEYS];
+} ParallelApplyRelIndex;
+
+typedef struct ParallelApplyRel
+{
+	ParallelApplyRelKey key;	/* hash key */
+	/* local relation, InvalidOid if there's none */
+	Oid			relid;
+	/* needs to be looked up (again) */
+	bool		stale;
+	/* changes to it need all earlier transactions to have committed */
+	bool		serial;
+	/* unique indexes, replica identity index first; none if it's unusable */
+	int			nindexes;
+	ParallelApplyRelIndex indexes[BDR_APPLY_PARALLEL_MAX_INDEXES];
+	/* the last transactions that changed any row, and a row of unknown key */
+	uint64		last_write;
+	uint64		last_unkeyed_write;
+} ParallelApplyRel;
+
+/* The last transaction that wrote a row with a given unique key */
+typedef struct ParallelApplyWriteKey
+{
+	Oid			relid;
+	uint32		hash;
+} ParallelApplyWriteKey;
+
+typedef struct ParallelApplyWrite
+{
+	ParallelApplyWriteKey key;	/* hash key */
+	uint64		seq;
+} ParallelApplyWrite;
+
+/* in parallel apply workers */
+bool		bdr_is_parallel_apply_worker = false;
+static int	my_worker = -1;
+static uint64 my_seq = 0;
+
+/* in both */
+static dsm_segment *parallel_seg = NULL;
+static BdrApplyParallelShared *parallel_shared = NULL;
+
+/* in the apply worker */
+static BdrApplyWorker *parallel_apply_worker = NULL;
+static bool parallel_apply_disabled = false;
+static ParallelApplyWorker *parallel_workers = NULL;
+static int	parallel_nworkers = 0;
+static int	parallel_next_worker = 0;
+
+static HTAB *ParallelApplyRelHash = NULL;
+static HTAB *ParallelApplyWriteHash = NULL;
+
+/* the last transaction handed out, and its commit LSN on the upstream */
+static uint64 last_seq = 0;
+static XLogRecPtr last_seq_lsn = InvalidXLogRecPtr;
+/* the last commit reported by bdr_apply_parallel_progress() */
+static XLogRecPtr last_progress_end = InvalidXLogRecPtr;
+
+/* the transaction being handed out */
+static bool in_remote_xact = false;
+/* -1 while the apply worker applies it itself */
+static int	xact_worker = -1;
+static uint64 xact_seq = 0;
+/* the latest transaction it's been told to wait for */
+static uint64 xact_waits_for = 0;
+static bool xact_serial = false;
+
+static void parallel_apply_shutdown(int code, Datum arg);
+static bool parallel_apply_start(void);
+static void parallel_apply_send(int worker, const char *data, Size len);
+static void parallel_apply_send_wait(uint64 seq);
+static void parallel_apply_check_workers(bool check_handles);
+static bool parallel_apply_committed(uint64 seq);
+static void parallel_apply_wait_for(uint64 seq);
+static int	parallel_apply_idle_worker(void);
+static void parallel_apply_serialize_xact(void);
+static void parallel_apply_track_change(StringInfo s, char action);
+static ParallelApplyRel *parallel_apply_get_rel(const char *nspname,
+												const char *relname);
+static void parallel_apply_lookup_rel(ParallelApplyRel *rel);
+static bool parallel_apply_index_keys(ParallelApplyRel *rel, Oid indexoid,
+									  ParallelApplyRelIndex *keys);
+static void parallel_apply_rel_inval_cb(Datum arg, Oid relid);
+static bool parallel_apply_read_keys(StringInfo s, ParallelApplyRel *rel,
+									 uint32 *hashes, int *nhashes);
+static void parallel_apply_forget_writes(void);
+static void parallel_worker_wait_for(uint64 seq);
+static void parallel_worker_detach(dsm_segment *seg, Datum arg);
+
+/*
+ * Prepare the apply worker for handing out transactions to parallel apply
+ * workers. They're only started once the first transaction arrives.
+ */
+void
+bdr_apply_parallel_init(BdrApplyWorker *apply, int apply_slot,
+						RepNodeId upstream_origin_id,
+						uint64 sysid, TimeLineID tli, Oid dboid,
+						bool relation_dictionary, bool value_chunks)
+{
+	HASHCTL		ctl;
+
+	parallel_apply_worker = apply;
+
+	if (dynamic_shared_memory_type == DSM_IMPL_NONE)
+	{
+		ereport(WARNING,
+				(errmsg("parallel apply requires dynamic shared memory, applying changes serially"),
+				 errhint("Set dynamic_shared_memory_type.")));
+		parallel_apply_disabled = true;
+	}
+
+	/* the rest of the shared state is filled in once the workers start */
+	parallel_shared = MemoryContextAllocZero(TopMemoryContext,
+											 sizeof(BdrApplyParallelShared));
+	namestrcpy(&parallel_shared->dbname, MyProcPort->database_name);
+	parallel_shared->apply_slot = apply_slot;
+	parallel_shared->upstream_origin_id = upstream_origin_id;
+	parallel_shared->origin_sysid = sysid;
+	parallel_shared->origin_timeline = tli;
+	parallel_shared->origin_dboid = dboid;
+	parallel_shared->relation_dictionary = relation_dictionary;
+	parallel_shared->value_chunks = value_chunks;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ParallelApplyRelKey);
+	ctl.entrysize = sizeof(ParallelApplyRel);
+	ctl.hash = tag_hash;
+	ctl.hcxt = TopMemoryContext;
+	ParallelApplyRelHash = hash_create("BDR parallel apply relations", 128,
+									   &ctl,
+									   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ParallelApplyWriteKey);
+	ctl.entrysize = sizeof(ParallelApplyWrite);
+	ctl.hash = tag_hash;
+	ctl.hcxt = TopMemoryContext;
+	ParallelApplyWriteHash = hash_create("BDR parallel apply writes", 1024,
+										 &ctl,
+										 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	CacheRegisterRelcacheCallback(parallel_apply_rel_inval_cb, (Datum) 0);
+
+	before_shmem_exit(parallel_apply_shutdown, (Datum) 0);
+}
+
+/*
+ * Stop the parallel apply workers when the apply worker exits. Whatever they
+ * were applying is rolled back and applied by the apply worker itself once
+ * it's restarted, in case that's what made us exit.
+ */
+static void
+parallel_apply_shutdown(int code, Datum arg)
+{
+	int			i;
+
+	if (parallel_seg == NULL)
+		return;
+
+	/* the slot's gone if the apply worker unregistered */
+	if (bdr_worker_slot != NULL && bdr_apply_parallel_pending())
+		parallel_apply_worker->parallel_resume_lsn = last_seq_lsn;
+
+	for (i = 0; i < parallel_nworkers; i++)
+		TerminateBackgroundWorker(parallel_workers[i].handle);
+}
+
+/*
+ * Set up the shared memory segment and start the parallel apply workers, one
+ * after the other so each attaches to its own queue.
+ *
+ * Returns false if that's not possible, leaving it to the apply worker to
+ * apply all transactions.
+ */
+static bool
+parallel_apply_start(void)
+{
+	int			nworkers = bdr_parallel_apply_workers;
+	shm_toc_estimator e;
+	shm_toc    *toc;
+	Size		sharedsize;
+	Size		segsize;
+	BdrApplyParallelShared *shared;
+	BackgroundWorker bgw;
+	MemoryContext oldcontext;
+	List	   *msgs;
+	ListCell   *lc;
+	int			i;
+
+	if (nworkers < 1)
+		return false;
+
+	sharedsize = offsetof(BdrApplyParallelShared, workers) +
+		nworkers * sizeof(BdrApplyParallelWorker);
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, sharedsize);
+	for (i = 0; i < nworkers; i++)
+		shm_toc_estimate_chunk(&e, BDR_APPLY_PARALLEL_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, 1 + nworkers);
+	segsize = shm_toc_estimate(&e);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	parallel_seg = dsm_create(segsize);
+	/* keep it for as long as we're around, not just this transaction */
+	dsm_pin_mapping(parallel_seg);
+
+	toc = shm_toc_create(BDR_APPLY_PARALLEL_MAGIC,
+						 dsm_segment_address(parallel_seg), segsize);
+
+	shared = shm_toc_allocate(toc, sharedsize);
+	memcpy(shared, parallel_shared, offsetof(BdrApplyParallelShared, workers));
+	memset(shared->workers, 0, nworkers * sizeof(BdrApplyParallelWorker));
+	SpinLockInit(&shared->mutex);
+	shared->apply_proc = MyProc;
+	shared->nattached = 0;
+	shared->failed = false;
+	shared->next_commit = last_seq + 1;
+	shared->remote_end = InvalidXLogRecPtr;
+	shared->local_end = InvalidXLogRecPtr;
+	shared->nworkers = nworkers;
+	shm_toc_insert(toc, 0, shared);
+
+	pfree(parallel_shared);
+	parallel_shared = shared;
+
+	parallel_workers = palloc0(nworkers * sizeof(ParallelApplyWorker));
+
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	bgw.bgw_main = NULL;
+	strncpy(bgw.bgw_library_name, BDR_LIBRARY_NAME, BGW_MAXLEN);
+	strncpy(bgw.bgw_function_name, "bdr_apply_parallel_worker_main",
+			BGW_MAXLEN);
+	bgw.bgw_restart_time = BGW_NEVER_RESTART;
+	bgw.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(parallel_seg));
+	bgw.bgw_notify_pid = MyProcPid;
+
+	for (i = 0; i < nworkers; i++)
+	{
+		shm_mq	   *mq;
+		pid_t		pid;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, BDR_APPLY_PARALLEL_QUEUE_SIZE),
+						   BDR_APPLY_PARALLEL_QUEUE_SIZE);
+		shm_toc_insert(toc, i + 1, mq);
+		shm_mq_set_sender(mq, MyProc);
+
+		snprintf(bgw.bgw_name, BGW_MAXLEN,
+				 "bdr: parallel apply %d for apply worker %d",
+				 i, MyProcPid);
+
+		if (!RegisterDynamicBackgroundWorker(&bgw,
+											 &parallel_workers[i].handle))
+		{
+			ereport(WARNING,
+					(errmsg("could not start parallel apply workers, applying changes serially"),
+					 errhint("You may need to increase max_worker_processes.")));
+			goto fail;
+		}
+		parallel_nworkers = i + 1;
+
+		parallel_workers[i].mqh = shm_mq_attach(mq, parallel_seg,
+												parallel_workers[i].handle);
+
+		/* wait for it to claim its queue before starting the next one */
+		for (;;)
+		{
+			int			nattached;
+			int			rc;
+
+			ResetLatch(&MyProc->procLatch);
+
+			SpinLockAcquire(&shared->mutex);
+			nattached = shared->nattached;
+			SpinLockRelease(&shared->mutex);
+
+			if (nattached > i)
+				break;
+
+			if (GetBackgroundWorkerPid(parallel_workers[i].handle, &pid) == BGWH_STOPPED)
+			{
+				ereport(WARNING,
+						(errmsg("parallel apply worker exited during startup, applying changes serially")));
+				goto fail;
+			}
+
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   1000L);
+
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * The upstream sends the metadata of a relation only once per session.
+	 * What it sent before now, e.g. in the transactions up to
+	 * parallel_resume_lsn we applied ourselves, the workers get from us.
+	 */
+	msgs = bdr_remote_relation_messages();
+	foreach(lc, msgs)
+	{
+		StringInfo	msg = (StringInfo) lfirst(lc);
+
+		for (i = 0; i < nworkers; i++)
+			parallel_apply_send(i, msg->data, msg->len);
+
+		pfree(msg->data);
+	}
+	list_free_deep(msgs);
+
+	elog(DEBUG1, "started %d parallel apply workers", nworkers);
+
+	return true;
+
+fail:
+	for (i = 0; i < parallel_nworkers; i++)
+		TerminateBackgroundWorker(parallel_workers[i].handle);
+	parallel_nworkers = 0;
+
+	/* keep a private copy of the shared state, for lack of anything better */
+	parallel_shared = palloc(sizeof(BdrApplyParallelShared));
+	memcpy(parallel_shared, shared, sizeof(BdrApplyParallelShared));
+
+	dsm_detach(parallel_seg);
+	parallel_seg = NULL;
+
+	parallel_apply_disabled = true;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return false;
+}
+
+/*
+ * Hand a remote action to the parallel apply worker applying its
+ * transaction, or apply it ourselves where that's necessary.
+ *
+ * Returns the action, like bdr_process_remote_action().
+ */
+char
+bdr_apply_parallel_dispatch(StringInfo s)
+{
+	StringInfoData msg = *s;
+	const char *data = s->data + s->cursor;
+	Size		len = s->len - s->cursor;
+	char		action;
+	int			i;
+
+	action = pq_getmsgbyte(&msg);
+
+	if (parallel_seg != NULL)
+		parallel_apply_check_workers(false);
+
+	/* in a transaction we apply ourselves, everything is as usual */
+	if (in_remote_xact && xact_worker == -1)
+	{
+		if (action == 'C')
+			in_remote_xact = false;
+		/* but the workers need to know relations for what comes later */
+		else if (action == 'R')
+		{
+			for (i = 0; i < parallel_nworkers; i++)
+				parallel_apply_send(i, data, len);
+		}
+		return bdr_process_remote_action(s);
+	}
+
+	switch (action)
+	{
+			/* BEGIN */
+		case 'B':
+			{
+				XLogRecPtr	origlsn;
+				StringInfoData buf;
+
+				Assert(!in_remote_xact);
+				in_remote_xact = true;
+
+				pq_getmsgint(&msg, 4);	/* flags */
+				origlsn = pq_getmsgint64(&msg);
+
+				/*
+				 * Apply what was in progress when the apply worker last
+				 * exited ourselves, in case a parallel apply worker failed on
+				 * it; and everything if we can't have parallel apply workers.
+				 */
+				if (parallel_apply_disabled ||
+					origlsn <= parallel_apply_worker->parallel_resume_lsn ||
+					(parallel_seg == NULL && !parallel_apply_start()))
+				{
+					xact_worker = -1;
+					return bdr_process_remote_action(s);
+				}
+
+				/* notice changes to the relations' replica identity */
+				AcceptInvalidationMessages();
+				parallel_apply_forget_writes();
+
+				xact_worker = parallel_apply_idle_worker();
+				xact_seq = ++last_seq;
+				xact_waits_for = 0;
+				xact_serial = false;
+				last_seq_lsn = origlsn;
+
+				initStringInfo(&buf);
+				pq_sendbyte(&buf, 'q');
+				pq_sendint64(&buf, xact_seq);
+				parallel_apply_send(xact_worker, buf.data, buf.len);
+				pfree(buf.data);
+
+				parallel_workers[xact_worker].last_seq = xact_seq;
+				parallel_apply_send(xact_worker, data, len);
+				break;
+			}
+			/* COMMIT */
+		case 'C':
+			Assert(in_remote_xact);
+			parallel_apply_send(xact_worker, data, len);
+			in_remote_xact = false;
+
+			/*
+			 * Nothing after a transaction that possibly replicated DDL may be
+			 * handed out before it committed. The replica identity of the
+			 * relations might have changed, too.
+			 */
+			if (xact_serial)
+			{
+				HASH_SEQ_STATUS status;
+				ParallelApplyRel *rel;
+
+				parallel_apply_wait_for(xact_seq);
+
+				hash_seq_init(&status, ParallelApplyRelHash);
+				while ((rel = (ParallelApplyRel *) hash_seq_search(&status)) != NULL)
+					rel->stale = true;
+			}
+			break;
+			/* INSERT, UPDATE, DELETE */
+		case 'I':
+		case 'U':
+		case 'D':
+			Assert(in_remote_xact);
+			parallel_apply_track_change(&msg, action);
+			parallel_apply_send(xact_worker, data, len);
+			break;
+		case 'M':
+			if (!in_remote_xact)
+			{
+				/*
+				 * Messages outside of transactions, e.g. for the global DDL
+				 * lock, are handled in order with the transactions around
+				 * them, by us.
+				 */
+				if (parallel_seg != NULL)
+					parallel_apply_wait_for(last_seq);
+				return bdr_process_remote_action(s);
+			}
+
+			/* handlers may do anything, so no concurrency there */
+			parallel_apply_serialize_xact();
+			parallel_apply_send(xact_worker, data, len);
+			break;
+			/* relation metadata */
+		case 'R':
+			/* we need to know it as well as the parallel apply workers */
+			for (i = 0; i < parallel_nworkers; i++)
+				parallel_apply_send(i, data, len);
+			return bdr_process_remote_action(s);
+			/* chunk of a large value */
+		case 'V':
+			Assert(in_remote_xact);
+			parallel_apply_send(xact_worker, data, len);
+			break;
+		default:
+			elog(ERROR, "unknown action of type %c", action);
+	}
+
+	return action;
+}
+
+/*
+ * Whether there are transactions handed to parallel apply workers that
+ * haven't committed yet.
+ */
+bool
+bdr_apply_parallel_pending(void)
+{
+	if (parallel_seg == NULL)
+		return false;
+
+	return !parallel_apply_committed(last_seq);
+}
+
+/*
+ * Return the end of the last transaction committed by a parallel apply
+ * worker, on the upstream and locally, if there's been one since the last
+ * call.
+ */
+bool
+bdr_apply_parallel_progress(XLogRecPtr *remote_end, XLogRecPtr *local_end)
+{
+	if (parallel_seg == NULL)
+		return false;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	*remote_end = parallel_shared->remote_end;
+	*local_end = parallel_shared->local_end;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	if (*remote_end <= last_progress_end)
+		return false;
+
+	last_progress_end = *remote_end;
+	return true;
+}
+
+/*
+ * Send a message to a parallel apply worker, waiting for room in its queue.
+ *
+ * Meanwhile we keep receiving from the upstream, see bdr_apply_wait().
+ */
+static void
+parallel_apply_send(int worker, const char *data, Size len)
+{
+	shm_mq_result res;
+
+	for (;;)
+	{
+		ResetLatch(&MyProc->procLatch);
+
+		/* a partially sent message is continued with the same arguments */
+		res = shm_mq_send(parallel_workers[worker].mqh, len, data, true);
+
+		if (res != SHM_MQ_WOULD_BLOCK)
+			break;
+
+		parallel_apply_check_workers(true);
+
+		(void) bdr_apply_wait(1000L);
+
+		if (got_SIGTERM)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (res != SHM_MQ_SUCCESS)
+		elog(ERROR, "parallel apply worker %d exited unexpectedly", worker);
+}
+
+/*
+ * Tell the worker applying the current transaction to wait for the commit of
+ * the transaction numbered 'seq' before applying the next change.
+ */
+static void
+parallel_apply_send_wait(uint64 seq)
+{
+	StringInfoData buf;
+
+	if (seq <= xact_waits_for || parallel_apply_committed(seq))
+		return;
+
+	initStringInfo(&buf);
+	pq_sendbyte(&buf, 'w');
+	pq_sendint64(&buf, seq);
+	parallel_apply_send(xact_worker, buf.data, buf.len);
+	pfree(buf.data);
+
+	xact_waits_for = seq;
+}
+
+/*
+ * Error out if a parallel apply worker exited, which makes all of them exit.
+ *
+ * Workers that exit normally flag that on their way out. Checking whether
+ * the workers are still running as well catches those that didn't get that
+ * far.
+ */
+static void
+parallel_apply_check_workers(bool check_handles)
+{
+	bool		failed;
+	int			i;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	failed = parallel_shared->failed;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	if (!failed && check_handles)
+	{
+		for (i = 0; i < parallel_nworkers; i++)
+		{
+			pid_t		pid;
+
+			if (GetBackgroundWorkerPid(parallel_workers[i].handle, &pid) == BGWH_STOPPED)
+				failed = true;
+		}
+	}
+
+	if (failed)
+		ereport(ERROR,
+				(errmsg("a parallel apply worker exited unexpectedly"),
+				 errdetail("The transactions in progress will be applied by the apply worker after restarting.")));
+}
+
+/*
+ * Whether the transaction numbered 'seq' has committed.
+ */
+static bool
+parallel_apply_committed(uint64 seq)
+{
+	uint64		next_commit;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	next_commit = parallel_shared->next_commit;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	return seq < next_commit;
+}
+
+/*
+ * Wait in the apply worker for the transaction numbered 'seq', and thus all
+ * before it, to have committed, receiving from the upstream meanwhile.
+ */
+static void
+parallel_apply_wait_for(uint64 seq)
+{
+	for (;;)
+	{
+		ResetLatch(&MyProc->procLatch);
+
+		parallel_apply_check_workers(true);
+
+		if (parallel_apply_committed(seq))
+			break;
+
+		(void) bdr_apply_wait(1000L);
+
+		if (got_SIGTERM)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Pick a parallel apply worker that isn't busy with a transaction, waiting
+ * for one to finish if there's none.
+ *
+ * Every transaction handed out before has been sent completely, so all of
+ * them can run to completion meanwhile.
+ */
+static int
+parallel_apply_idle_worker(void)
+{
+	for (;;)
+	{
+		uint64		next_commit;
+		int			i;
+
+		SpinLockAcquire(&parallel_shared->mutex);
+		next_commit = parallel_shared->next_commit;
+		SpinLockRelease(&parallel_shared->mutex);
+
+		/* round robin, so all workers keep their caches warm */
+		for (i = 0; i < parallel_nworkers; i++)
+		{
+			int			worker = (parallel_next_worker + i) % parallel_nworkers;
+
+			if (parallel_workers[worker].last_seq < next_commit)
+			{
+				parallel_next_worker = (worker + 1) % parallel_nworkers;
+				return worker;
+			}
+		}
+
+		/* the oldest transaction in progress finishes first */
+		parallel_apply_wait_for(next_commit);
+	}
+}
+
+/*
+ * Make the current transaction wait for all earlier ones before applying the
+ * next change, and everything after it wait for its commit.
+ */
+static void
+parallel_apply_serialize_xact(void)
+{
+	if (xact_serial)
+		return;
+
+	xact_serial = true;
+
+	if (xact_seq > 1)
+		parallel_apply_send_wait(xact_seq - 1);
+}
+
+/*
+ * Record which rows an INSERT, UPDATE or DELETE of the current transaction
+ * writes, after the action byte, and have the transaction wait for the
+ * earlier ones that wrote the same rows first.
+ *
+ * UPDATEs write the row with the old key as well as the new one; if the key
+ * didn't change, only the new tuple is sent. A change we can't determine
+ * all keys of counts as a write of every row in the relation. That includes
+ * UPDATEs and DELETEs of relations with several unique indexes, the old
+ * row's values of the other indexes' columns aren't sent.
+ */
+static void
+parallel_apply_track_change(StringInfo s, char action)
+{
+	const char *nspname;
+	const char *relname;
+	ParallelApplyRel *rel;
+	uint32		hashes[BDR_APPLY_PARALLEL_MAX_INDEXES + 1];
+	int			nhashes = 0;
+	bool		unkeyed = false;
+	uint64		depends_on;
+	char		kind;
+	int			i;
+
+	bdr_read_remote_relation(s, &nspname, &relname);
+
+	rel = parallel_apply_get_rel(nspname, relname);
+
+	if (rel->serial)
+	{
+		parallel_apply_serialize_xact();
+		return;
+	}
+
+	kind = pq_getmsgbyte(s);
+
+	if (action != 'I' && rel->nindexes > 1)
+		unkeyed = true;
+	else
+	{
+		if (action == 'U' && kind == 'K')
+		{
+			parallel_apply_read_keys(s, rel, hashes, &nhashes);
+			kind = pq_getmsgbyte(s);
+		}
+
+		if (kind == 'N' || kind == 'K')
+		{
+			if (!parallel_apply_read_keys(s, rel, hashes, &nhashes))
+			{
+				/* an unchanged key isn't sent along with the new tuple */
+				if (action != 'U' || nhashes == 0)
+					unkeyed = true;
+			}
+		}
+		else
+			unkeyed = true;		/* DELETE without key, it's skipped anyway */
+	}
+
+	if (unkeyed)
+	{
+		depends_on = rel->last_write;
+		rel->last_unkeyed_write = xact_seq;
+	}
+	else
+	{
+		depends_on = rel->last_unkeyed_write;
+
+		for (i = 0; i < nhashes; i++)
+		{
+			ParallelApplyWriteKey key;
+			ParallelApplyWrite *write;
+			bool		found;
+
+			key.relid = rel->relid;
+			key.hash = hashes[i];
+
+			write = hash_search(ParallelApplyWriteHash, &key, HASH_ENTER,
+								&found);
+			if (found && write->seq > depends_on)
+				depends_on = write->seq;
+			write->seq = xact_seq;
+		}
+	}
+	rel->last_write = xact_seq;
+
+	if (depends_on != 0 && depends_on != xact_seq)
+		parallel_apply_send_wait(depends_on);
+}
+
+/*
+ * Look up what we know about a relation changes arrive for, finding out its
+ * unique indexes if necessary.
+ */
+static ParallelApplyRel *
+parallel_apply_get_rel(const char *nspname, const char *relname)
+{
+	ParallelApplyRelKey key;
+	ParallelApplyRel *rel;
+	bool		found;
+
+	memset(&key, 0, sizeof(key));
+	strlcpy(NameStr(key.nspname), nspname, NAMEDATALEN);
+	strlcpy(NameStr(key.relname), relname, NAMEDATALEN);
+
+	rel = hash_search(ParallelApplyRelHash, &key, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		rel->relid = InvalidOid;
+		rel->serial = false;
+		rel->nindexes = 0;
+		rel->last_write = 0;
+		rel->last_unkeyed_write = 0;
+		rel->stale = true;
+	}
+	else if (rel->stale)
+	{
+		/*
+		 * The key might change. Rows written so far can't be told apart by
+		 * the new one, so they count as rows of unknown key.
+		 */
+		rel->last_unkeyed_write = rel->last_write;
+	}
+
+	if (rel->stale)
+		parallel_apply_lookup_rel(rel);
+
+	return rel;
+}
+
+/*
+ * Find out the columns of the local relation's unique indexes, the replica
+ * identity index first.
+ *
+ * The relation might be locked by a parallel apply worker replaying DDL on
+ * it, which might need us to hand it further changes to commit, so we don't
+ * wait for its lock. Until we get it all changes count as rows of unknown
+ * key.
+ */
+static void
+parallel_apply_lookup_rel(ParallelApplyRel *rel)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	Relation	r;
+	Oid			relid;
+
+	rel->serial = false;
+	rel->nindexes = 0;
+
+	/* changes to BDR's catalogs replicate DDL, sequences etc */
+	if (strcmp(NameStr(rel->key.nspname), "bdr") == 0)
+	{
+		rel->serial = true;
+		rel->stale = false;
+		return;
+	}
+
+	StartTransactionCommand();
+
+	relid = RangeVarGetRelid(makeRangeVar(NameStr(rel->key.nspname),
+										  NameStr(rel->key.relname), -1),
+							 NoLock, true);
+	rel->relid = relid;
+
+	if (!OidIsValid(relid))
+	{
+		/* applying the change will fail, let that happen in order */
+		rel->serial = true;
+		rel->stale = false;
+	}
+	else if (ConditionalLockRelationOid(relid, AccessShareLock))
+	{
+		Oid			idxoid;
+		List	   *indexoidlist;
+		ListCell   *lc;
+
+		r = heap_open(relid, NoLock);
+
+		idxoid = bdr_replident_index(r);
+
+		if (r->rd_rel->relkind != RELKIND_RELATION)
+			rel->serial = true;
+		else if (OidIsValid(idxoid))
+		{
+			rel->nindexes = 1;
+			parallel_apply_index_keys(rel, idxoid, &rel->indexes[0]);
+
+			/*
+			 * Conflicts on the other unique indexes are resolved against the
+			 * row they find as well, so they need to be applied in order, too.
+			 * Indexes that aren't valid yet might already be checked.
+			 */
+			indexoidlist = RelationGetIndexList(r);
+
+			foreach(lc, indexoidlist)
+			{
+				Oid			indexoid = lfirst_oid(lc);
+
+				if (indexoid == idxoid)
+					continue;
+
+				if (rel->nindexes == BDR_APPLY_PARALLEL_MAX_INDEXES)
+				{
+					rel->serial = true;
+					break;
+				}
+
+				if (parallel_apply_index_keys(rel, indexoid,
+											  &rel->indexes[rel->nindexes]))
+					rel->nindexes++;
+
+				if (rel->serial)
+					break;
+			}
+
+			list_free(indexoidlist);
+
+			/* we'll wait for all earlier transactions anyway */
+			if (rel->serial)
+				rel->nindexes = 0;
+		}
+
+		heap_close(r, AccessShareLock);
+		rel->stale = false;
+	}
+
+	CommitTransactionCommand();
+	CurrentResourceOwner = bdr_saved_resowner;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Look up the columns of an index if it's unique, returning whether it is.
+ * Unique indexes with expression columns and exclusion constraints can't be
+ * told apart by the columns sent, they mark the relation to be applied
+ * serially.
+ */
+static bool
+parallel_apply_index_keys(ParallelApplyRel *rel, Oid indexoid,
+						  ParallelApplyRelIndex *keys)
+{
+	HeapTuple	indexTuple;
+	Form_pg_index index;
+	bool		unique;
+	int			i;
+
+	indexTuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(indexoid));
+	if (!HeapTupleIsValid(indexTuple))
+		elog(ERROR, "cache lookup failed for index %u", indexoid);
+	index = (Form_pg_index) GETSTRUCT(indexTuple);
+
+	unique = index->indisunique || index->indisexclusion;
+
+	keys->nkeys = 0;
+
+	if (unique)
+	{
+		for (i = 0; i < index->indnatts; i++)
+		{
+			/* expression index columns don't correspond to a column */
+			if (index->indkey.values[i] <= 0)
+				break;
+			keys->keys[i] = index->indkey.values[i] - 1;
+		}
+
+		if (i == index->indnatts && !index->indisexclusion)
+			keys->nkeys = i;
+		else
+			rel->serial = true;
+	}
+
+	ReleaseSysCache(indexTuple);
+
+	return unique;
+}
+
+/*
+ * Relcache invalidation callback, the replica identity of the relation
+ * might have changed.
+ */
+static void
+parallel_apply_rel_inval_cb(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	ParallelApplyRel *rel;
+
+	hash_seq_init(&status, ParallelApplyRelHash);
+
+	while ((rel = (ParallelApplyRel *) hash_seq_search(&status)) != NULL)
+	{
+		if (relid == InvalidOid || rel->relid == relid)
+			rel->stale = true;
+	}
+}
+
+/*
+ * Read a tuple of a change and hash the key columns of each of the
+ * relation's unique indexes, appending the hashes to hashes[*nhashes].
+ *
+ * The values are hashed as sent, which is the same for the same value as
+ * long as the connection lasts. Keys containing a NULL can't conflict and
+ * aren't hashed. Returns false, without appending anything, if not all key
+ * columns are there to hash.
+ */
+static bool
+parallel_apply_read_keys(StringInfo s, ParallelApplyRel *rel,
+						 uint32 *hashes, int *nhashes)
+{
+	uint32		h[BDR_APPLY_PARALLEL_MAX_INDEXES];
+	int			nfound[BDR_APPLY_PARALLEL_MAX_INDEXES];
+	bool		hasnull[BDR_APPLY_PARALLEL_MAX_INDEXES];
+	int			natts;
+	int			i;
+	int			n;
+	int			k;
+
+	if (pq_getmsgbyte(s) != 'T')
+		elog(ERROR, "expected TUPLE");
+
+	for (n = 0; n < rel->nindexes; n++)
+	{
+		/* the same values in different indexes don't conflict */
+		h[n] = (uint32) n;
+		nfound[n] = 0;
+		hasnull[n] = false;
+	}
+
+	natts = pq_getmsgint(s, 4);
+
+	for (i = 0; i < natts; i++)
+	{
+		char		kind = pq_getmsgbyte(s);
+		const char *data = NULL;
+		int			len = 0;
+
+		switch (kind)
+		{
+			case 'n':			/* null */
+			case 'u':			/* unchanged column */
+				break;
+			case 'c':			/* sent in chunks before */
+				len = pq_getmsgint(s, 4);
+				break;
+			case 'b':			/* binary format */
+			case 's':			/* send/recv format */
+			case 't':			/* text format */
+				len = pq_getmsgint(s, 4);
+				data = pq_getmsgbytes(s, len);
+				break;
+			default:
+				elog(ERROR, "unknown column type '%c'", kind);
+		}
+
+		if (data == NULL && kind != 'n')
+			continue;
+
+		for (n = 0; n < rel->nindexes; n++)
+		{
+			ParallelApplyRelIndex *index = &rel->indexes[n];
+
+			for (k = 0; k < index->nkeys; k++)
+			{
+				if (index->keys[k] != i)
+					continue;
+
+				nfound[n]++;
+
+				if (data == NULL)
+				{
+					hasnull[n] = true;
+					continue;
+				}
+
+				/* the key columns' order doesn't matter for telling keys apart */
+				h[n] = (h[n] << 1) | (h[n] >> 31);
+				h[n] ^= DatumGetUInt32(hash_any((const unsigned char *) data, len));
+			}
+		}
+	}
+
+	if (rel->nindexes == 0)
+		return false;
+
+	for (n = 0; n < rel->nindexes; n++)
+	{
+		if (rel->indexes[n].nkeys == 0 || nfound[n] != rel->indexes[n].nkeys)
+			return false;
+	}
+
+	for (n = 0; n < rel->nindexes; n++)
+	{
+		if (!hasnull[n])
+			hashes[(*nhashes)++] = h[n];
+	}
+
+	return true;
+}
+
+/*
+ * Forget about rows written by committed transactions once there are many,
+ * nothing needs to wait for those anymore.
+ */
+static void
+parallel_apply_forget_writes(void)
+{
+	HASH_SEQ_STATUS status;
+	ParallelApplyWrite *write;
+
+	if (hash_get_num_entries(ParallelApplyWriteHash) < BDR_APPLY_PARALLEL_MAX_WRITES)
+		return;
+
+	hash_seq_init(&status, ParallelApplyWriteHash);
+
+	while ((write = (ParallelApplyWrite *) hash_seq_search(&status)) != NULL)
+	{
+		if (parallel_apply_committed(write->seq))
+			hash_search(ParallelApplyWriteHash, &write->key, HASH_REMOVE,
+						NULL);
+	}
+}
+
+/*
+ * Entry point of a parallel apply worker.
+ *
+ * Attaches to the apply worker's shared memory segment, claims the next
+ * queue and applies the transactions it receives there, until the apply
+ * worker goes away.
+ */
+void
+bdr_apply_parallel_worker_main(Datum main_arg)
+{
+	shm_toc    *toc;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	BdrApplyParallelShared *shared;
+
+	/* the apply worker stops us with SIGTERM, abort whatever we're doing */
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "bdr parallel apply top-level resource owner");
+
+	parallel_seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (parallel_seg == NULL)
+		elog(ERROR, "could not map dynamic shared memory segment");
+	dsm_pin_mapping(parallel_seg);
+
+	toc = shm_toc_attach(BDR_APPLY_PARALLEL_MAGIC,
+						 dsm_segment_address(parallel_seg));
+	if (toc == NULL)
+		elog(ERROR, "bad magic number in dynamic shared memory segment");
+
+	shared = shm_toc_lookup(toc, 0);
+	parallel_shared = shared;
+
+	SpinLockAcquire(&shared->mutex);
+	my_worker = shared->nattached++;
+	if (my_worker < shared->nworkers)
+		shared->workers[my_worker].proc = MyProc;
+	SpinLockRelease(&shared->mutex);
+
+	if (my_worker >= shared->nworkers)
+		elog(ERROR, "too many parallel apply workers");
+
+	on_dsm_detach(parallel_seg, parallel_worker_detach, (Datum) 0);
+
+	mq = shm_toc_lookup(toc, my_worker + 1);
+	shm_mq_set_receiver(mq, MyProc);
+	mqh = shm_mq_attach(mq, parallel_seg, NULL);
+
+	SetLatch(&shared->apply_proc->procLatch);
+
+	MyProcPort = (Port *) calloc(1, sizeof(Port));
+	BackgroundWorkerInitializeConnection(NameStr(shared->dbname), NULL);
+	MyProcPort->database_name = MemoryContextStrdup(TopMemoryContext,
+													NameStr(shared->dbname));
+
+	bdr_is_parallel_apply_worker = true;
+	/* we're applying changes as the apply worker would */
+	bdr_worker_type = BDR_WORKER_APPLY;
+
+	bdr_bgworker_init_session(BDR_WORKER_APPLY);
+
+	bdr_apply_init_parallel_worker(&BdrWorkerCtl->slots[shared->apply_slot].data.apply,
+								   shared->upstream_origin_id,
+								   shared->origin_sysid,
+								   shared->origin_timeline,
+								   shared->origin_dboid,
+								   shared->relation_dictionary,
+								   shared->value_chunks);
+
+	for (;;)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+		StringInfoData s;
+
+		MemoryContextSwitchTo(MessageContext);
+
+		res = shm_mq_receive(mqh, &nbytes, &data, false);
+
+		/* the apply worker went away, anything in progress is rolled back */
+		if (res != SHM_MQ_SUCCESS)
+			break;
+
+		s.data = data;
+		s.len = nbytes;
+		s.maxlen = -1;
+		s.cursor = 0;
+
+		switch (s.data[0])
+		{
+				/* the transaction that's following */
+			case 'q':
+				pq_getmsgbyte(&s);
+				my_seq = pq_getmsgint64(&s);
+
+				SpinLockAcquire(&shared->mutex);
+				shared->workers[my_worker].seq = my_seq;
+				shared->workers[my_worker].xid = InvalidTransactionId;
+				SpinLockRelease(&shared->mutex);
+				break;
+				/* wait for an earlier transaction to commit */
+			case 'w':
+				pq_getmsgbyte(&s);
+				parallel_worker_wait_for(pq_getmsgint64(&s));
+				break;
+			default:
+				if (bdr_process_remote_action(&s) == 'C')
+					MemoryContextReset(MessageContext);
+				break;
+		}
+	}
+
+	proc_exit(1);
+}
+
+/*
+ * Make the local transaction we're applying a remote one in known, so others
+ * can wait for it. Called when it starts, before it could hold any locks.
+ */
+void
+bdr_apply_parallel_xact_started(void)
+{
+	TransactionId xid = GetTopTransactionId();
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	parallel_shared->workers[my_worker].xid = xid;
+	SpinLockRelease(&parallel_shared->mutex);
+}
+
+/*
+ * Wait for all transactions before ours to have committed, so ours can
+ * commit next.
+ */
+void
+bdr_apply_parallel_wait_turn(void)
+{
+	parallel_worker_wait_for(my_seq - 1);
+
+	/*
+	 * Once committed, the replication identifier needs to be advanced and
+	 * the next transaction be let through; a SIGTERM mustn't come between.
+	 */
+	HOLD_INTERRUPTS();
+}
+
+/*
+ * Let the next transaction commit after ours did, see
+ * bdr_apply_parallel_wait_turn().
+ */
+void
+bdr_apply_parallel_commit_done(XLogRecPtr remote_end, XLogRecPtr local_end)
+{
+	int			i;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	Assert(parallel_shared->next_commit == my_seq);
+	parallel_shared->next_commit = my_seq + 1;
+	parallel_shared->remote_end = remote_end;
+	parallel_shared->local_end = local_end;
+	parallel_shared->workers[my_worker].seq = 0;
+	parallel_shared->workers[my_worker].xid = InvalidTransactionId;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	my_seq = 0;
+
+	/* whoever might wait for us */
+	SetLatch(&parallel_shared->apply_proc->procLatch);
+	for (i = 0; i < parallel_shared->nworkers; i++)
+	{
+		PGPROC	   *proc = parallel_shared->workers[i].proc;
+
+		if (proc != NULL && proc != MyProc)
+			SetLatch(&proc->procLatch);
+	}
+
+	RESUME_INTERRUPTS();
+}
+
+/*
+ * Wait in a parallel apply worker for the transaction numbered 'seq', and
+ * thus all before it, to have committed.
+ *
+ * The transaction committing next is waited for on its transaction lock once
+ * it started, so the deadlock detector sees what we're waiting for. The
+ * others can only commit after it.
+ */
+static void
+parallel_worker_wait_for(uint64 seq)
+{
+	for (;;)
+	{
+		uint64		next_commit;
+		bool		failed;
+		TransactionId xid = InvalidTransactionId;
+		int			i;
+		int			rc;
+
+		ResetLatch(&MyProc->procLatch);
+
+		SpinLockAcquire(&parallel_shared->mutex);
+		next_commit = parallel_shared->next_commit;
+		failed = parallel_shared->failed;
+		for (i = 0; i < parallel_shared->nworkers; i++)
+		{
+			if (parallel_shared->workers[i].seq == next_commit)
+				xid = parallel_shared->workers[i].xid;
+		}
+		SpinLockRelease(&parallel_shared->mutex);
+
+		if (seq < next_commit)
+			break;
+
+		if (failed)
+			elog(ERROR, "another parallel apply worker exited unexpectedly");
+
+		if (TransactionIdIsValid(xid) && TransactionIdIsInProgress(xid))
+		{
+			XactLockTableWait(xid, NULL, NULL, XLTW_None);
+			continue;
+		}
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Detach callback of a parallel apply worker, which only exits when it
+ * failed or the apply worker exited. Let everyone waiting know.
+ */
+static void
+parallel_worker_detach(dsm_segment *seg, Datum arg)
+{
+	int			i;
+
+	SpinLockAcquire(&parallel_shared->mutex);
+	parallel_shared->failed = true;
+	SpinLockRelease(&parallel_shared->mutex);
+
+	SetLatch(&parallel_shared->apply_proc->procLatch);
+	for (i = 0; i < parallel_shared->nworkers; i++)
+	{
+		PGPROC	   *proc = parallel_shared->workers[i].proc;
+
+		if (proc != NULL && proc != MyProc)
+			SetLatch(&proc->procLatch);
+	}
+}
@@ -31,15 +31,63 @@
 
 #include "replication/replication_identifier.h"
 
+#include "storage/barrier.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/guc.h"
 #include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/resowner.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
 
+/*
+ * Identity of the node behind a replication identifier, as encoded in the
+ * identifier's name.
+ */
+typedef struct BdrNodeIdentity
+{
+	/*
+	 * Incremented before and after every change, so it's odd while the entry
+	 * is being written. Readers don't lock, they retry instead.
+	 */
+	uint32		changecount;
+	bool		valid;
+	uint64		sysid;
+	TimeLineID	timeline;
+	Oid			dboid;
+	Oid			local_dboid;
+} BdrNodeIdentity;
+
+/*
+ * Shared memory map from RepNodeId to node identity.
+ *
+ * Replication identifiers are numbered from 1 upwards, reusing the numbers
+ * of dropped identifiers, so they stay small. Identifiers beyond the end of
+ * the array are looked up in the catalog every time.
+ */
+typedef struct BdrNodeIdentityControl
+{
+	/* serializes writers */
+	slock_t		mutex;
+	BdrNodeIdentity entries[FLEXIBLE_ARRAY_MEMBER];
+} BdrNodeIdentityControl;
+
+static BdrNodeIdentityControl *BdrNodeIdentityCtl = NULL;
+
+/* how many entries have we built shmem for */
+static Size bdr_node_identity_nentries = 0;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
 static int getattno(const char *colname);
 static char* bdr_textarr_to_identliststr(ArrayType *textarray);
+static void bdr_node_identity_shmem_startup(void);
 
 
 /* GetSysCacheOid equivalent that errors out if nothing is found */
@@ -262,6 +310,63 @@ bdr_get_node_identity_by_name(const char *node_name, uint64 *sysid, TimeLineID *
 	return found;
 }
 
+/*
+ * Read bdr.bdr_node_relays into a list of palloc'd BDRNodeRelay entries.
+ *
+ * bdr_node_relays is a user catalog table, so this works in the output
+ * plugin too, where it sees the relays as of the decoding position.
+ *
+ * You must be in a running transaction.
+ */
+List *
+bdr_read_node_relays(void)
+{
+	List	   *relays = NIL;
+	HeapTuple	tuple;
+	Relation	rel;
+	RangeVar   *rv;
+	SysScanDesc scan;
+	TupleDesc	desc;
+
+	Assert(IsTransactionState());
+
+	rv = makeRangeVar("bdr", "bdr_node_relays", -1);
+	rel = heap_openrv(rv, AccessShareLock);
+	desc = RelationGetDescr(rel);
+
+	scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+	while ((tuple = systable_getnext(scan)) != NULL)
+	{
+		BDRNodeRelay *relay = palloc(sizeof(BDRNodeRelay));
+		bool		isnull;
+		char	   *sysid_str;
+
+		sysid_str = TextDatumGetCString(fastgetattr(tuple, 1, desc, &isnull));
+		if (sscanf(sysid_str, UINT64_FORMAT, &relay->node.sysid) != 1)
+			elog(ERROR, "bdr.bdr_node_relays.node_sysid didn't parse to integer; shouldn't happen");
+		relay->node.timeline =
+			DatumGetObjectId(fastgetattr(tuple, 2, desc, &isnull));
+		relay->node.dboid =
+			DatumGetObjectId(fastgetattr(tuple, 3, desc, &isnull));
+
+		sysid_str = TextDatumGetCString(fastgetattr(tuple, 4, desc, &isnull));
+		if (sscanf(sysid_str, UINT64_FORMAT, &relay->relay.sysid) != 1)
+			elog(ERROR, "bdr.bdr_node_relays.relay_sysid didn't parse to integer; shouldn't happen");
+		relay->relay.timeline =
+			DatumGetObjectId(fastgetattr(tuple, 5, desc, &isnull));
+		relay->relay.dboid =
+			DatumGetObjectId(fastgetattr(tuple, 6, desc, &isnull));
+
+		relays = lappend(relays, relay);
+	}
+
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	return relays;
+}
+
 /* Free the BDRNodeInfo pointer including its properties. */
 void
 bdr_bdr_node_free(BDRNodeInfo *node)
@@ -335,10 +440,256 @@ bdr_nodes_set_local_status(char status)
 		CommitTransactionCommand();
 }
 
+/*
+ * Record in bdr.bdr_relayed_progress how far we replayed the changes a relay
+ * node sent us, as part of the current transaction applying a transaction it
+ * forwarded from another node.
+ *
+ * Such a transaction is replayed under the replication identifier of the
+ * node it originated on, so its commit record doesn't advance the relay's.
+ * This is what keeps us from replaying it a second time after a crash, see
+ * bdr_get_relayed_progress().
+ */
+void
+bdr_set_relayed_progress(uint64 sysid, TimeLineID tli, Oid dboid,
+						 XLogRecPtr lsn)
+{
+	int			spi_ret;
+	Oid			argtypes[] = { TEXTOID, OIDOID, OIDOID, LSNOID };
+	Datum		values[4];
+	char		sysid_str[33];
+	bool		spi_pushed;
+
+	Assert(IsTransactionState());
+
+	spi_pushed = SPI_push_conditional();
+	SPI_connect();
+
+	snprintf(sysid_str, sizeof(sysid_str), UINT64_FORMAT, sysid);
+	sysid_str[sizeof(sysid_str)-1] = '\0';
+
+	values[0] = CStringGetTextDatum(sysid_str);
+	values[1] = ObjectIdGetDatum(tli);
+	values[2] = ObjectIdGetDatum(dboid);
+	values[3] = LSNGetDatum(lsn);
+
+	spi_ret = SPI_execute_with_args(
+							   "UPDATE bdr.bdr_relayed_progress"
+							   "   SET remote_lsn = $4"
+							   " WHERE node_sysid = $1"
+							   "   AND node_timeline = $2"
+							   "   AND node_dboid = $3;",
+							   4, argtypes, values, NULL, false, 0);
+
+	if (spi_ret != SPI_OK_UPDATE)
+		elog(ERROR, "Unable to update bdr.bdr_relayed_progress: SPI error %d",
+			 spi_ret);
+
+	if (SPI_processed == 0)
+	{
+		spi_ret = SPI_execute_with_args(
+								   "INSERT INTO bdr.bdr_relayed_progress"
+								   "   (node_sysid, node_timeline, node_dboid, remote_lsn)"
+								   " VALUES ($1, $2, $3, $4);",
+								   4, argtypes, values, NULL, false, 0);
+
+		if (spi_ret != SPI_OK_INSERT)
+			elog(ERROR, "Unable to insert into bdr.bdr_relayed_progress: SPI error %d",
+				 spi_ret);
+	}
+
+	SPI_finish();
+	SPI_pop_conditional(spi_pushed);
+}
+
+/*
+ * Look up how far we replayed the transactions a relay node forwarded to us
+ * from other nodes, see bdr_set_relayed_progress().
+ *
+ * Returns InvalidXLogRecPtr if none did.
+ */
+XLogRecPtr
+bdr_get_relayed_progress(uint64 sysid, TimeLineID tli, Oid dboid)
+{
+	int			spi_ret;
+	Oid			argtypes[] = { TEXTOID, OIDOID, OIDOID };
+	Datum		values[3];
+	char		sysid_str[33];
+	bool		isnull;
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+	bool		tx_started = false;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+
+	if (!IsTransactionState())
+	{
+		tx_started = true;
+		StartTransactionCommand();
+	}
+	SPI_connect();
+
+	snprintf(sysid_str, sizeof(sysid_str), UINT64_FORMAT, sysid);
+	sysid_str[sizeof(sysid_str)-1] = '\0';
+
+	values[0] = CStringGetTextDatum(sysid_str);
+	values[1] = ObjectIdGetDatum(tli);
+	values[2] = ObjectIdGetDatum(dboid);
+
+	spi_ret = SPI_execute_with_args(
+			"SELECT remote_lsn FROM bdr.bdr_relayed_progress "
+			"WHERE node_sysid = $1 AND node_timeline = $2 AND node_dboid = $3",
+			3, argtypes, values, NULL, true, 1);
+
+	if (spi_ret != SPI_OK_SELECT)
+		elog(ERROR, "Unable to query bdr.bdr_relayed_progress, SPI error %d",
+			 spi_ret);
+
+	if (SPI_processed > 0)
+	{
+		Datum		d = SPI_getbinval(SPI_tuptable->vals[0],
+									  SPI_tuptable->tupdesc, 1, &isnull);
+
+		if (!isnull)
+			lsn = DatumGetLSN(d);
+	}
+
+	SPI_finish();
+	if (tx_started)
+	{
+		CommitTransactionCommand();
+		CurrentResourceOwner = oldowner;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return lsn;
+}
+
+static Size
+bdr_node_identity_shmem_size(void)
+{
+	Size		size = 0;
+
+	size = add_size(size, offsetof(BdrNodeIdentityControl, entries));
+	size = add_size(size, mul_size(bdr_node_identity_nentries,
+								   sizeof(BdrNodeIdentity)));
+
+	return size;
+}
+
+/*
+ * Reserve shared memory for the identities of replication identifiers
+ * 1 to nentries - 1.
+ */
+void
+bdr_node_identity_shmem_init(Size nentries)
+{
+	Assert(process_shared_preload_libraries_in_progress);
+
+	bdr_node_identity_nentries = nentries;
+
+	RequestAddinShmemSpace(bdr_node_identity_shmem_size());
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = bdr_node_identity_shmem_startup;
+}
+
+static void
+bdr_node_identity_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook != NULL)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	BdrNodeIdentityCtl = ShmemInitStruct("bdr_node_identity",
+										 bdr_node_identity_shmem_size(),
+										 &found);
+	if (!found)
+	{
+		memset(BdrNodeIdentityCtl, 0, bdr_node_identity_shmem_size());
+		SpinLockInit(&BdrNodeIdentityCtl->mutex);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Remember the identity of the node behind a replication identifier.
+ *
+ * Called when BDR creates a replication identifier, which might reuse the
+ * number of a dropped one, and when a lookup had to go to the catalog.
+ */
+void
+bdr_node_identity_store(RepNodeId node_id, uint64 sysid, TimeLineID tli,
+						Oid dboid, Oid local_dboid)
+{
+	volatile BdrNodeIdentity *entry;
+
+	if (BdrNodeIdentityCtl == NULL || node_id >= bdr_node_identity_nentries)
+		return;
+
+	entry = &BdrNodeIdentityCtl->entries[node_id];
+
+	SpinLockAcquire(&BdrNodeIdentityCtl->mutex);
+	entry->changecount++;
+	pg_write_barrier();
+
+	entry->sysid = sysid;
+	entry->timeline = tli;
+	entry->dboid = dboid;
+	entry->local_dboid = local_dboid;
+	entry->valid = true;
+
+	pg_write_barrier();
+	entry->changecount++;
+	SpinLockRelease(&BdrNodeIdentityCtl->mutex);
+}
+
+/*
+ * Read the identity of the node behind a replication identifier from shared
+ * memory, without locking. Returns false if it's not known there.
+ */
+static bool
+bdr_node_identity_lookup(RepNodeId node_id, BdrNodeIdentity *identity)
+{
+	volatile BdrNodeIdentity *entry;
+
+	if (BdrNodeIdentityCtl == NULL || node_id >= bdr_node_identity_nentries)
+		return false;
+
+	entry = &BdrNodeIdentityCtl->entries[node_id];
+
+	for (;;)
+	{
+		uint32		before = entry->changecount;
+
+		pg_read_barrier();
+
+		identity->valid = entry->valid;
+		identity->sysid = entry->sysid;
+		identity->timeline = entry->timeline;
+		identity->dboid = entry->dboid;
+		identity->local_dboid = entry->local_dboid;
+
+		pg_read_barrier();
+
+		/* retry if a writer got in the way */
+		if ((before & 1) == 0 && before == entry->changecount)
+			break;
+
+		SPIN_DELAY();
+	}
+
+	return identity->valid;
+}
+
 /*
  * Given a node's local RepNodeId, get its globally unique identifier (sysid,
  * timeline id, database oid). Ignore identifiers local to databases other than
  * the active DB.
+ *
+ * This runs for every forwarded transaction and conflict, so the result is
+ * kept in shared memory and the catalog is only consulted the first time.
  */
 void
 bdr_fetch_sysid_via_node_id(RepNodeId node_id, uint64 *sysid, TimeLineID *tli,
@@ -353,33 +704,38 @@ bdr_fetch_sysid_via_node_id(RepNodeId node_id, uint64 *sysid, TimeLineID *tli,
 	}
 	else
 	{
-		char *riname;
+		BdrNodeIdentity identity;
+
+		if (!bdr_node_identity_lookup(node_id, &identity))
+		{
+			char *riname;
+			NameData replication_name;
 
-		uint64 remote_sysid;
-		Oid remote_dboid;
-		TimeLineID remote_tli;
-		Oid local_dboid;
-		NameData replication_name;
+			GetReplicationInfoByIdentifier(node_id, false, &riname);
 
-		GetReplicationInfoByIdentifier(node_id, false, &riname);
+			if (sscanf(riname, BDR_NODE_ID_FORMAT,
+					   &identity.sysid, &identity.timeline, &identity.dboid,
+					   &identity.local_dboid,
+					   NameStr(replication_name)) != 4)
+				elog(ERROR, "could not parse sysid: %s", riname);
+			pfree(riname);
 
-		if (sscanf(riname, BDR_NODE_ID_FORMAT,
-				   &remote_sysid, &remote_tli, &remote_dboid, &local_dboid,
-				   NameStr(replication_name)) != 4)
-			elog(ERROR, "could not parse sysid: %s", riname);
-		pfree(riname);
+			bdr_node_identity_store(node_id, identity.sysid,
+									identity.timeline, identity.dboid,
+									identity.local_dboid);
+		}
 
-		if (local_dboid != MyDatabaseId)
+		if (identity.local_dboid != MyDatabaseId)
 		{
 			ereport(ERROR,
 					(errmsg("lookup failed for replication identifier %u", node_id),
 					 errmsg("Replication identifier %u exists but is owned by another BDR node in the same PostgreSQL instance, with dboid %u. Current node oid is %u.",
-					 		node_id, local_dboid, MyDatabaseId)));
+					 		node_id, identity.local_dboid, MyDatabaseId)));
 		}
 
-		*sysid = remote_sysid;
-		*tli = remote_tli;
-		*dboid = remote_dboid;
+		*sysid = identity.sysid;
+		*tli = identity.timeline;
+		*dboid = identity.dboid;
 	}
 }
 
@@ -509,7 +865,8 @@ bdr_read_connection_configs()
 							 "  conn_sysid, conn_timeline, conn_dboid, "
 							 "  conn_dsn, conn_apply_delay, "
 							 "  conn_replication_sets, "
-							 "  conn_origin_dboid <> 0 AS origin_is_my_id "
+							 "  conn_origin_dboid <> 0 AS origin_is_my_id, "
+							 BDR_CONN_RELAYED_EXPR " AS relayed "
 							 "FROM bdr.bdr_connections "
 							 "INNER JOIN bdr.bdr_nodes "
 							 "  ON (conn_sysid = node_sysid AND "
@@ -587,6 +944,11 @@ bdr_read_connection_configs()
 		Assert(!isnull);
 		cfg->origin_is_my_id = DatumGetBool(tmp_datum);
 
+		tmp_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc,
+								  getattno("relayed"),
+								  &isnull);
+		Assert(!isnull);
+		cfg->relayed = DatumGetBool(tmp_datum);
 
 		cfg->dsn = SPI_getvalue(tuple,
 											 SPI_tuptable->tupdesc,
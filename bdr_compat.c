@@ -14,6 +14,20 @@
 
 #include "bdr.h"
 
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+
+#include "catalog/pg_type.h"
+
+#include "lib/stringinfo.h"
+
+#include "utils/builtins.h"
+
+PGDLLEXPORT Datum bdr_type_capabilities_sql(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(bdr_type_capabilities_sql);
+
 bool
 bdr_get_float4byval(void)
 {
@@ -53,3 +67,116 @@ bdr_get_bigendian(void)
 	return false;
 #endif
 }
+
+/*
+ * Alignment in bytes of a pg_type.typalign value on this server.
+ */
+int
+bdr_typalign_bytes(char typalign)
+{
+	switch (typalign)
+	{
+		case 'c':
+			return 1;
+		case 's':
+			return ALIGNOF_SHORT;
+		case 'i':
+			return ALIGNOF_INT;
+		case 'd':
+			return ALIGNOF_DOUBLE;
+	}
+
+	elog(ERROR, "invalid typalign '%c'", typalign);
+	return 0;					/* keep compiler quiet */
+}
+
+/*
+ * Does our receive function of a builtin type accept the send/recv format of
+ * the type of all major versions? Those of these types haven't changed since
+ * send/recv was introduced.
+ */
+static bool
+bdr_type_recv_stable(Oid typid)
+{
+	switch (typid)
+	{
+		case BOOLOID:
+		case BYTEAOID:
+		case CHAROID:
+		case NAMEOID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case TEXTOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case BPCHAROID:
+		case VARCHAROID:
+		case DATEOID:
+		case UUIDOID:
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Describe the builtin base types of this server, so the upstream can decide
+ * for each type on its own whether its values can be sent in binary or
+ * send/recv form, see decide_datum_transfer() in bdr_output.c.
+ *
+ * Returns a comma separated list of oid:typlen:alignment:byval:recv:stable
+ * entries, with the alignment in bytes and byval/recv/stable as 0 or 1. The
+ * last says whether we receive the type's send/recv format of any major
+ * version, see bdr_type_recv_stable(). The oids of builtin types never change
+ * meaning between releases, so they identify a type across versions.
+ *
+ * Must be called inside a transaction.
+ */
+char *
+bdr_type_capabilities(void)
+{
+	StringInfoData caps;
+	Relation	rel;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+
+	initStringInfo(&caps);
+
+	rel = heap_open(TypeRelationId, AccessShareLock);
+	scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		Form_pg_type typ = (Form_pg_type) GETSTRUCT(tuple);
+		Oid			typid = HeapTupleGetOid(tuple);
+
+		if (typid >= FirstNormalObjectId || typ->typtype != 'b')
+			continue;
+
+		if (caps.len > 0)
+			appendStringInfoChar(&caps, ',');
+		appendStringInfo(&caps, "%u:%d:%d:%d:%d:%d",
+						 typid, typ->typlen,
+						 bdr_typalign_bytes(typ->typalign),
+						 typ->typbyval ? 1 : 0,
+						 OidIsValid(typ->typreceive) ? 1 : 0,
+						 bdr_type_recv_stable(typid) ? 1 : 0);
+	}
+
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	return caps.data;
+}
+
+/*
+ * SQL-callable wrapper of bdr_type_capabilities(), showing what an apply
+ * worker of this node tells its upstream about our types.
+ */
+Datum
+bdr_type_capabilities_sql(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_TEXT_P(cstring_to_text(bdr_type_capabilities()));
+}
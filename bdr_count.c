@@ -43,6 +43,9 @@ typedef struct BdrCountSlot
 {
 	RepNodeId	node_id;
 
+	/* protects the counters, see BDR_COUNT_INCREMENT */
+	slock_t		mutex;
+
 	/* we use int64 to make sure we can export to sql, there is uint64 there */
 	int64		nr_commit;
 	int64		nr_rollback;
@@ -81,7 +84,7 @@ typedef struct BdrCountSerialize
 static const uint32 bdr_count_magic = 0x5e51A7;
 
 /* everytime the stored data format changes, increase */
-static const uint32 bdr_count_version = 2;
+static const uint32 bdr_count_version = 3;
 
 /* shortcut for the finding BdrCountControl in memory */
 static BdrCountControl *BdrCountCtl = NULL;
@@ -102,10 +105,16 @@ static void bdr_count_serialize(void);
 static void bdr_count_unserialize(void);
 
 #define BDR_COUNT_STAT_COLS 12
+#define BDR_WALSENDER_STAT_COLS 16
+#define BDR_WALSENDER_TXN_STAT_COLS 6
 
 PGDLLEXPORT Datum pg_stat_get_bdr(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_stat_get_bdr_walsender(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pg_stat_get_bdr_walsender_txn(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(pg_stat_get_bdr);
+PG_FUNCTION_INFO_V1(pg_stat_get_bdr_walsender);
+PG_FUNCTION_INFO_V1(pg_stat_get_bdr_walsender_txn);
 
 static Size
 bdr_count_shmem_size(void)
@@ -147,10 +156,16 @@ bdr_count_shmem_startup(void)
 								  &found);
 	if (!found)
 	{
+		size_t		i;
+
 		/* initialize */
 		memset(BdrCountCtl, 0, bdr_count_shmem_size());
 		BdrCountCtl->lock = LWLockAssign();
 		bdr_count_unserialize();
+
+		/* the stat file may contain the state of a spinlock, so init after */
+		for (i = 0; i < bdr_count_nnodes; i++)
+			SpinLockInit(&BdrCountCtl->slots[i].mutex);
 	}
 	LWLockRelease(AddinShmemInitLock);
 
@@ -223,70 +238,72 @@ out:
 /*
  * Statistic manipulation functions.
  *
- * We assume we don't have to do any locking for *our* slot since only one
- * backend will do writing there.
+ * The apply worker and its parallel apply workers all count into the slot of
+ * their upstream node, so the counters are only modified with the slot's
+ * spinlock held.
  */
+#define BDR_COUNT_INCREMENT(counter) \
+	do { \
+		BdrCountSlot *slot; \
+		Assert(MyCountOffsetIdx != -1); \
+		slot = &BdrCountCtl->slots[MyCountOffsetIdx]; \
+		SpinLockAcquire(&slot->mutex); \
+		slot->counter++; \
+		SpinLockRelease(&slot->mutex); \
+	} while (0)
+
 void
 bdr_count_commit(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_commit++;
+	BDR_COUNT_INCREMENT(nr_commit);
 }
 
 void
 bdr_count_rollback(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_rollback++;
+	BDR_COUNT_INCREMENT(nr_rollback);
 }
 
 void
 bdr_count_insert(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_insert++;
+	BDR_COUNT_INCREMENT(nr_insert);
 }
 
 void
 bdr_count_insert_conflict(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_insert_conflict++;
+	BDR_COUNT_INCREMENT(nr_insert_conflict);
 }
 
 void
 bdr_count_update(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_update++;
+	BDR_COUNT_INCREMENT(nr_update);
 }
 
 void
 bdr_count_update_conflict(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_update_conflict++;
+	BDR_COUNT_INCREMENT(nr_update_conflict);
 }
 
 void
 bdr_count_delete(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_delete++;
+	BDR_COUNT_INCREMENT(nr_delete);
 }
 
 void
 bdr_count_delete_conflict(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_delete_conflict++;
+	BDR_COUNT_INCREMENT(nr_delete_conflict);
 }
 
 void
 bdr_count_disconnect(void)
 {
-	Assert(MyCountOffsetIdx != -1);
-	BdrCountCtl->slots[MyCountOffsetIdx].nr_disconnect++;
+	BDR_COUNT_INCREMENT(nr_disconnect);
 }
 
 Datum
@@ -334,34 +351,40 @@ pg_stat_get_bdr(PG_FUNCTION_ARGS)
 	for (current_offset = 0; current_offset < bdr_count_nnodes;
 		 current_offset++)
 	{
-		BdrCountSlot *slot;
+		BdrCountSlot *shared_slot;
+		BdrCountSlot slot;
 		char	   *riname;
 		Datum		values[BDR_COUNT_STAT_COLS];
 		bool		nulls[BDR_COUNT_STAT_COLS];
 
-		slot = &BdrCountCtl->slots[current_offset];
+		shared_slot = &BdrCountCtl->slots[current_offset];
 
 		/* no stats here */
-		if (slot->node_id == InvalidRepNodeId)
+		if (shared_slot->node_id == InvalidRepNodeId)
 			continue;
 
+		/* get a consistent snapshot of the counters */
+		SpinLockAcquire(&shared_slot->mutex);
+		slot = *shared_slot;
+		SpinLockRelease(&shared_slot->mutex);
+
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
 
-		GetReplicationInfoByIdentifier(slot->node_id, false, &riname);
+		GetReplicationInfoByIdentifier(slot.node_id, false, &riname);
 
-		values[ 0] = ObjectIdGetDatum(slot->node_id);
-		values[ 1] = ObjectIdGetDatum(slot->node_id);
+		values[ 0] = ObjectIdGetDatum(slot.node_id);
+		values[ 1] = ObjectIdGetDatum(slot.node_id);
 		values[ 2] = CStringGetTextDatum(riname);
-		values[ 3] = Int64GetDatumFast(slot->nr_commit);
-		values[ 4] = Int64GetDatumFast(slot->nr_rollback);
-		values[ 5] = Int64GetDatumFast(slot->nr_insert);
-		values[ 6] = Int64GetDatumFast(slot->nr_insert_conflict);
-		values[ 7] = Int64GetDatumFast(slot->nr_update);
-		values[ 8] = Int64GetDatumFast(slot->nr_update_conflict);
-		values[ 9] = Int64GetDatumFast(slot->nr_delete);
-		values[10] = Int64GetDatumFast(slot->nr_delete_conflict);
-		values[11] = Int64GetDatumFast(slot->nr_disconnect);
+		values[ 3] = Int64GetDatumFast(slot.nr_commit);
+		values[ 4] = Int64GetDatumFast(slot.nr_rollback);
+		values[ 5] = Int64GetDatumFast(slot.nr_insert);
+		values[ 6] = Int64GetDatumFast(slot.nr_insert_conflict);
+		values[ 7] = Int64GetDatumFast(slot.nr_update);
+		values[ 8] = Int64GetDatumFast(slot.nr_update_conflict);
+		values[ 9] = Int64GetDatumFast(slot.nr_delete);
+		values[10] = Int64GetDatumFast(slot.nr_delete_conflict);
+		values[11] = Int64GetDatumFast(slot.nr_disconnect);
 
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
@@ -372,6 +395,201 @@ pg_stat_get_bdr(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
+/*
+ * Output plugin statistics of the currently connected BDR walsenders.
+ *
+ * Unlike the apply statistics above these live in the walsender's shmem slot
+ * and so only cover the walsender's lifetime.
+ */
+Datum
+pg_stat_get_bdr_walsender(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("Access to pg_stat_get_bdr_walsender() denied as non-superuser")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != BDR_WALSENDER_STAT_COLS)
+		elog(ERROR, "wrong function definition");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* don't let a walsender come or go below us */
+	LWLockAcquire(BdrWorkerCtl->lock, LW_SHARED);
+
+	for (i = 0; i < bdr_max_workers; i++)
+	{
+		BdrWorker  *w = &BdrWorkerCtl->slots[i];
+		BdrWalsenderWorker *walsnd = &w->data.walsnd;
+		char		sysid_str[33];
+		Datum		values[BDR_WALSENDER_STAT_COLS];
+		bool		nulls[BDR_WALSENDER_STAT_COLS];
+
+		if (w->worker_type != BDR_WORKER_WALSENDER)
+			continue;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		snprintf(sysid_str, sizeof(sysid_str), UINT64_FORMAT,
+				 walsnd->remote_sysid);
+
+		values[ 0] = Int32GetDatum(w->worker_pid);
+		if (walsnd->slot != NULL)
+			values[ 1] = NameGetDatum(&walsnd->slot->data.name);
+		else
+			nulls[ 1] = true;
+		values[ 2] = CStringGetTextDatum(sysid_str);
+		values[ 3] = ObjectIdGetDatum(walsnd->remote_timeline);
+		values[ 4] = ObjectIdGetDatum(walsnd->remote_dboid);
+		values[ 5] = Int64GetDatumFast(walsnd->nr_txn_decoded);
+		values[ 6] = Int64GetDatumFast(walsnd->nr_txn_filtered_origin);
+		values[ 7] = Int64GetDatumFast(walsnd->nr_change_decoded);
+		values[ 8] = Int64GetDatumFast(walsnd->nr_change_filtered_origin);
+		values[ 9] = Int64GetDatumFast(walsnd->nr_change_filtered_repset);
+		values[10] = Int64GetDatumFast(walsnd->nr_change_filtered_row);
+		values[11] = Int64GetDatumFast(walsnd->nr_bytes_sent);
+		values[12] = Int64GetDatumFast(walsnd->nr_columns_binary);
+		values[13] = Int64GetDatumFast(walsnd->nr_columns_sendrecv);
+		values[14] = Int64GetDatumFast(walsnd->nr_columns_text);
+		/* in milliseconds, like pg_stat_user_functions */
+		values[15] = Float8GetDatum(walsnd->write_tuple_time / 1000.0);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(BdrWorkerCtl->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Histograms of the transactions sent by the currently connected BDR
+ * walsenders, one row per non-empty bucket.
+ */
+Datum
+pg_stat_get_bdr_walsender_txn(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("Access to pg_stat_get_bdr_walsender_txn() denied as non-superuser")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != BDR_WALSENDER_TXN_STAT_COLS)
+		elog(ERROR, "wrong function definition");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* don't let a walsender come or go below us */
+	LWLockAcquire(BdrWorkerCtl->lock, LW_SHARED);
+
+	for (i = 0; i < bdr_max_workers; i++)
+	{
+		BdrWorker  *w = &BdrWorkerCtl->slots[i];
+		BdrWalsenderWorker *walsnd = &w->data.walsnd;
+		const char *metrics[] = {"changes", "bytes", "latency_us"};
+		int64	   *hists[] = {walsnd->txn_changes_hist,
+							   walsnd->txn_bytes_hist,
+							   walsnd->txn_latency_hist};
+		int			m;
+
+		if (w->worker_type != BDR_WORKER_WALSENDER)
+			continue;
+
+		for (m = 0; m < lengthof(metrics); m++)
+		{
+			int			bucket;
+
+			for (bucket = 0; bucket < BDR_TXN_HISTOGRAM_BUCKETS; bucket++)
+			{
+				Datum		values[BDR_WALSENDER_TXN_STAT_COLS];
+				bool		nulls[BDR_WALSENDER_TXN_STAT_COLS];
+
+				if (hists[m][bucket] == 0)
+					continue;
+
+				memset(values, 0, sizeof(values));
+				memset(nulls, 0, sizeof(nulls));
+
+				values[0] = Int32GetDatum(w->worker_pid);
+				if (walsnd->slot != NULL)
+					values[1] = NameGetDatum(&walsnd->slot->data.name);
+				else
+					nulls[1] = true;
+				values[2] = CStringGetTextDatum(metrics[m]);
+				/* see BDR_TXN_HISTOGRAM_BUCKETS for the bucket bounds */
+				values[3] = Int64GetDatum(bucket == 0 ? 0 :
+										  INT64CONST(1) << (bucket - 1));
+				if (bucket == BDR_TXN_HISTOGRAM_BUCKETS - 1)
+					nulls[4] = true;
+				else
+					values[4] = Int64GetDatum(INT64CONST(1) << bucket);
+				values[5] = Int64GetDatum(hists[m][bucket]);
+
+				tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			}
+		}
+	}
+	LWLockRelease(BdrWorkerCtl->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
 /*
  * Write the BDR stats from shared memory to a file
  */
@@ -19,12 +19,15 @@
 #include "bdr.h"
 
 #include "access/heapam.h"
+#include "access/nbtree.h"
 #include "access/skey.h"
 #include "access/xact.h"
 #include "access/xlog_fn.h"
 
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_namespace.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_trigger.h"
@@ -147,7 +150,8 @@ UserTableUpdateOpenIndexes(EState *estate, TupleTableSlot *slot)
 }
 
 void
-build_index_scan_keys(EState *estate, ScanKey *scan_keys, BDRTupleData *tup)
+build_index_scan_keys(BDRRelation *rel, EState *estate, ScanKey *scan_keys,
+					  BDRTupleData *tup)
 {
 	ResultRelInfo *relinfo;
 	int i;
@@ -176,7 +180,7 @@ build_index_scan_keys(EState *estate, ScanKey *scan_keys, BDRTupleData *tup)
 		 * Only return index if we could build a key without NULLs.
 		 */
 		if (build_index_scan_key(scan_keys[i],
-								  relinfo->ri_RelationDesc,
+								  rel,
 								  relinfo->ri_IndexRelationDescs[i],
 								  tup))
 		{
@@ -188,21 +192,44 @@ build_index_scan_keys(EState *estate, ScanKey *scan_keys, BDRTupleData *tup)
 }
 
 /*
- * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
- * is setup to match 'rel' (*NOT* idxrel!).
- *
- * Returns whether any column contains NULLs.
+ * How to set up a scan key for an index of a relation from a tuple of the
+ * relation, see get_index_key_plan().
  */
-bool
-build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *tup)
+typedef struct BDRIndexKeyPlan
 {
+	Oid			indexoid;
+	int			nkeys;
+	/* column of the relation and equality function of each index column */
+	AttrNumber	attnums[INDEX_MAX_KEYS];
+	FmgrInfo	eqfuncs[INDEX_MAX_KEYS];
+} BDRIndexKeyPlan;
+
+/*
+ * Look up the equality operators of an index of 'rel', the first time a scan
+ * key is built for it. The result is kept with the relation's apply plan, so
+ * it survives until the next relcache invalidation of the relation, which
+ * creating or dropping any of its indexes results in.
+ */
+static BDRIndexKeyPlan *
+get_index_key_plan(BDRRelation *rel, Relation idxrel)
+{
+	ListCell   *lc;
+	MemoryContext cxt;
+	MemoryContext oldcxt;
+	BDRIndexKeyPlan *plan;
 	int			attoff;
 	Datum		indclassDatum;
 	Datum		indkeyDatum;
 	bool		isnull;
 	oidvector  *opclass;
 	int2vector  *indkey;
-	bool		hasnulls = false;
+
+	foreach(lc, rel->apply_index_keys)
+	{
+		plan = lfirst(lc);
+		if (plan->indexoid == RelationGetRelid(idxrel))
+			return plan;
+	}
 
 	indclassDatum = SysCacheGetAttr(INDEXRELID, idxrel->rd_indextuple,
 									Anum_pg_index_indclass, &isnull);
@@ -214,15 +241,17 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *
 	Assert(!isnull);
 	indkey = (int2vector *) DatumGetPointer(indkeyDatum);
 
+	cxt = bdr_apply_plan_context(rel);
+	plan = MemoryContextAllocZero(cxt, sizeof(BDRIndexKeyPlan));
+	plan->indexoid = RelationGetRelid(idxrel);
+	plan->nkeys = RelationGetNumberOfAttributes(idxrel);
 
-	for (attoff = 0; attoff < RelationGetNumberOfAttributes(idxrel); attoff++)
+	for (attoff = 0; attoff < plan->nkeys; attoff++)
 	{
 		Oid			operator;
 		Oid			opfamily;
-		RegProcedure regop;
-		int			pkattno = attoff + 1;
 		int			mainattno = indkey->values[attoff];
-		Oid			atttype = attnumTypeId(rel, mainattno);
+		Oid			atttype = attnumTypeId(rel->rel, mainattno);
 		Oid			optype = get_opclass_input_type(opclass->values[attoff]);
 
 		opfamily = get_opclass_family(opclass->values[attoff]);
@@ -236,14 +265,44 @@ build_index_scan_key(ScanKey skey, Relation rel, Relation idxrel, BDRTupleData *
 				 "could not lookup equality operator for type %u, optype %u in opfamily %u",
 				 atttype, optype, opfamily);
 
-		regop = get_opcode(operator);
+		plan->attnums[attoff] = mainattno;
+		fmgr_info_cxt(get_opcode(operator), &plan->eqfuncs[attoff], cxt);
+	}
+
+	oldcxt = MemoryContextSwitchTo(cxt);
+	rel->apply_index_keys = lappend(rel->apply_index_keys, plan);
+	MemoryContextSwitchTo(oldcxt);
+
+	return plan;
+}
+
+/*
+ * Setup a ScanKey for a search in the relation 'rel' for a tuple 'key' that
+ * is setup to match 'rel' (*NOT* idxrel!).
+ *
+ * Returns whether any column contains NULLs.
+ */
+bool
+build_index_scan_key(ScanKey skey, BDRRelation *rel, Relation idxrel, BDRTupleData *tup)
+{
+	BDRIndexKeyPlan *plan = get_index_key_plan(rel, idxrel);
+	int			attoff;
+	bool		hasnulls = false;
+
+	for (attoff = 0; attoff < plan->nkeys; attoff++)
+	{
+		int			pkattno = attoff + 1;
+		int			mainattno = plan->attnums[attoff];
 
 		/* FIXME: convert type? */
-		ScanKeyInit(&skey[attoff],
-					pkattno,
-					BTEqualStrategyNumber,
-					regop,
-					tup->values[mainattno - 1]);
+		ScanKeyEntryInitializeWithInfo(&skey[attoff],
+									   0,
+									   pkattno,
+									   BTEqualStrategyNumber,
+									   InvalidOid,
+									   DEFAULT_COLLATION_OID,
+									   &plan->eqfuncs[attoff],
+									   tup->values[mainattno - 1]);
 
 		if (tup->isnull[mainattno - 1])
 		{
@@ -339,6 +398,133 @@ retry:
 	return found;
 }
 
+/*
+ * Prefetch the pages a search of the btree 'idxrel' for the row of 'rel'
+ * with the key 'values' will read, see bdr.prefetch_depth.
+ *
+ * The inner pages are read, they're usually cached anyway, and the leaf page
+ * the key is on is prefetched. With 'heap' the leaf page is read as well, to
+ * prefetch the heap page of the row with the key, if there's one. Doing the
+ * latter a while after the former gives the leaf page time to arrive.
+ *
+ * Prefetching is only a hint to the kernel, and only happens on platforms
+ * with posix_fadvise(). Other index types are ignored.
+ */
+void
+bdr_prefetch_index_key(Relation rel, Relation idxrel, Datum *values,
+					   bool *isnull, bool heap)
+{
+	int			natts = RelationGetNumberOfAttributes(idxrel);
+	IndexTuple	itup;
+	ScanKey		itup_scankey;
+	Buffer		buf;
+
+	if (idxrel->rd_rel->relam != BTREE_AM_OID)
+		return;
+
+	itup = index_form_tuple(RelationGetDescr(idxrel), values, isnull);
+	itup_scankey = _bt_mkscankey(idxrel, itup);
+
+	/* descend like _bt_search() does, but stop short of the leaf level */
+	buf = _bt_getroot(idxrel, BT_READ);
+
+	while (BufferIsValid(buf))
+	{
+		Page		page;
+		BTPageOpaque opaque;
+		OffsetNumber offnum;
+		IndexTuple	child;
+		BlockNumber blkno;
+
+		/* the page might have been split since we followed the link to it */
+		buf = _bt_moveright(idxrel, buf, natts, itup_scankey, false, false,
+							NULL, BT_READ);
+		page = BufferGetPage(buf);
+		opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+
+		offnum = _bt_binsrch(idxrel, buf, natts, itup_scankey, false);
+
+		if (P_ISLEAF(opaque))
+		{
+			if (heap && offnum <= PageGetMaxOffsetNumber(page) &&
+				_bt_compare(idxrel, natts, itup_scankey, page, offnum) == 0)
+			{
+				child = (IndexTuple) PageGetItem(page,
+												 PageGetItemId(page, offnum));
+				PrefetchBuffer(rel, MAIN_FORKNUM,
+							   ItemPointerGetBlockNumber(&child->t_tid));
+			}
+			_bt_relbuf(idxrel, buf);
+			break;
+		}
+
+		child = (IndexTuple) PageGetItem(page, PageGetItemId(page, offnum));
+		blkno = ItemPointerGetBlockNumber(&child->t_tid);
+
+		if (opaque->btpo.level == 1 && !heap)
+		{
+			PrefetchBuffer(idxrel, MAIN_FORKNUM, blkno);
+			_bt_relbuf(idxrel, buf);
+			break;
+		}
+
+		buf = _bt_relandgetbuf(idxrel, buf, blkno, BT_READ);
+	}
+
+	_bt_freeskey(itup_scankey);
+	pfree(itup);
+}
+
+/*
+ * Return the unique index used to identify rows of 'rel' during replay, or
+ * InvalidOid if there's none.
+ *
+ * That's the replica identity index, or, for tables with REPLICA IDENTITY
+ * FULL, the primary key. The latter case is only relevant for replay, the
+ * decoding side sends the complete old tuple, which contains the key.
+ */
+Oid
+bdr_replident_index(Relation rel)
+{
+	List	   *indexoidlist;
+	ListCell   *indexoidscan;
+	Oid			result = InvalidOid;
+
+	/* make sure rd_replidindex is valid */
+	if (rel->rd_indexvalid == 0)
+		RelationGetIndexList(rel);
+
+	if (OidIsValid(rel->rd_replidindex) ||
+		rel->rd_rel->relreplident != REPLICA_IDENTITY_FULL)
+		return rel->rd_replidindex;
+
+	indexoidlist = RelationGetIndexList(rel);
+
+	foreach(indexoidscan, indexoidlist)
+	{
+		Oid			indexoid = lfirst_oid(indexoidscan);
+		HeapTuple	indexTuple;
+		Form_pg_index index;
+
+		indexTuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(indexoid));
+		if (!HeapTupleIsValid(indexTuple))
+			elog(ERROR, "cache lookup failed for index %u", indexoid);
+		index = (Form_pg_index) GETSTRUCT(indexTuple);
+
+		if (index->indisprimary && IndexIsValid(index))
+			result = indexoid;
+
+		ReleaseSysCache(indexTuple);
+
+		if (OidIsValid(result))
+			break;
+	}
+
+	list_free(indexoidlist);
+
+	return result;
+}
+
 /*
  * bdr_queue_ddl_command
  *
@@ -1149,9 +1335,7 @@ BdrExecutorStart(QueryDesc *queryDesc, int eflags)
 							CreateWritableStmtTag(plannedstmt),
 							RelationGetRelationName(rel))));
 
-		if (rel->rd_indexvalid == 0)
-			RelationGetIndexList(rel);
-		if (OidIsValid(rel->rd_replidindex))
+		if (OidIsValid(bdr_replident_index(rel)))
 		{
 			RelationClose(rel);
 			continue;
@@ -1141,6 +1141,7 @@ bdr_catchup_to_lsn(remote_node_info *ri, XLogRecPtr target_lsn)
 		/* Special parameters for a catchup worker only */
 		catchup_worker->replay_stop_lsn = target_lsn;
 		catchup_worker->forward_changesets = true;
+		catchup_worker->parallel_resume_lsn = InvalidXLogRecPtr;
 
 		/* and the BackgroundWorker, which is a regular apply worker */
 		bgw.bgw_flags = BGWORKER_SHMEM_ACCESS |
@@ -58,8 +58,33 @@ typedef struct BdrConnectionConfig
 
 	/* Quoted identifier-list of replication sets */
 	char *replication_sets;
+
+	/*
+	 * Changes between this node and ours are exchanged through a relay node
+	 * (see bdr.bdr_node_relays), so we mustn't connect to it directly.
+	 */
+	bool relayed;
 } BdrConnectionConfig;
 
+/*
+ * SQL expression that's true if changes between the node of a
+ * bdr.bdr_connections row and the local node, passed as ($1, $2, $3), go
+ * through a relay node: either we have a relay other than that node, or that
+ * node has a relay other than us.
+ */
+#define BDR_CONN_RELAYED_EXPR \
+	"EXISTS (SELECT 1 FROM bdr.bdr_node_relays r " \
+	"        WHERE (r.node_sysid = $1 AND " \
+	"               r.node_timeline = $2 AND " \
+	"               r.node_dboid = $3 AND " \
+	"               (r.relay_sysid, r.relay_timeline, r.relay_dboid) " \
+	"                 <> (conn_sysid, conn_timeline, conn_dboid)) " \
+	"           OR (r.node_sysid = conn_sysid AND " \
+	"               r.node_timeline = conn_timeline AND " \
+	"               r.node_dboid = conn_dboid AND " \
+	"               (r.relay_sysid, r.relay_timeline, r.relay_dboid) " \
+	"                 <> ($1, $2, $3))) "
+
 extern volatile sig_atomic_t got_SIGTERM;
 extern volatile sig_atomic_t got_SIGHUP;
 
@@ -53,7 +53,7 @@ bdr_object_relabel(const ObjectAddress *object, const char *seclabel)
 			/* ensure bdr_relcache.c is coherent */
 			CacheInvalidateRelcacheByRelid(object->objectId);
 
-			bdr_parse_relation_options(seclabel, NULL);
+			bdr_validate_relation_options(object->objectId, seclabel);
 			break;
 		case DatabaseRelationId:
 
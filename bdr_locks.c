@@ -692,6 +692,19 @@ bdr_acquire_ddl_lock(BDRLockType lock_type)
 					 errmsg("No peer nodes or peer node count unknown, cannot acquire global lock"),
 					 errhint("BDR is probably still starting up, wait a while")));
 		}
+
+		/*
+		 * Lock messages are only sent to directly connected peers, relay
+		 * nodes don't forward them.
+		 */
+		if (bdr_read_node_relays() != NIL)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("Global DDL locking is not supported while relay nodes are configured"),
+					 errdetail("Nodes connected through a relay node would never confirm the lock."),
+					 errhint("Set bdr.skip_ddl_locking to run DDL without the global lock. See the 'Relay nodes' section of the documentation.")));
+		}
 	}
 
 	if (this_xact_acquired_lock)
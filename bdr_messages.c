@@ -0,0 +1,315 @@
+/* -------------------------------------------------------------------------
+ *
+ * bdr_messages.c
+ *		Replication of application messages on named channels
+ *
+ * Copyright (C) 2012-2015, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *		bdr_messages.c
+ *
+ * Besides BDR's own messages on the "bdr" channel, see bdr_locks.c,
+ * applications can send messages on channels of their own with
+ * bdr.bdr_send_message(), e.g. to invalidate caches or wake up queue
+ * consumers on the other nodes without the overhead of replicating rows.
+ *
+ * Apply workers subscribe to the channels there's a handler for on their
+ * node: C functions registered with bdr_register_message_handler() by
+ * libraries in shared_preload_libraries, and SQL functions configured in
+ * bdr.bdr_message_handlers. The upstream only sends messages on those
+ * channels, see pg_decode_message().
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "bdr.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xlog.h"
+
+#include "libpq/pqformat.h"
+
+#include "nodes/makefuncs.h"
+
+#include "storage/standby.h"
+
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+
+PGDLLEXPORT Datum bdr_send_message(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(bdr_send_message);
+
+typedef struct BdrMessageHandlerEntry
+{
+	char	   *channel;
+	BdrMessageHandler handler;
+} BdrMessageHandlerEntry;
+
+/* C handlers, registered at library load time */
+static List *BdrMessageHandlers = NIL;
+
+/*
+ * Channel names are restricted like replication set names, so they can be
+ * passed around in identifier lists without quoting issues.
+ */
+void
+bdr_validate_message_channel_name(const char *channel)
+{
+	const char *cp;
+
+	if (strlen(channel) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("message channel name \"%s\" is too short",
+						channel)));
+
+	if (strlen(channel) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("message channel name \"%s\" is too long",
+						channel)));
+
+	for (cp = channel; *cp; cp++)
+	{
+		if (!((*cp >= 'a' && *cp <= 'z')
+			  || (*cp >= '0' && *cp <= '9')
+			  || (*cp == '_')
+			  || (*cp == '-')))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_NAME),
+					 errmsg("message channel name \"%s\" contains invalid character",
+							channel),
+					 errhint("Message channel names may only contain lower case letters, numbers, the underscore and the dash.")));
+	}
+
+	if (strcmp(channel, "bdr") == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_RESERVED_NAME),
+				 errmsg("message channel name \"%s\" is reserved",
+						channel)));
+}
+
+/*
+ * Register a C function to handle the messages on 'channel' in apply
+ * workers. Meant to be called from the _PG_init() of a library in
+ * shared_preload_libraries.
+ *
+ * The handler is called in a transaction: for transactional messages the one
+ * applying the transaction the message was sent in, otherwise one of its own.
+ */
+void
+bdr_register_message_handler(const char *channel, BdrMessageHandler handler)
+{
+	MemoryContext old;
+	BdrMessageHandlerEntry *entry;
+	ListCell   *lc;
+
+	bdr_validate_message_channel_name(channel);
+
+	foreach(lc, BdrMessageHandlers)
+	{
+		entry = lfirst(lc);
+		if (strcmp(entry->channel, channel) == 0)
+			elog(ERROR, "a handler for message channel \"%s\" is already registered",
+				 channel);
+	}
+
+	old = MemoryContextSwitchTo(TopMemoryContext);
+	entry = palloc(sizeof(BdrMessageHandlerEntry));
+	entry->channel = pstrdup(channel);
+	entry->handler = handler;
+	BdrMessageHandlers = lappend(BdrMessageHandlers, entry);
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * Send a message on an application channel to all other nodes.
+ *
+ * The message carries the channel, the identity of the sending node and the
+ * payload, in the same framing as BDR's own messages.
+ */
+Datum
+bdr_send_message(PG_FUNCTION_ARGS)
+{
+	char	   *channel = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	bytea	   *payload = PG_GETARG_BYTEA_PP(1);
+	bool		transactional = PG_GETARG_BOOL(2);
+	StringInfoData s;
+	XLogRecPtr	lsn;
+
+	bdr_validate_message_channel_name(channel);
+
+	initStringInfo(&s);
+	pq_sendint(&s, strlen(channel), 4);
+	pq_sendbytes(&s, channel, strlen(channel));
+	pq_sendint64(&s, GetSystemIdentifier());	/* sysid */
+	pq_sendint(&s, ThisTimeLineID, 4);			/* tli */
+	pq_sendint(&s, MyDatabaseId, 4);			/* database */
+	pq_sendint(&s, VARSIZE_ANY_EXHDR(payload), 4);
+	pq_sendbytes(&s, VARDATA_ANY(payload), VARSIZE_ANY_EXHDR(payload));
+
+	lsn = LogStandbyMessage(s.data, s.len, transactional);
+
+	PG_RETURN_LSN(lsn);
+}
+
+/*
+ * Look up the SQL handler configured for a channel in bdr.bdr_message_handlers.
+ *
+ * Returns NULL if there's none. The table has a handful of rows, so there's
+ * no point in going through an index.
+ */
+static char *
+lookup_sql_handler(const char *channel)
+{
+	Relation	rel;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	char	   *handler = NULL;
+
+	rel = heap_openrv(makeRangeVar("bdr", "bdr_message_handlers", -1),
+					  AccessShareLock);
+	scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		bool		isnull;
+		Datum		d;
+
+		d = heap_getattr(tuple, 1, RelationGetDescr(rel), &isnull);
+		if (strcmp(TextDatumGetCString(d), channel) != 0)
+			continue;
+
+		d = heap_getattr(tuple, 2, RelationGetDescr(rel), &isnull);
+		handler = TextDatumGetCString(d);
+		break;
+	}
+
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	return handler;
+}
+
+/*
+ * Return the channels the local node has handlers for, as a list of quoted
+ * identifiers, or NULL if there are none.
+ *
+ * Must be called in a transaction.
+ */
+char *
+bdr_message_channels(void)
+{
+	StringInfoData channels;
+	Relation	rel;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	ListCell   *lc;
+
+	initStringInfo(&channels);
+
+	foreach(lc, BdrMessageHandlers)
+	{
+		BdrMessageHandlerEntry *entry = lfirst(lc);
+
+		if (channels.len > 0)
+			appendStringInfoChar(&channels, ',');
+		appendStringInfoString(&channels, quote_identifier(entry->channel));
+	}
+
+	rel = heap_openrv(makeRangeVar("bdr", "bdr_message_handlers", -1),
+					  AccessShareLock);
+	scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		bool		isnull;
+		Datum		d;
+
+		d = heap_getattr(tuple, 1, RelationGetDescr(rel), &isnull);
+
+		if (channels.len > 0)
+			appendStringInfoChar(&channels, ',');
+		appendStringInfoString(&channels,
+							   quote_identifier(TextDatumGetCString(d)));
+	}
+
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	if (channels.len == 0)
+		return NULL;
+
+	return channels.data;
+}
+
+/*
+ * Pass a message received on an application channel to its handler.
+ *
+ * C handlers take precedence over SQL handlers for the same channel. Must be
+ * called in a transaction.
+ */
+void
+bdr_dispatch_message(const char *channel, uint64 origin_sysid,
+					 TimeLineID origin_tli, Oid origin_dboid,
+					 bool transactional, const char *payload, Size len)
+{
+	ListCell   *lc;
+	char	   *handler;
+	Oid			handler_oid;
+	FmgrInfo	flinfo;
+	FunctionCallInfoData fcinfo;
+	char		sysid_str[33];
+	bytea	   *payload_bytea;
+
+	foreach(lc, BdrMessageHandlers)
+	{
+		BdrMessageHandlerEntry *entry = lfirst(lc);
+
+		if (strcmp(entry->channel, channel) == 0)
+		{
+			entry->handler(channel, origin_sysid, origin_tli, origin_dboid,
+						   transactional, payload, len);
+			return;
+		}
+	}
+
+	handler = lookup_sql_handler(channel);
+	if (handler == NULL)
+	{
+		elog(LOG, "ignoring message in channel %s without a handler", channel);
+		return;
+	}
+
+	/* the signature is part of the name, see bdr.bdr_set_message_handler() */
+	handler_oid = DatumGetObjectId(DirectFunctionCall1(regprocedurein,
+												   CStringGetDatum(handler)));
+
+	snprintf(sysid_str, sizeof(sysid_str), UINT64_FORMAT, origin_sysid);
+
+	payload_bytea = palloc(VARHDRSZ + len);
+	SET_VARSIZE(payload_bytea, VARHDRSZ + len);
+	memcpy(VARDATA(payload_bytea), payload, len);
+
+	fmgr_info(handler_oid, &flinfo);
+	InitFunctionCallInfoData(fcinfo, &flinfo, 5, InvalidOid, NULL, NULL);
+	fcinfo.arg[0] = CStringGetTextDatum(channel);
+	fcinfo.arg[1] = CStringGetTextDatum(sysid_str);
+	fcinfo.arg[2] = ObjectIdGetDatum(origin_tli);
+	fcinfo.arg[3] = ObjectIdGetDatum(origin_dboid);
+	fcinfo.arg[4] = PointerGetDatum(payload_bytea);
+	memset(fcinfo.argnull, 0, 5 * sizeof(bool));
+
+	/* handlers return void, there's no result to look at */
+	(void) FunctionCallInvoke(&fcinfo);
+}
@@ -17,10 +17,15 @@
 #include <unistd.h>
 #include <dirent.h>
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #include "bdr.h"
 #include "bdr_internal.h"
 #include "miscadmin.h"
 
+#include "access/htup_details.h"
 #include "access/sysattr.h"
 #include "access/tuptoaster.h"
 #include "access/xact.h"
@@ -36,14 +41,21 @@
 
 #include "commands/dbcommands.h"
 
+#include "executor/executor.h"
 #include "executor/spi.h"
 
 #include "libpq/pqformat.h"
 
 #include "mb/pg_wchar.h"
 
+#include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 
+#include "optimizer/planner.h"
+#include "optimizer/var.h"
+
+#include "portability/instr_time.h"
+
 #include "replication/logical.h"
 #include "replication/output_plugin.h"
 #include "replication/replication_identifier.h"
@@ -54,6 +66,8 @@
 #include "storage/proc.h"
 
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
@@ -66,6 +80,11 @@ extern void		_PG_output_plugin_init(OutputPluginCallbacks *cb);
 typedef struct
 {
 	MemoryContext context;
+	/* size of the block context keeps across resets */
+	Size context_size;
+	/* largest change, and number of changes, since context was last sized */
+	Size context_peak;
+	uint32 context_nchanges;
 
 	uint64		remote_sysid;
 	TimeLineID	remote_timeline;
@@ -73,8 +92,31 @@ typedef struct
 
 	bool allow_binary_protocol;
 	bool allow_sendrecv_protocol;
+	/* sizes of the basic C types and byte order are the same on both sides */
+	bool binary_platform_matches;
+	/* builtin types as described by the client, see type_transfer_allowed() */
+	HTAB *client_types;
 	bool int_datetime_mismatch;
+	bool builtin_oids_match;
 	bool forward_changesets;
+	bool relation_dictionary;
+	bool changed_columns_only;
+	bool tuple_fast_path;
+	BdrCompression compression;
+	uint32 batch_messages;
+	/* values larger than this are sent ahead in pieces, 0 disables that */
+	uint32 value_chunk_size;
+
+	/* offset of the message being written in ctx->out */
+	int write_start;
+
+	/* messages not yet sent, see bdr_write() */
+	StringInfoData batch;
+	uint32 batch_count;
+#ifdef HAVE_LIBZ
+	z_stream *zstream;
+	StringInfoData zbuf;
+#endif
 
 	uint32 client_pg_version;
 	uint32 client_pg_catversion;
@@ -90,13 +132,42 @@ typedef struct
 	bool client_float8_byval;
 	bool client_int_datetime;
 	char *client_db_encoding;
+	char *client_type_capabilities;
 	Oid bdr_schema_oid;
 	Oid bdr_conflict_handlers_reloid;
 	Oid bdr_locks_reloid;
 	Oid bdr_conflict_history_reloid;
+	Oid bdr_relayed_progress_reloid;
 
 	int num_replication_sets;
 	char **replication_sets;
+
+	/* application message channels to send, -1 for all, see pg_decode_message() */
+	int num_message_channels;
+	char **message_channels;
+
+	/* used to evaluate row filters, see should_forward_row() */
+	ExprContext *filter_econtext;
+
+	/* statistics in our shmem slot, see bdr.pg_stat_bdr_walsender */
+	BdrWalsenderWorker *stats;
+	/* changes sent, and nr_bytes_sent at BEGIN, for the current transaction */
+	uint64 txn_nchanges;
+	int64 txn_start_bytes;
+
+	/*
+	 * Relay topology as of the decoding position, see
+	 * should_forward_changeset(). Reloaded at the next BEGIN once a change to
+	 * bdr.bdr_node_relays has been decoded.
+	 */
+	bool relays_valid;
+	/* does the client exchange all its changes through us? */
+	bool remote_is_relayed;
+	/* other nodes that exchange their changes through us, as BDRNodeId */
+	List *relayed_nodes;
+	/* the last origin we decided about, and whether we forward it */
+	RepNodeId forward_origin_id;
+	bool forward_origin;
 } BdrOutputData;
 
 /* These must be available to pg_dlsym() */
@@ -115,10 +186,99 @@ static void pg_decode_message(LogicalDecodingContext *ctx,
 							  bool transactional, Size sz,
 							  const char *message);
 
+/*
+ * How a single attribute of a relation is sent over the wire. Built once per
+ * relation by get_output_plan() and cached in its BDRRelation until the next
+ * relcache invalidation for the relation.
+ */
+typedef struct BDRAttOutputPlan
+{
+	/* wire kind: 'b'inary, 's'end/recv or 't'ext */
+	char		kind;
+	int16		attlen;
+	bool		attbyval;
+	/* send or output function, unused for binary transfer */
+	FmgrInfo	outfunc;
+} BDRAttOutputPlan;
+
+/*
+ * A builtin type as described by the client in the type_capabilities option,
+ * see bdr_type_capabilities().
+ */
+typedef struct BdrClientType
+{
+	Oid			typid;			/* hash key */
+	int16		typlen;
+	int			align;			/* in bytes */
+	bool		typbyval;
+	bool		has_recv;
+	/* receives the send/recv format of all major versions */
+	bool		recv_stable;
+} BdrClientType;
+
+/*
+ * Which actions on a relation should_forward_change() lets through, so that
+ * changes the replication sets exclude can be skipped without opening the
+ * relation. Entries are dropped by relcache invalidations of the relation;
+ * all of them on changes of the replication set configuration and at the end
+ * of the decoding session.
+ */
+typedef struct BdrRelForwardEntry
+{
+	Oid			relid;			/* hash key */
+	bool		forward_insert;
+	bool		forward_update;
+	bool		forward_delete;
+} BdrRelForwardEntry;
+
+static HTAB *BdrRelForwardHash = NULL;
+
+/*
+ * Messages smaller than this are sent uncompressed even if compression is
+ * enabled, it's not worth the CPU time.
+ */
+#define BDR_COMPRESSION_MIN_SIZE 128
+
+/*
+ * Batches of messages are sent once they reach this size, even if they don't
+ * contain batch_messages messages yet.
+ */
+#define BDR_BATCH_MAX_SIZE (64 * 1024)
+
+/*
+ * Bounds for the block the per-change memory context keeps across resets,
+ * and the number of changes after which it's sized anew, see
+ * reset_change_context().
+ */
+#define BDR_CHANGE_CONTEXT_MIN_SIZE (16 * 1024)
+#define BDR_CHANGE_CONTEXT_MAX_SIZE (1024 * 1024)
+#define BDR_CHANGE_CONTEXT_WINDOW 4096
+
 /* private prototypes */
-static void write_rel(StringInfo out, Relation rel);
-static void write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
-						HeapTuple tuple);
+static MemoryContext create_change_context(Size size);
+static void reset_change_context(BdrOutputData *data, Size used);
+static void record_txn_stats(BdrOutputData *data, ReorderBufferTXN *txn);
+static BdrRelForwardEntry *rel_forward_lookup(Oid relid);
+static BdrRelForwardEntry *rel_forward_compute(LogicalDecodingContext *ctx,
+											   BdrOutputData *data,
+											   BDRRelation *r);
+static void rel_forward_reset(void);
+static void bdr_prepare_write(LogicalDecodingContext *ctx, bool last_write);
+static void bdr_write(LogicalDecodingContext *ctx, bool last_write,
+					  bool flush);
+static BDRAttOutputPlan *get_output_plan(BdrOutputData *data,
+										 BDRRelation *rel);
+static HTAB *parse_client_types(const char *caps, MemoryContext cxt);
+static void write_rel(BdrOutputData *data, StringInfo out, Relation rel);
+static void write_relmeta(StringInfo out, Relation rel);
+static void write_tuple(BdrOutputData *data, StringInfo out, BDRRelation *rel,
+						HeapTuple tuple, HeapTuple oldtuple,
+						Bitmapset *chunked);
+static Bitmapset *write_value_chunks(LogicalDecodingContext *ctx,
+									 BDRRelation *rel, HeapTuple tuple,
+									 HeapTuple oldtuple);
+static int write_tuple_binary(StringInfo out, BDRRelation *rel,
+							  HeapTuple tuple);
 
 static void pglReorderBufferCleanSerializedTXNs(const char *slotname);
 
@@ -370,21 +530,23 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 	Oid				local_dboid;
 
 	data = palloc0(sizeof(BdrOutputData));
-	data->context = AllocSetContextCreate(TopMemoryContext,
-										  "bdr conversion context",
-										  ALLOCSET_DEFAULT_MINSIZE,
-										  ALLOCSET_DEFAULT_INITSIZE,
-										  ALLOCSET_DEFAULT_MAXSIZE);
+	data->context_size = BDR_CHANGE_CONTEXT_MIN_SIZE;
+	data->context = create_change_context(data->context_size);
 
 	ctx->output_plugin_private = data;
 
 	opt->output_type = OUTPUT_PLUGIN_BINARY_OUTPUT;
 
 	data->bdr_conflict_history_reloid = InvalidOid;
+	data->bdr_relayed_progress_reloid = InvalidOid;
 	data->bdr_conflict_handlers_reloid = InvalidOid;
 	data->bdr_locks_reloid = InvalidOid;
 	data->bdr_schema_oid = InvalidOid;
 	data->num_replication_sets = -1;
+	data->num_message_channels = -1;
+	data->tuple_fast_path = true;
+	initStringInfo(&data->batch);
+	data->filter_econtext = CreateStandaloneExprContext();
 
 	/* parse where the connection has to be from */
 	bdr_parse_slot_name(NameStr(MyReplicationSlot->data.name),
@@ -431,6 +593,36 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 			data->client_db_encoding = pstrdup(strVal(elem->arg));
 		else if (strcmp(elem->defname, "forward_changesets") == 0)
 			bdr_parse_bool(elem, &data->forward_changesets);
+		else if (strcmp(elem->defname, "relation_dictionary") == 0)
+			bdr_parse_bool(elem, &data->relation_dictionary);
+		else if (strcmp(elem->defname, "changed_columns_only") == 0)
+			bdr_parse_bool(elem, &data->changed_columns_only);
+		else if (strcmp(elem->defname, "batch_messages") == 0)
+			bdr_parse_uint32(elem, &data->batch_messages);
+		else if (strcmp(elem->defname, "value_chunk_size") == 0)
+			bdr_parse_uint32(elem, &data->value_chunk_size);
+		else if (strcmp(elem->defname, "type_capabilities") == 0)
+			bdr_parse_str(elem, &data->client_type_capabilities);
+		/* only useful to benchmark write_tuple_binary() */
+		else if (strcmp(elem->defname, "tuple_fast_path") == 0)
+			bdr_parse_bool(elem, &data->tuple_fast_path);
+		else if (strcmp(elem->defname, "compression") == 0)
+		{
+			char *compression;
+
+			bdr_parse_str(elem, &compression);
+			if (strcmp(compression, "none") == 0)
+				data->compression = BDR_COMPRESSION_NONE;
+#ifdef HAVE_LIBZ
+			else if (strcmp(compression, "zlib") == 0)
+				data->compression = BDR_COMPRESSION_ZLIB;
+#endif
+			else
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("compression \"%s\" is not supported by this server",
+								compression)));
+		}
 		else if (strcmp(elem->defname, "unidirectional") == 0)
 		{
 			bool is_unidirectional;
@@ -458,6 +650,20 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 			qsort(data->replication_sets, data->num_replication_sets,
 				  sizeof(char *), pg_qsort_strcmp);
 		}
+		else if (strcmp(elem->defname, "message_channels") == 0)
+		{
+			int i;
+
+			bdr_parse_identifier_list_arr(elem,
+										  &data->message_channels,
+										  &data->num_message_channels);
+
+			for (i = 0; i < data->num_message_channels; i++)
+				bdr_validate_message_channel_name(data->message_channels[i]);
+
+			qsort(data->message_channels, data->num_message_channels,
+				  sizeof(char *), pg_qsort_strcmp);
+		}
 		else if (strcmp(elem->defname, "interactive") == 0)
 		{
 			/*
@@ -592,6 +798,8 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 			elog(LOG, "disabling binary protocol because of endianess difference");
 		}
 
+		data->binary_platform_matches = data->allow_binary_protocol;
+
 		/*
 		 * We also can't use the binary protocol if there are critical
 		 * differences in compile time settings.
@@ -618,6 +826,24 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 		if (data->client_pg_version / 100 != PG_VERSION_NUM / 100)
 			data->allow_sendrecv_protocol = false;
 
+		/*
+		 * Arrays and composites embed the oids of their element types in
+		 * both their binary and send/recv representation. Those only
+		 * reliably match on both sides for builtin types of the same catalog
+		 * version.
+		 */
+		data->builtin_oids_match =
+			data->client_pg_catversion == CATALOG_VERSION_NO;
+
+		/*
+		 * If the client described its types, the decisions above are
+		 * refined per type, see type_transfer_allowed().
+		 */
+		if (data->client_type_capabilities != NULL)
+			data->client_types =
+				parse_client_types(data->client_type_capabilities,
+								   ctx->context);
+
 		bdr_maintain_schema(false);
 
 		data->bdr_schema_oid = get_namespace_oid("bdr", true);
@@ -640,6 +866,12 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 			if (data->bdr_conflict_history_reloid == InvalidOid)
 				elog(ERROR, "cache lookup for relation bdr.bdr_conflict_history failed");
 
+			data->bdr_relayed_progress_reloid =
+				get_relname_relid("bdr_relayed_progress", schema_oid);
+
+			if (data->bdr_relayed_progress_reloid == InvalidOid)
+				elog(ERROR, "cache lookup for relation bdr.bdr_relayed_progress failed");
+
 			data->bdr_locks_reloid =
 				get_relname_relid("bdr_global_locks", schema_oid);
 
@@ -683,6 +915,7 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 		bdr_worker_slot->data.walsnd.remote_sysid = data->remote_sysid;
 		bdr_worker_slot->data.walsnd.remote_timeline = data->remote_timeline;
 		bdr_worker_slot->data.walsnd.remote_dboid = data->remote_dboid;
+		data->stats = &bdr_worker_slot->data.walsnd;
 
 		LWLockRelease(BdrWorkerCtl->lock);
 	}
@@ -691,19 +924,262 @@ pg_decode_startup(LogicalDecodingContext * ctx, OutputPluginOptions *opt, bool i
 static void
 pg_decode_shutdown(LogicalDecodingContext * ctx)
 {
+#ifdef HAVE_LIBZ
+	BdrOutputData *data = ctx->output_plugin_private;
+
+	if (data->zstream != NULL)
+	{
+		deflateEnd(data->zstream);
+		pfree(data->zstream);
+		data->zstream = NULL;
+	}
+#endif
+
+	/* the next decoding session in this backend may start elsewhere */
+	bdr_replication_set_config_reset();
+	rel_forward_reset();
+
 	/* release and free slot */
 	bdr_worker_shmem_release();
 }
 
+/*
+ * Start writing a message, like OutputPluginPrepareWrite(). All messages have
+ * to be written via bdr_prepare_write() and bdr_write().
+ */
+static void
+bdr_prepare_write(LogicalDecodingContext *ctx, bool last_write)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+
+	OutputPluginPrepareWrite(ctx, last_write);
+
+	/* whatever the walsender put in front of the message isn't ours */
+	data->write_start = ctx->out->len;
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Replace the message being written in ctx->out by its compressed form.
+ *
+ * All messages are compressed as part of one zlib stream per connection,
+ * flushed at each message boundary. That gives much better compression for
+ * the small messages most changes result in than compressing each on its own,
+ * but the client has to decompress all compressed messages in order.
+ */
+static void
+compress_message(BdrOutputData *data, StringInfo out)
+{
+	int			rawlen = out->len - data->write_start;
+	int			ret;
+
+	if (data->zstream == NULL)
+	{
+		MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+
+		data->zstream = palloc0(sizeof(z_stream));
+		if (deflateInit(data->zstream, Z_BEST_SPEED) != Z_OK)
+			elog(ERROR, "could not initialize compression: %s",
+				 data->zstream->msg ? data->zstream->msg : "unknown error");
+
+		initStringInfo(&data->zbuf);
+
+		MemoryContextSwitchTo(old);
+	}
+
+	resetStringInfo(&data->zbuf);
+
+	data->zstream->next_in = (Bytef *) out->data + data->write_start;
+	data->zstream->avail_in = rawlen;
+
+	do
+	{
+		/* the buffer is kept across calls, so it only grows occasionally */
+		if (data->zbuf.maxlen - data->zbuf.len < 64)
+			enlargeStringInfo(&data->zbuf, data->zbuf.maxlen);
+
+		data->zstream->next_out = (Bytef *) data->zbuf.data + data->zbuf.len;
+		data->zstream->avail_out = data->zbuf.maxlen - data->zbuf.len - 1;
+
+		ret = deflate(data->zstream, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			elog(ERROR, "could not compress data: %s",
+				 data->zstream->msg ? data->zstream->msg : "unknown error");
+
+		data->zbuf.len = (char *) data->zstream->next_out - data->zbuf.data;
+	} while (data->zstream->avail_out == 0);
+
+	Assert(data->zstream->avail_in == 0);
+
+	/* and replace the original message */
+	out->len = data->write_start;
+	pq_sendbyte(out, 'Z');		/* compressed message */
+	pq_sendint(out, rawlen, 4);	/* uncompressed length */
+	appendBinaryStringInfo(out, data->zbuf.data, data->zbuf.len);
+}
+#endif
+
+/*
+ * Finish writing a message, like OutputPluginWrite(), compressing it if
+ * requested.
+ *
+ * If the client asked for batching, the message is only appended to the
+ * current batch, which is sent as a single message ('P') once it's full or
+ * 'flush' is passed. That's done at commit, so a batch never contains more
+ * than one commit, and that's its last message. If a message isn't sent
+ * ctx->out is left in a prepared state, which is harmless, the next
+ * bdr_prepare_write() just starts over.
+ */
+static void
+bdr_write(LogicalDecodingContext *ctx, bool last_write, bool flush)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+
+	if (data->batch_messages > 1)
+	{
+		int			msglen = ctx->out->len - data->write_start;
+
+		pq_sendint(&data->batch, msglen, 4);
+		appendBinaryStringInfo(&data->batch,
+							   ctx->out->data + data->write_start, msglen);
+		data->batch_count++;
+
+		if (!flush &&
+			data->batch_count < data->batch_messages &&
+			data->batch.len < BDR_BATCH_MAX_SIZE)
+			return;
+
+		/* replace the message by the whole batch */
+		ctx->out->len = data->write_start;
+		pq_sendbyte(ctx->out, 'P');		/* batch of messages */
+		pq_sendint(ctx->out, data->batch_count, 4);
+		appendBinaryStringInfo(ctx->out, data->batch.data, data->batch.len);
+
+		resetStringInfo(&data->batch);
+		data->batch_count = 0;
+	}
+
+#ifdef HAVE_LIBZ
+	if (data->compression == BDR_COMPRESSION_ZLIB &&
+		ctx->out->len - data->write_start >= BDR_COMPRESSION_MIN_SIZE)
+		compress_message(data, ctx->out);
+#endif
+
+	data->stats->nr_bytes_sent += ctx->out->len - data->write_start;
+
+	OutputPluginWrite(ctx, last_write);
+}
+
+/*
+ * Load the part of bdr.bdr_node_relays that concerns us: whether the client
+ * and which other nodes use us as their relay.
+ */
+static void
+bdr_load_relays(LogicalDecodingContext *ctx, BdrOutputData *data)
+{
+	List	   *relays;
+	ListCell   *lc;
+	MemoryContext old;
+
+	list_free_deep(data->relayed_nodes);
+	data->relayed_nodes = NIL;
+	data->remote_is_relayed = false;
+
+	relays = bdr_read_node_relays();
+
+	old = MemoryContextSwitchTo(ctx->context);
+	foreach(lc, relays)
+	{
+		BDRNodeRelay *relay = lfirst(lc);
+		BDRNodeId  *node;
+
+		if (relay->relay.sysid != GetSystemIdentifier() ||
+			relay->relay.timeline != ThisTimeLineID ||
+			relay->relay.dboid != MyDatabaseId)
+			continue;
+
+		if (relay->node.sysid == data->remote_sysid &&
+			relay->node.timeline == data->remote_timeline &&
+			relay->node.dboid == data->remote_dboid)
+		{
+			data->remote_is_relayed = true;
+			continue;
+		}
+
+		node = palloc(sizeof(BDRNodeId));
+		*node = relay->node;
+		data->relayed_nodes = lappend(data->relayed_nodes, node);
+	}
+	MemoryContextSwitchTo(old);
+
+	list_free_deep(relays);
+
+	data->relays_valid = true;
+	data->forward_origin_id = InvalidRepNodeId;
+}
+
+/*
+ * Should changes that originated on another node be relayed to the client?
+ *
+ * A client that exchanges its changes through us gets those of all other
+ * nodes, any other client only gets those of the nodes relayed through us.
+ * Nobody gets their own changes back.
+ */
+static bool
+should_relay_origin(BdrOutputData *data, RepNodeId origin_id)
+{
+	uint64		sysid;
+	TimeLineID	timeline;
+	Oid			dboid;
+	ListCell   *lc;
+
+	bdr_fetch_sysid_via_node_id(origin_id, &sysid, &timeline, &dboid);
+
+	if (sysid == data->remote_sysid &&
+		timeline == data->remote_timeline &&
+		dboid == data->remote_dboid)
+		return false;
+
+	if (data->remote_is_relayed)
+		return true;
+
+	foreach(lc, data->relayed_nodes)
+	{
+		BDRNodeId  *node = lfirst(lc);
+
+		if (node->sysid == sysid &&
+			node->timeline == timeline &&
+			node->dboid == dboid)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Only changesets generated on the local node should be replicated
- * to the client unless we're in changeset forwarding mode.
+ * to the client unless we're in changeset forwarding mode or relaying
+ * changesets between the client and their origin.
  */
 static inline bool
 should_forward_changeset(LogicalDecodingContext *ctx, BdrOutputData *data,
 						 ReorderBufferTXN *txn)
 {
-	return txn->origin_id == InvalidRepNodeId || data->forward_changesets;
+	if (txn->origin_id == InvalidRepNodeId || data->forward_changesets)
+		return true;
+
+	/* not a relay for anybody */
+	if (!data->remote_is_relayed && data->relayed_nodes == NIL)
+		return false;
+
+	/* transactions from the same origin tend to come in runs */
+	if (txn->origin_id != data->forward_origin_id)
+	{
+		data->forward_origin_id = txn->origin_id;
+		data->forward_origin = should_relay_origin(data, txn->origin_id);
+	}
+
+	return data->forward_origin;
 }
 
 static inline bool
@@ -713,16 +1189,10 @@ should_forward_change(LogicalDecodingContext *ctx, BdrOutputData *data,
 	/* internal bdr relations that may not be replicated */
 	if (RelationGetRelid(r->rel) == data->bdr_conflict_handlers_reloid ||
 		RelationGetRelid(r->rel) == data->bdr_locks_reloid ||
-		RelationGetRelid(r->rel) == data->bdr_conflict_history_reloid)
+		RelationGetRelid(r->rel) == data->bdr_conflict_history_reloid ||
+		RelationGetRelid(r->rel) == data->bdr_relayed_progress_reloid)
 		return false;
 
-	/*
-	 * Quite ugly, but there's no neat way right now: Flush replication set
-	 * configuration from bdr's relcache.
-	 */
-	if (RelationGetRelid(r->rel) == BdrReplicationSetConfigRelid)
-		BDRRelcacheHashInvalidateCallback(0, InvalidOid);
-
 	/* always replicate other stuff in the bdr schema */
 	if (r->rel->rd_rel->relnamespace == data->bdr_schema_oid)
 		return true;
@@ -747,198 +1217,914 @@ should_forward_change(LogicalDecodingContext *ctx, BdrOutputData *data,
 }
 
 /*
- * BEGIN callback
- *
- * If you change this you must also change the corresponding code in
- * bdr_apply.c . Make sure that any flags are in sync.
+ * Invalidate the cached decisions about a relation, see BdrRelForwardEntry.
  */
-void
-pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+static void
+rel_forward_inval_cb(Datum arg, Oid relid)
 {
-	BdrOutputData *data = ctx->output_plugin_private;
-	int flags = 0;
+	if (BdrRelForwardHash == NULL)
+		return;
 
-	AssertVariableIsOfType(&pg_decode_begin_txn, LogicalDecodeBeginCB);
+	if (OidIsValid(relid))
+		hash_search(BdrRelForwardHash, &relid, HASH_REMOVE, NULL);
+	else
+		rel_forward_reset();
+}
 
-	if (!should_forward_changeset(ctx, data, txn))
-		return;
+/*
+ * Forget all cached decisions about relations.
+ */
+static void
+rel_forward_reset(void)
+{
+	HASH_SEQ_STATUS status;
+	BdrRelForwardEntry *entry;
 
-	OutputPluginPrepareWrite(ctx, true);
-	pq_sendbyte(ctx->out, 'B');		/* BEGIN */
+	if (BdrRelForwardHash == NULL)
+		return;
 
+	hash_seq_init(&status, BdrRelForwardHash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(BdrRelForwardHash, &entry->relid, HASH_REMOVE, NULL);
+}
 
-	/*
-	 * Are we forwarding changesets from other nodes? If so, we must include
-	 * the origin node ID and LSN in BEGIN records.
-	 */
-	if (data->forward_changesets)
-		flags |= BDR_OUTPUT_TRANSACTION_HAS_ORIGIN;
+/*
+ * Return the cached decisions about a relation, or NULL if there are none.
+ */
+static BdrRelForwardEntry *
+rel_forward_lookup(Oid relid)
+{
+	if (BdrRelForwardHash == NULL)
+		return NULL;
 
-	/* send the flags field its self */
-	pq_sendint(ctx->out, flags, 4);
+	return hash_search(BdrRelForwardHash, &relid, HASH_FIND, NULL);
+}
 
-	/* fixed fields */
-	pq_sendint64(ctx->out, txn->final_lsn);
-	pq_sendint64(ctx->out, txn->commit_time);
-	pq_sendint(ctx->out, txn->xid, 4);
+/*
+ * Decide which actions on the relation are forwarded, and cache that.
+ */
+static BdrRelForwardEntry *
+rel_forward_compute(LogicalDecodingContext *ctx, BdrOutputData *data,
+					BDRRelation *r)
+{
+	Oid			relid = RelationGetRelid(r->rel);
+	BdrRelForwardEntry *entry;
 
-	/* and optional data selected above */
-	if (flags & BDR_OUTPUT_TRANSACTION_HAS_ORIGIN)
+	if (BdrRelForwardHash == NULL)
 	{
-		/*
-		 * The RepNodeId in txn->origin_id is our local identifier for the
-		 * origin node, but it's not valid outside our node. It must be
-		 * converted into the (sysid, tlid, dboid) that uniquely identifies the
-		 * node globally so that can be sent.
-		 */
-		uint64		origin_sysid;
-		TimeLineID	origin_tlid;
-		Oid			origin_dboid = InvalidOid;
+		HASHCTL		ctl;
 
-		bdr_fetch_sysid_via_node_id(txn->origin_id, &origin_sysid,
-									&origin_tlid, &origin_dboid);
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(BdrRelForwardEntry);
+		ctl.hash = oid_hash;
+		ctl.hcxt = TopMemoryContext;
 
-		pq_sendint64(ctx->out, origin_sysid);
-		pq_sendint(ctx->out, origin_tlid, 4);
-		pq_sendint(ctx->out, origin_dboid, 4);
-		pq_sendint64(ctx->out, txn->origin_lsn);
+		BdrRelForwardHash = hash_create("BDR forwarded relations", 128, &ctl,
+										HASH_ELEM | HASH_FUNCTION |
+										HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(rel_forward_inval_cb, (Datum) 0);
 	}
 
-	OutputPluginWrite(ctx, true);
-	return;
+	entry = hash_search(BdrRelForwardHash, &relid, HASH_ENTER, NULL);
+	entry->forward_insert =
+		should_forward_change(ctx, data, r, REORDER_BUFFER_CHANGE_INSERT);
+	entry->forward_update =
+		should_forward_change(ctx, data, r, REORDER_BUFFER_CHANGE_UPDATE);
+	entry->forward_delete =
+		should_forward_change(ctx, data, r, REORDER_BUFFER_CHANGE_DELETE);
+
+	return entry;
+}
+
+static inline bool
+rel_forward_action(BdrRelForwardEntry *entry,
+				   enum ReorderBufferChangeType change)
+{
+	switch (change)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			return entry->forward_insert;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			return entry->forward_update;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			return entry->forward_delete;
+		default:
+			elog(ERROR, "should be unreachable");
+	}
 }
 
 /*
- * COMMIT callback
- *
- * Send the LSN at the time of the commit, the commit time, and the end LSN.
- *
- * The presence of additional records is controlled by a flag field, with
- * records that're present appearing strictly in the order they're listed
- * here. There is no sub-record header or other structure beyond the flags
- * field.
+ * Compile the row filters of one action into a single expression.
  *
- * If you change this, you'll need to change process_remote_commit(...)
- * too. Make sure to keep any flags in sync.
+ * If attrs isn't NULL, the columns referenced by the filters are added to it,
+ * offset by FirstLowInvalidHeapAttributeNumber like pull_varattnos() does.
  */
-void
-pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
-					 XLogRecPtr commit_lsn)
+static ExprState *
+compile_row_filters(BDRRelation *r, List *filters, Bitmapset **attrs)
 {
-	BdrOutputData *data = ctx->output_plugin_private;
+	List	   *exprs = NIL;
+	ListCell   *lc;
+	Expr	   *expr;
 
-	int flags = 0;
+	if (filters == NIL)
+		return NULL;
 
-	if (!should_forward_changeset(ctx, data, txn))
-		return;
+	foreach(lc, filters)
+		exprs = lappend(exprs, bdr_row_filter_expr(r->rel, lfirst(lc)));
 
-	OutputPluginPrepareWrite(ctx, true);
-	pq_sendbyte(ctx->out, 'C');		/* sending COMMIT */
+	if (list_length(exprs) == 1)
+		expr = linitial(exprs);
+	else
+		expr = makeBoolExpr(OR_EXPR, exprs, -1);
 
-	/* send the flags field its self */
-	pq_sendint(ctx->out, flags, 4);
+	if (attrs != NULL)
+		pull_varattnos((Node *) expr, 1, attrs);
 
-	/* Send fixed fields */
-	pq_sendint64(ctx->out, commit_lsn);
-	pq_sendint64(ctx->out, txn->end_lsn);
-	pq_sendint64(ctx->out, txn->commit_time);
+	expr = expression_planner(expr);
 
-	OutputPluginWrite(ctx, true);
+	return ExecInitExpr(expr, NULL);
 }
 
-void
-pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
-				 Relation relation, ReorderBufferChange *change)
+/*
+ * Does any of the columns attrs, as collected by compile_row_filters(), hold
+ * a value that is only an on-disk toast pointer in the decoded tuple?
+ */
+static bool
+filter_sees_ondisk_toast(BDRRelation *r, Bitmapset *attrs, HeapTuple tuple)
 {
-	BdrOutputData *data;
-	MemoryContext old;
-	BDRRelation *bdr_relation;
+	TupleDesc	desc = RelationGetDescr(r->rel);
+	bool		whole_row;
+	int			i;
 
-	bdr_relation = bdr_heap_open(RelationGetRelid(relation), NoLock);
+	if (!HeapTupleHasExternal(tuple))
+		return false;
 
-	data = ctx->output_plugin_private;
+	whole_row = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs);
 
-	/* Avoid leaking memory by using and resetting our own context */
-	old = MemoryContextSwitchTo(data->context);
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+		Datum		value;
+		bool		isnull;
+
+		if (att->attisdropped || att->attlen != -1)
+			continue;
+
+		if (!whole_row &&
+			!bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber,
+						   attrs))
+			continue;
+
+		value = heap_getattr(tuple, att->attnum, desc, &isnull);
+		if (!isnull && VARATT_IS_EXTERNAL_ONDISK(value))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Does the row changed by the change pass the relation's row filters?
+ *
+ * Inserts and updates are filtered by the new row, deletes by the old one.
+ * Deletes are only filtered if the complete old row is known, i.e. with
+ * REPLICA IDENTITY FULL, otherwise the filters couldn't be evaluated on the
+ * old key alone. Changes whose row has a toasted column the filters reference
+ * that wasn't decoded, i.e. an unchanged one in an update or any in the old
+ * row of a delete, are always forwarded. Deleting a row that was filtered out
+ * before is harmless on the receiving side.
+ */
+static bool
+should_forward_row(BdrOutputData *data, BDRRelation *r,
+				   ReorderBufferChange *change)
+{
+	ExprContext *econtext = data->filter_econtext;
+	ExprState  *filter;
+	HeapTuple	tuple;
+	Datum		res;
+	bool		isnull;
+
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			if (r->computed_filter_insert == NIL)
+				return true;
+			tuple = &change->data.tp.newtuple->tuple;
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			if (r->computed_filter_update == NIL)
+				return true;
+			tuple = &change->data.tp.newtuple->tuple;
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			if (r->computed_filter_delete == NIL ||
+				change->data.tp.oldtuple == NULL ||
+				r->rel->rd_rel->relreplident != REPLICA_IDENTITY_FULL)
+				return true;
+			tuple = &change->data.tp.oldtuple->tuple;
+			break;
+		default:
+			elog(ERROR, "should be unreachable");
+	}
+
+	/*
+	 * Compile the filters on first use. Like the output plan they're thrown
+	 * away on relcache invalidation.
+	 */
+	if (!r->output_filters_valid)
+	{
+		MemoryContext old;
+
+		(void) get_output_plan(data, r);
+		old = MemoryContextSwitchTo(r->output_plan_cxt);
+
+		/* a copy, so the slot doesn't pin the relcache's tuple descriptor */
+		r->output_filter_slot =
+			MakeSingleTupleTableSlot(CreateTupleDescCopy(RelationGetDescr(r->rel)));
+		r->output_filter_insert =
+			compile_row_filters(r, r->computed_filter_insert, NULL);
+		r->output_filter_update =
+			compile_row_filters(r, r->computed_filter_update,
+								&r->output_filter_update_attrs);
+		r->output_filter_delete =
+			compile_row_filters(r, r->computed_filter_delete,
+								&r->output_filter_delete_attrs);
+
+		MemoryContextSwitchTo(old);
+		r->output_filters_valid = true;
+	}
+
+	if (change->action == REORDER_BUFFER_CHANGE_INSERT)
+		filter = r->output_filter_insert;
+	else if (change->action == REORDER_BUFFER_CHANGE_UPDATE)
+	{
+		/*
+		 * The values of toasted columns an UPDATE didn't change aren't
+		 * decoded, the new tuple just points to the toast table. The filters
+		 * can't be evaluated then, so the row is forwarded rather than
+		 * guessing.
+		 */
+		if (filter_sees_ondisk_toast(r, r->output_filter_update_attrs, tuple))
+			return true;
+		filter = r->output_filter_update;
+	}
+	else
+	{
+		/*
+		 * The old tuple of a DELETE has its toasted values as on-disk
+		 * pointers too, and the toast rows they point to are deleted along
+		 * with it.
+		 */
+		if (filter_sees_ondisk_toast(r, r->output_filter_delete_attrs, tuple))
+			return true;
+		filter = r->output_filter_delete;
+	}
+
+	ExecStoreTuple(tuple, r->output_filter_slot, InvalidBuffer, false);
+	econtext->ecxt_scantuple = r->output_filter_slot;
+
+	res = ExecEvalExprSwitchContext(filter, econtext, &isnull, NULL);
+
+	ExecClearTuple(r->output_filter_slot);
+	ResetExprContext(econtext);
+
+	return !isnull && DatumGetBool(res);
+}
+
+/*
+ * BEGIN callback
+ *
+ * If you change this you must also change the corresponding code in
+ * bdr_apply.c . Make sure that any flags are in sync.
+ */
+void
+pg_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+	int flags = 0;
+
+	AssertVariableIsOfType(&pg_decode_begin_txn, LogicalDecodeBeginCB);
+
+	data->stats->nr_txn_decoded++;
+
+	/*
+	 * Only switch relay topology between transactions, so the same decision
+	 * is made for all of a transaction's changes.
+	 */
+	if (!data->relays_valid)
+		bdr_load_relays(ctx, data);
+
+	if (!should_forward_changeset(ctx, data, txn))
+	{
+		data->stats->nr_txn_filtered_origin++;
+		return;
+	}
+
+	data->txn_nchanges = 0;
+	data->txn_start_bytes = data->stats->nr_bytes_sent;
+
+	bdr_prepare_write(ctx, true);
+	pq_sendbyte(ctx->out, 'B');		/* BEGIN */
+
+
+	/*
+	 * Are we forwarding changesets from other nodes? If so, we must include
+	 * the origin node ID and LSN in BEGIN records.
+	 */
+	if (data->forward_changesets || txn->origin_id != InvalidRepNodeId)
+		flags |= BDR_OUTPUT_TRANSACTION_HAS_ORIGIN;
+
+	/* send the flags field its self */
+	pq_sendint(ctx->out, flags, 4);
+
+	/* fixed fields */
+	pq_sendint64(ctx->out, txn->final_lsn);
+	pq_sendint64(ctx->out, txn->commit_time);
+	pq_sendint(ctx->out, txn->xid, 4);
+
+	/* and optional data selected above */
+	if (flags & BDR_OUTPUT_TRANSACTION_HAS_ORIGIN)
+	{
+		/*
+		 * The RepNodeId in txn->origin_id is our local identifier for the
+		 * origin node, but it's not valid outside our node. It must be
+		 * converted into the (sysid, tlid, dboid) that uniquely identifies the
+		 * node globally so that can be sent.
+		 */
+		uint64		origin_sysid;
+		TimeLineID	origin_tlid;
+		Oid			origin_dboid = InvalidOid;
+
+		bdr_fetch_sysid_via_node_id(txn->origin_id, &origin_sysid,
+									&origin_tlid, &origin_dboid);
+
+		pq_sendint64(ctx->out, origin_sysid);
+		pq_sendint(ctx->out, origin_tlid, 4);
+		pq_sendint(ctx->out, origin_dboid, 4);
+		pq_sendint64(ctx->out, txn->origin_lsn);
+	}
+
+	bdr_write(ctx, true, false);
+	return;
+}
+
+/*
+ * COMMIT callback
+ *
+ * Send the LSN at the time of the commit, the commit time, and the end LSN.
+ *
+ * The presence of additional records is controlled by a flag field, with
+ * records that're present appearing strictly in the order they're listed
+ * here. There is no sub-record header or other structure beyond the flags
+ * field.
+ *
+ * If you change this, you'll need to change process_remote_commit(...)
+ * too. Make sure to keep any flags in sync.
+ */
+void
+pg_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					 XLogRecPtr commit_lsn)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+
+	int flags = 0;
+
+	if (!should_forward_changeset(ctx, data, txn))
+		return;
 
+	bdr_prepare_write(ctx, true);
+	pq_sendbyte(ctx->out, 'C');		/* sending COMMIT */
+
+	/* send the flags field its self */
+	pq_sendint(ctx->out, flags, 4);
+
+	/* Send fixed fields */
+	pq_sendint64(ctx->out, commit_lsn);
+	pq_sendint64(ctx->out, txn->end_lsn);
+	pq_sendint64(ctx->out, txn->commit_time);
+
+	bdr_write(ctx, true, true);
+
+	record_txn_stats(data, txn);
+}
+
+/*
+ * Bucket of a BdrWalsenderWorker transaction histogram for 'value'.
+ */
+static int
+txn_histogram_bucket(uint64 value)
+{
+	int			bucket = 0;
+
+	while (value != 0 && bucket < BDR_TXN_HISTOGRAM_BUCKETS - 1)
+	{
+		value >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/*
+ * Add a transaction that's just been sent to the histograms of the
+ * walsender's statistics.
+ *
+ * With batching the whole transaction has been sent at this point too, as
+ * COMMIT flushes the batch, so the bytes are those of the transaction alone.
+ */
+static void
+record_txn_stats(BdrOutputData *data, ReorderBufferTXN *txn)
+{
+	long		secs;
+	int			usecs;
+
+	TimestampDifference(txn->commit_time, GetCurrentTimestamp(),
+						&secs, &usecs);
+
+	data->stats->txn_changes_hist[txn_histogram_bucket(data->txn_nchanges)]++;
+	data->stats->txn_bytes_hist[
+		txn_histogram_bucket(data->stats->nr_bytes_sent -
+							 data->txn_start_bytes)]++;
+	data->stats->txn_latency_hist[
+		txn_histogram_bucket((uint64) secs * USECS_PER_SEC + usecs)]++;
+}
+
+void
+pg_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+				 Relation relation, ReorderBufferChange *change)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+	Oid			relid = RelationGetRelid(relation);
+	MemoryContext old;
+	BDRRelation *bdr_relation;
+	BdrRelForwardEntry *forward;
+	HeapTuple	cmptuple = NULL;
+	Bitmapset  *chunked = NULL;
+	Size		used = 0;
+
+	data->stats->nr_change_decoded++;
+
+	/*
+	 * Keep the replication set configuration in step with the decoding
+	 * position, whichever node the change came from.
+	 */
+	if (relid == BdrReplicationSetConfigRelid)
+	{
+		bdr_replication_set_config_changed(relation,
+			change->data.tp.oldtuple ? &change->data.tp.oldtuple->tuple : NULL,
+			change->data.tp.newtuple ? &change->data.tp.newtuple->tuple : NULL);
+		rel_forward_reset();
+	}
+	else if (relid == BdrNodeRelaysRelid)
+		data->relays_valid = false;
+
+	/*
+	 * Reject changes we don't send as early and cheaply as possible: in a
+	 * mesh most decoded changes came from other nodes and aren't forwarded,
+	 * and neither are changes to relations outside our replication sets.
+	 * Both decisions are cached, by origin and by relation, so neither needs
+	 * the BDRRelation.
+	 */
 	if (!should_forward_changeset(ctx, data, txn))
+	{
+		data->stats->nr_change_filtered_origin++;
+		return;
+	}
+
+	forward = rel_forward_lookup(relid);
+	if (forward != NULL && !rel_forward_action(forward, change->action))
+	{
+		data->stats->nr_change_filtered_repset++;
+		return;
+	}
+
+	bdr_relation = bdr_heap_open(relid, NoLock);
+
+	/* Avoid leaking memory by using and resetting our own context */
+	old = MemoryContextSwitchTo(data->context);
+
+	if (forward == NULL)
+		(void) rel_forward_compute(ctx, data, bdr_relation);
+
+	/* also brings the relation's replication settings up to date */
+	if (!should_forward_change(ctx, data, bdr_relation, change->action))
+	{
+		data->stats->nr_change_filtered_repset++;
+		goto skip;
+	}
+
+	if (!should_forward_row(data, bdr_relation, change))
+	{
+		data->stats->nr_change_filtered_row++;
 		goto skip;
+	}
+
+	/*
+	 * If the client asked us to refer to relations by id, make sure it knows
+	 * about this relation before sending the change. After an invalidation
+	 * of the relation the metadata is sent again, so renames etc. reach the
+	 * client before any change using the new definition.
+	 */
+	if (data->relation_dictionary && !bdr_relation->output_relmeta_sent)
+	{
+		bdr_prepare_write(ctx, false);
+		pq_sendbyte(ctx->out, 'R');		/* relation metadata */
+		write_relmeta(ctx->out, relation);
+		bdr_write(ctx, false, false);
+
+		bdr_relation->output_relmeta_sent = true;
+	}
+
+	/*
+	 * Only send the columns of an UPDATE that actually changed if the client
+	 * asked for that. That requires the complete old tuple, which we only get
+	 * with REPLICA IDENTITY FULL; otherwise it's either absent or just
+	 * contains the old key.
+	 */
+	if (change->action == REORDER_BUFFER_CHANGE_UPDATE &&
+		data->changed_columns_only &&
+		change->data.tp.oldtuple != NULL &&
+		relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL)
+		cmptuple = &change->data.tp.oldtuple->tuple;
+
+	/* large values of the new tuple go ahead of the change itself */
+	if (data->value_chunk_size > 0 &&
+		change->action != REORDER_BUFFER_CHANGE_DELETE)
+		chunked = write_value_chunks(ctx, bdr_relation,
+									 &change->data.tp.newtuple->tuple,
+									 cmptuple);
+
+	bdr_prepare_write(ctx, true);
+
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			pq_sendbyte(ctx->out, 'I');		/* action INSERT */
+			write_rel(data, ctx->out, relation);
+			pq_sendbyte(ctx->out, 'N');		/* new tuple follows */
+			write_tuple(data, ctx->out, bdr_relation,
+						&change->data.tp.newtuple->tuple, NULL, chunked);
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			pq_sendbyte(ctx->out, 'U');		/* action UPDATE */
+			write_rel(data, ctx->out, relation);
+			if (change->data.tp.oldtuple != NULL)
+			{
+				pq_sendbyte(ctx->out, 'K');	/* old key follows */
+				write_tuple(data, ctx->out, bdr_relation,
+							&change->data.tp.oldtuple->tuple, NULL, NULL);
+			}
+			pq_sendbyte(ctx->out, 'N');		/* new tuple follows */
+			write_tuple(data, ctx->out, bdr_relation,
+						&change->data.tp.newtuple->tuple, cmptuple, chunked);
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			pq_sendbyte(ctx->out, 'D');		/* action DELETE */
+			write_rel(data, ctx->out, relation);
+			if (change->data.tp.oldtuple != NULL)
+			{
+				pq_sendbyte(ctx->out, 'K');	/* old key follows */
+				write_tuple(data, ctx->out, bdr_relation,
+							&change->data.tp.oldtuple->tuple, NULL, NULL);
+			}
+			else
+				pq_sendbyte(ctx->out, 'E');	/* empty */
+			break;
+		default:
+			Assert(false);
+	}
+	used = ctx->out->len - data->write_start;
+	bdr_write(ctx, true, false);
+	data->txn_nchanges++;
+
+skip:
+	MemoryContextSwitchTo(old);
+	reset_change_context(data, used);
+
+	bdr_heap_close(bdr_relation, NoLock);
+}
+
+/*
+ * Create the memory context changes are converted in.
+ *
+ * It keeps its first block of 'size' bytes when reset, so converting a change
+ * that fits into it doesn't need to malloc() or free() anything.
+ */
+static MemoryContext
+create_change_context(Size size)
+{
+	return AllocSetContextCreate(TopMemoryContext,
+								 "bdr conversion context",
+								 size,
+								 size,
+								 Max(size, ALLOCSET_DEFAULT_MAXSIZE));
+}
+
+/*
+ * Reset the per-change memory context after a change has been converted.
+ *
+ * 'used' is the size of the message the change resulted in, which is what
+ * most of the memory used in the context is proportional to. The kept block
+ * is sized to twice the largest such message among the last
+ * BDR_CHANGE_CONTEXT_WINDOW changes, growing immediately and shrinking only
+ * at the end of a window, so the context isn't recreated over and over with
+ * changes of varying size.
+ */
+static void
+reset_change_context(BdrOutputData *data, Size used)
+{
+	Size		size;
+
+	data->context_peak = Max(data->context_peak, used);
+
+	if (++data->context_nchanges < BDR_CHANGE_CONTEXT_WINDOW &&
+		data->context_peak * 2 <= data->context_size)
+	{
+		MemoryContextReset(data->context);
+		return;
+	}
+
+	size = BDR_CHANGE_CONTEXT_MIN_SIZE;
+	while (size < data->context_peak * 2 && size < BDR_CHANGE_CONTEXT_MAX_SIZE)
+		size *= 2;
+
+	if (data->context_nchanges >= BDR_CHANGE_CONTEXT_WINDOW)
+	{
+		data->context_peak = 0;
+		data->context_nchanges = 0;
+	}
+
+	if (size == data->context_size)
+	{
+		MemoryContextReset(data->context);
+		return;
+	}
+
+	MemoryContextDelete(data->context);
+	data->context = create_change_context(size);
+	data->context_size = size;
+}
+
+/*
+ * Write the relation a change applies to to the output stream.
+ *
+ * Normally that's schema.relation. If the client negotiated the relation
+ * dictionary, only the relation's id is sent; the name has already been sent
+ * in a preceding relation metadata message, see write_relmeta().
+ */
+static void
+write_rel(BdrOutputData *data, StringInfo out, Relation rel)
+{
+	const char *nspname;
+	int64		nspnamelen;
+	const char *relname;
+	int64		relnamelen;
+
+	if (data->relation_dictionary)
+	{
+		pq_sendint(out, RelationGetRelid(rel), 4);	/* relation id */
+		return;
+	}
+
+	nspname = get_namespace_name(rel->rd_rel->relnamespace);
+	if (nspname == NULL)
+		elog(ERROR, "cache lookup failed for namespace %u",
+			 rel->rd_rel->relnamespace);
+	nspnamelen = strlen(nspname) + 1;
+
+	relname = NameStr(rel->rd_rel->relname);
+	relnamelen = strlen(relname) + 1;
+
+	pq_sendint(out, nspnamelen, 2);		/* schema name length */
+	appendBinaryStringInfo(out, nspname, nspnamelen);
+
+	pq_sendint(out, relnamelen, 2);		/* table name length */
+	appendBinaryStringInfo(out, relname, relnamelen);
+}
+
+/*
+ * Write the mapping between a relation's id and its schema.relation name to
+ * the output stream.
+ *
+ * The id is the relation's oid on this node. It's only meaningful to the
+ * client as a key for subsequent changes on the same connection.
+ *
+ * If you change this, you'll need to change process_remote_relation(...) too.
+ */
+static void
+write_relmeta(StringInfo out, Relation rel)
+{
+	const char *nspname;
+	int64		nspnamelen;
+	const char *relname;
+	int64		relnamelen;
+
+	nspname = get_namespace_name(rel->rd_rel->relnamespace);
+	if (nspname == NULL)
+		elog(ERROR, "cache lookup failed for namespace %u",
+			 rel->rd_rel->relnamespace);
+	nspnamelen = strlen(nspname) + 1;
+
+	relname = NameStr(rel->rd_rel->relname);
+	relnamelen = strlen(relname) + 1;
+
+	pq_sendint(out, RelationGetRelid(rel), 4);	/* relation id */
+
+	pq_sendint(out, nspnamelen, 2);		/* schema name length */
+	appendBinaryStringInfo(out, nspname, nspnamelen);
+
+	pq_sendint(out, relnamelen, 2);		/* table name length */
+	appendBinaryStringInfo(out, relname, relnamelen);
+}
+
+/*
+ * Does the binary representation of the type depend on integer_datetimes?
+ */
+static bool
+is_datetime_type(Oid typid)
+{
+	return typid == TIMESTAMPOID || typid == TIMESTAMPTZOID ||
+		typid == TIMEOID;
+}
+
+/*
+ * Can values of the composite type be transferred using send/recv?
+ *
+ * record_send() embeds the type oid of every column, which record_recv()
+ * checks against the receiving side's definition of the type. So that's only
+ * possible if all columns are of builtin types, which have the same oid on
+ * both sides, and those types support send/recv themselves. Should the
+ * definitions of the composite type differ between the nodes, record_recv()
+ * errors out rather than misinterpreting the data.
+ */
+static bool
+composite_sendrecv_safe(BdrOutputData *data, Oid typid)
+{
+	TupleDesc	desc;
+	bool		safe = true;
+	int			i;
+
+	desc = lookup_rowtype_tupdesc(typid, -1);
+
+	for (i = 0; i < desc->natts && safe; i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+		HeapTuple	typtup;
+		Form_pg_type typclass;
+
+		if (att->attisdropped)
+			continue;
+
+		if (att->atttypid >= FirstNormalObjectId)
+		{
+			safe = false;
+			break;
+		}
+
+		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
+		if (!HeapTupleIsValid(typtup))
+			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
+		typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+		if (!OidIsValid(typclass->typsend) ||
+			!OidIsValid(typclass->typreceive))
+			safe = false;
+		else if (data->int_datetime_mismatch &&
+				 (is_datetime_type(att->atttypid) ||
+				  is_datetime_type(typclass->typelem)))
+			safe = false;
+
+		ReleaseSysCache(typtup);
+	}
+
+	ReleaseTupleDesc(desc);
+
+	return safe;
+}
 
-	if (!should_forward_change(ctx, data, bdr_relation, change->action))
-		goto skip;
+/*
+ * Parse the type_capabilities option of the client into a hash table, which
+ * is kept for the rest of the session.
+ */
+static HTAB *
+parse_client_types(const char *caps, MemoryContext cxt)
+{
+	HASHCTL		ctl;
+	HTAB	   *types;
+	const char *p = caps;
 
-	OutputPluginPrepareWrite(ctx, true);
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(BdrClientType);
+	ctl.hash = oid_hash;
+	ctl.hcxt = cxt;
 
-	switch (change->action)
+	types = hash_create("BDR client types", 256, &ctl,
+						HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	while (*p != '\0')
 	{
-		case REORDER_BUFFER_CHANGE_INSERT:
-			pq_sendbyte(ctx->out, 'I');		/* action INSERT */
-			write_rel(ctx->out, relation);
-			pq_sendbyte(ctx->out, 'N');		/* new tuple follows */
-			write_tuple(data, ctx->out, relation, &change->data.tp.newtuple->tuple);
-			break;
-		case REORDER_BUFFER_CHANGE_UPDATE:
-			pq_sendbyte(ctx->out, 'U');		/* action UPDATE */
-			write_rel(ctx->out, relation);
-			if (change->data.tp.oldtuple != NULL)
-			{
-				pq_sendbyte(ctx->out, 'K');	/* old key follows */
-				write_tuple(data, ctx->out, relation,
-							&change->data.tp.oldtuple->tuple);
-			}
-			pq_sendbyte(ctx->out, 'N');		/* new tuple follows */
-			write_tuple(data, ctx->out, relation,
-						&change->data.tp.newtuple->tuple);
-			break;
-		case REORDER_BUFFER_CHANGE_DELETE:
-			pq_sendbyte(ctx->out, 'D');		/* action DELETE */
-			write_rel(ctx->out, relation);
-			if (change->data.tp.oldtuple != NULL)
-			{
-				pq_sendbyte(ctx->out, 'K');	/* old key follows */
-				write_tuple(data, ctx->out, relation,
-							&change->data.tp.oldtuple->tuple);
-			}
-			else
-				pq_sendbyte(ctx->out, 'E');	/* empty */
-			break;
-		default:
-			Assert(false);
+		Oid			typid;
+		int			typlen;
+		int			align;
+		int			typbyval;
+		int			has_recv;
+		int			recv_stable;
+		int			consumed;
+		BdrClientType *entry;
+
+		if (sscanf(p, "%u:%d:%d:%d:%d:%d%n", &typid, &typlen, &align,
+				   &typbyval, &has_recv, &recv_stable, &consumed) != 6 ||
+			(p[consumed] != ',' && p[consumed] != '\0'))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("could not parse type_capabilities entry \"%s\"",
+							p)));
+
+		entry = hash_search(types, &typid, HASH_ENTER, NULL);
+		entry->typlen = typlen;
+		entry->align = align;
+		entry->typbyval = typbyval != 0;
+		entry->has_recv = has_recv != 0;
+		entry->recv_stable = recv_stable != 0;
+
+		p += consumed;
+		if (*p == ',')
+			p++;
 	}
-	OutputPluginWrite(ctx, true);
 
-skip:
-	MemoryContextSwitchTo(old);
-	MemoryContextReset(data->context);
+	return types;
+}
 
-	bdr_heap_close(bdr_relation, NoLock);
+/*
+ * Does the client store values of the type exactly like we do?
+ */
+static bool
+client_type_layout_matches(BdrOutputData *data, Oid typid)
+{
+	BdrClientType *ctype;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	ctype = hash_search(data->client_types, &typid, HASH_FIND, NULL);
+	if (ctype == NULL)
+		return false;
+
+	get_typlenbyvalalign(typid, &typlen, &typbyval, &typalign);
+
+	return ctype->typlen == typlen && ctype->typbyval == typbyval &&
+		ctype->align == bdr_typalign_bytes(typalign);
 }
 
 /*
- * Write schema.relation to the output stream.
+ * Does the client receive the type's send/recv format of all versions?
  */
-static void
-write_rel(StringInfo out, Relation rel)
+static bool
+client_type_recv_stable(BdrOutputData *data, Oid typid)
 {
-	const char *nspname;
-	int64		nspnamelen;
-	const char *relname;
-	int64		relnamelen;
+	BdrClientType *ctype;
 
-	nspname = get_namespace_name(rel->rd_rel->relnamespace);
-	if (nspname == NULL)
-		elog(ERROR, "cache lookup failed for namespace %u",
-			 rel->rd_rel->relnamespace);
-	nspnamelen = strlen(nspname) + 1;
+	ctype = hash_search(data->client_types, &typid, HASH_FIND, NULL);
 
-	relname = NameStr(rel->rd_rel->relname);
-	relnamelen = strlen(relname) + 1;
+	return ctype != NULL && ctype->has_recv && ctype->recv_stable;
+}
 
-	pq_sendint(out, nspnamelen, 2);		/* schema name length */
-	appendBinaryStringInfo(out, nspname, nspnamelen);
+/*
+ * Which protocols are allowed for values of the type, leaving aside the
+ * restrictions specific to the kind of type in decide_datum_transfer()?
+ *
+ * Without a description of the client's types that's decided for all types
+ * at once at startup, so a single difference like float8 being pass by value
+ * on one side only prevents sending any value in binary. With it, each
+ * builtin type whose layout, and that of its elements, matches on both sides
+ * can be sent in binary, as long as the sizes of the basic C types and the
+ * byte order agree. Between major versions, builtin types are only sent in
+ * send/recv form if the client vouches that it receives their send/recv
+ * format of any version, which keeps the fast path for the most common types
+ * during rolling upgrades.
+ */
+static void
+type_transfer_allowed(BdrOutputData *data, Oid typid, Form_pg_type typclass,
+					  bool *allow_binary, bool *allow_sendrecv)
+{
+	*allow_binary = data->allow_binary_protocol;
+	*allow_sendrecv = data->allow_sendrecv_protocol;
 
-	pq_sendint(out, relnamelen, 2);		/* table name length */
-	appendBinaryStringInfo(out, relname, relnamelen);
+	if (data->client_types == NULL || typid >= FirstNormalObjectId)
+		return;
+
+	*allow_binary = data->binary_platform_matches &&
+		client_type_layout_matches(data, typid) &&
+		(!OidIsValid(typclass->typelem) ||
+		 client_type_layout_matches(data, typclass->typelem));
+
+	if (!*allow_sendrecv)
+		*allow_sendrecv = client_type_recv_stable(data, typid) &&
+			(!OidIsValid(typclass->typelem) ||
+			 client_type_recv_stable(data, typclass->typelem));
 }
 
 /*
@@ -949,10 +2135,16 @@ decide_datum_transfer(BdrOutputData *data,
 					  Form_pg_attribute att, Form_pg_type typclass,
 					  bool *use_binary, bool *use_sendrecv)
 {
+	bool		allow_binary;
+	bool		allow_sendrecv;
+
+	type_transfer_allowed(data, att->atttypid, typclass,
+						  &allow_binary, &allow_sendrecv);
+
 	/* always disallow fancyness if there's type representation mismatches */
 	if (data->int_datetime_mismatch &&
-		(att->atttypid == TIMESTAMPOID || att->atttypid == TIMESTAMPTZOID ||
-		 att->atttypid == TIMEOID))
+		(is_datetime_type(att->atttypid) ||
+		 is_datetime_type(typclass->typelem)))
 	{
 		*use_binary = false;
 		*use_sendrecv = false;
@@ -960,7 +2152,7 @@ decide_datum_transfer(BdrOutputData *data,
 	/*
 	 * Use the binary protocol, if allowed, for builtin & plain datatypes.
 	 */
-	else if (data->allow_binary_protocol &&
+	else if (allow_binary &&
 		typclass->typtype == 'b' &&
 		att->atttypid < FirstNormalObjectId &&
 		typclass->typelem == InvalidOid)
@@ -968,33 +2160,163 @@ decide_datum_transfer(BdrOutputData *data,
 		*use_binary = true;
 	}
 	/*
-	 * Use send/recv, if allowed, if the type is plain or builtin.
+	 * Builtin arrays of builtin base types can be copied in binary as well,
+	 * the element type oid stored in them is the same on both sides.
+	 */
+	else if (allow_binary &&
+			 data->builtin_oids_match &&
+			 typclass->typtype == 'b' &&
+			 att->atttypid < FirstNormalObjectId &&
+			 OidIsValid(typclass->typelem) &&
+			 typclass->typelem < FirstNormalObjectId &&
+			 get_typtype(typclass->typelem) == 'b')
+	{
+		*use_binary = true;
+	}
+	/*
+	 * Use send/recv, if allowed, if the type is plain or builtin, or a
+	 * composite type consisting of builtin types.
 	 *
-	 * XXX: we can't use send/recv for array or composite types for now due to
+	 * XXX: we can't use send/recv for other arrays or composite types due to
 	 * the embedded oids.
 	 */
-	else if (data->allow_sendrecv_protocol &&
+	else if (allow_sendrecv &&
 			 OidIsValid(typclass->typreceive) &&
-			 (att->atttypid < FirstNormalObjectId || typclass->typtype != 'c') &&
-			 (att->atttypid < FirstNormalObjectId || typclass->typelem == InvalidOid))
+			 (att->atttypid < FirstNormalObjectId ||
+			  (typclass->typtype != 'c' && typclass->typelem == InvalidOid) ||
+			  (typclass->typtype == 'c' && data->builtin_oids_match &&
+			   composite_sendrecv_safe(data, att->atttypid))))
 	{
 		*use_sendrecv = true;
 	}
 }
 
+/*
+ * Return the per-attribute output plan for the relation, building it if
+ * necessary.
+ *
+ * The decisions made by decide_datum_transfer() only depend on the attribute's
+ * type and on the options negotiated at startup, so there's no need to redo
+ * the type lookups for every row. Relcache invalidations for the relation
+ * throw the plan away together with the rest of the BDRRelation, see
+ * BDRRelcacheHashInvalidateEntry(), as do those for the row type of any of
+ * its composite columns, which ALTER TYPE sends.
+ */
+static BDRAttOutputPlan *
+get_output_plan(BdrOutputData *data, BDRRelation *rel)
+{
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	MemoryContext old;
+	BDRAttOutputPlan *plan;
+	int			i;
+
+	if (rel->output_plan != NULL)
+		return rel->output_plan;
+
+	Assert(rel->output_plan_cxt == NULL);
+
+	rel->output_plan_cxt = AllocSetContextCreate(CacheMemoryContext,
+												 "bdr output plan",
+												 ALLOCSET_SMALL_MINSIZE,
+												 ALLOCSET_SMALL_INITSIZE,
+												 ALLOCSET_SMALL_MAXSIZE);
+	old = MemoryContextSwitchTo(rel->output_plan_cxt);
+
+	plan = palloc0(Max(desc->natts, 1) * sizeof(BDRAttOutputPlan));
+	rel->output_plan_binary = true;
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute att = desc->attrs[i];
+		BDRAttOutputPlan *attplan = &plan[i];
+		HeapTuple	typtup;
+		Form_pg_type typclass;
+		bool		use_binary = false;
+		bool		use_sendrecv = false;
+
+		attplan->attlen = att->attlen;
+		attplan->attbyval = att->attbyval;
+
+		/* never sent, only null markers are emitted for them */
+		if (att->attisdropped)
+		{
+			attplan->kind = 'n';
+			continue;
+		}
+
+		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
+		if (!HeapTupleIsValid(typtup))
+			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
+		typclass = (Form_pg_type) GETSTRUCT(typtup);
+
+		/* whether send/recv is safe depends on the composite's columns */
+		if (typclass->typtype == 'c')
+			bdr_relcache_add_type_dependency(rel, typclass->typrelid);
+
+		decide_datum_transfer(data, att, typclass, &use_binary, &use_sendrecv);
+
+		if (use_binary)
+		{
+			if (!att->attbyval && att->attlen != -1 && att->attlen <= 0)
+				elog(ERROR, "unsupported tuple type");
+			attplan->kind = 'b';
+		}
+		else if (use_sendrecv)
+		{
+			rel->output_plan_binary = false;
+			attplan->kind = 's';
+			fmgr_info_cxt(typclass->typsend, &attplan->outfunc,
+						  rel->output_plan_cxt);
+		}
+		else
+		{
+			rel->output_plan_binary = false;
+			attplan->kind = 't';
+			fmgr_info_cxt(typclass->typoutput, &attplan->outfunc,
+						  rel->output_plan_cxt);
+		}
+
+		ReleaseSysCache(typtup);
+	}
+
+	MemoryContextSwitchTo(old);
+
+	rel->output_plan = plan;
+	return plan;
+}
+
 /*
  * Write a tuple to the outputstream, in the most efficient format possible.
+ *
+ * If oldtuple is passed, columns whose value is the same in both tuples are
+ * sent as unchanged, like unchanged toasted columns, and the receiving side
+ * keeps its local value for them. So are columns left out by the column lists
+ * of the replication sets.
+ *
+ * The values of the columns in 'chunked' have already been sent by
+ * write_value_chunks(), only their length is repeated here.
  */
 static void
-write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
-			HeapTuple tuple)
+write_tuple(BdrOutputData *data, StringInfo out, BDRRelation *rel,
+			HeapTuple tuple, HeapTuple oldtuple, Bitmapset *chunked)
 {
 	TupleDesc	desc;
+	BDRAttOutputPlan *plan;
 	Datum		values[MaxTupleAttributeNumber];
 	bool		isnull[MaxTupleAttributeNumber];
+	Datum	   *oldvalues = NULL;
+	bool	   *oldisnull = NULL;
 	int			i;
+	int			nbinary = 0;
+	int			nsendrecv = 0;
+	int			ntext = 0;
+	instr_time	start_time;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(start_time);
 
-	desc = RelationGetDescr(rel);
+	desc = RelationGetDescr(rel->rel);
+	plan = get_output_plan(data, rel);
 
 	pq_sendbyte(out, 'T');			/* tuple follows */
 
@@ -1005,67 +2327,107 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 					  desc->natts * ( 1 + 4));
 
 	/*
-	 * XXX: should this prove to be a relevant bottleneck, it might be
-	 * interesting to inline heap_deform_tuple() here, we don't actually need
-	 * the information in the form we get from it.
+	 * If every column is sent in binary there's no need to deform the tuple,
+	 * its data can be copied straight out of the heap tuple. Comparisons with
+	 * the old tuple and column lists still need the deformed values though.
 	 */
+	if (rel->output_plan_binary && oldtuple == NULL && data->tuple_fast_path &&
+		rel->computed_columns == NULL && chunked == NULL)
+	{
+		nbinary = write_tuple_binary(out, rel, tuple);
+		goto done;
+	}
+
 	heap_deform_tuple(tuple, desc, values, isnull);
 
-	for (i = 0; i < desc->natts; i++)
+	if (oldtuple != NULL)
 	{
-		HeapTuple	typtup;
-		Form_pg_type typclass;
-
-		Form_pg_attribute att = desc->attrs[i];
+		/* allocated in the per-change context, which is reset afterwards */
+		oldvalues = palloc(desc->natts * sizeof(Datum));
+		oldisnull = palloc(desc->natts * sizeof(bool));
+		heap_deform_tuple(oldtuple, desc, oldvalues, oldisnull);
+	}
 
-		bool use_binary = false;
-		bool use_sendrecv = false;
+	for (i = 0; i < desc->natts; i++)
+	{
+		BDRAttOutputPlan *attplan = &plan[i];
 
-		if (isnull[i] || att->attisdropped)
+		/*
+		 * Columns not in the column lists of the replication sets are sent
+		 * as unchanged; the receiving side keeps its local value on update
+		 * and uses NULL on insert.
+		 */
+		if (rel->computed_columns != NULL &&
+			!bms_is_member(i + 1, rel->computed_columns))
+		{
+			pq_sendbyte(out, 'u');	/* unreplicated column */
+			continue;
+		}
+		else if (isnull[i] || attplan->kind == 'n')
 		{
 			pq_sendbyte(out, 'n');	/* null column */
 			continue;
 		}
-		else if (att->attlen == -1 && VARATT_IS_EXTERNAL_ONDISK(values[i]))
+		else if (attplan->attlen == -1 && VARATT_IS_EXTERNAL_ONDISK(values[i]))
 		{
 			pq_sendbyte(out, 'u');	/* unchanged toast column */
 			continue;
 		}
+		/*
+		 * A bytewise comparison is sufficient here: differently represented
+		 * but equal values, e.g. compressed and uncompressed ones, are just
+		 * sent again.
+		 */
+		else if (oldtuple != NULL && !oldisnull[i] &&
+				 datumIsEqual(values[i], oldvalues[i],
+							  attplan->attbyval, attplan->attlen))
+		{
+			pq_sendbyte(out, 'u');	/* unchanged column */
+			continue;
+		}
+		else if (bms_is_member(i + 1, chunked))
+		{
+			struct varatt_indirect redirect;
 
-		typtup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(att->atttypid));
-		if (!HeapTupleIsValid(typtup))
-			elog(ERROR, "cache lookup failed for type %u", att->atttypid);
-		typclass = (Form_pg_type) GETSTRUCT(typtup);
+			VARATT_EXTERNAL_GET_POINTER(redirect, DatumGetPointer(values[i]));
 
-		decide_datum_transfer(data, att, typclass, &use_binary, &use_sendrecv);
+			nbinary++;
+			pq_sendbyte(out, 'c');	/* value was sent in chunks before */
+			pq_sendint(out, VARSIZE_ANY(redirect.pointer), 4); /* length */
+			continue;
+		}
 
-		if (use_binary)
+		if (attplan->kind == 'b')
 		{
+			nbinary++;
 			pq_sendbyte(out, 'b');	/* binary data follows */
 
 			/* pass by value */
-			if (att->attbyval)
+			if (attplan->attbyval)
 			{
-				pq_sendint(out, att->attlen, 4); /* length */
+				pq_sendint(out, attplan->attlen, 4); /* length */
 
-				enlargeStringInfo(out, att->attlen);
-				store_att_byval(out->data + out->len, values[i], att->attlen);
-				out->len += att->attlen;
+				enlargeStringInfo(out, attplan->attlen);
+				store_att_byval(out->data + out->len, values[i],
+								attplan->attlen);
+				out->len += attplan->attlen;
 				out->data[out->len] = '\0';
 			}
 			/* fixed length non-varlena pass-by-reference type */
-			else if (att->attlen > 0)
+			else if (attplan->attlen > 0)
 			{
-				pq_sendint(out, att->attlen, 4); /* length */
+				pq_sendint(out, attplan->attlen, 4); /* length */
 
 				appendBinaryStringInfo(out, DatumGetPointer(values[i]),
-									   att->attlen);
+									   attplan->attlen);
 			}
 			/* varlena type */
-			else if (att->attlen == -1)
+			else
 			{
 				char *data = DatumGetPointer(values[i]);
 
+				Assert(attplan->attlen == -1);
+
 				/* send indirect datums inline */
 				if (VARATT_IS_EXTERNAL_INDIRECT(values[i]))
 				{
@@ -1082,18 +2444,16 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 									   VARSIZE_ANY(data));
 
 			}
-			else
-				elog(ERROR, "unsupported tuple type");
 		}
-		else if (use_sendrecv)
+		else if (attplan->kind == 's')
 		{
 			bytea	   *outputbytes;
 			int			len;
 
+			nsendrecv++;
 			pq_sendbyte(out, 's');	/* 'send' data follows */
 
-			outputbytes =
-				OidSendFunctionCall(typclass->typsend, values[i]);
+			outputbytes = SendFunctionCall(&attplan->outfunc, values[i]);
 
 			len = VARSIZE(outputbytes) - VARHDRSZ;
 			pq_sendint(out, len, 4); /* length */
@@ -1105,18 +2465,235 @@ write_tuple(BdrOutputData *data, StringInfo out, Relation rel,
 			char   	   *outputstr;
 			int			len;
 
+			Assert(attplan->kind == 't');
+
+			ntext++;
 			pq_sendbyte(out, 't');	/* 'text' data follows */
 
-			outputstr =
-				OidOutputFunctionCall(typclass->typoutput, values[i]);
+			outputstr = OutputFunctionCall(&attplan->outfunc, values[i]);
 			len = strlen(outputstr) + 1;
 			pq_sendint(out, len, 4); /* length */
 			appendBinaryStringInfo(out, outputstr, len); /* data */
 			pfree(outputstr);
 		}
+	}
 
-		ReleaseSysCache(typtup);
+done:
+	data->stats->nr_columns_binary += nbinary;
+	data->stats->nr_columns_sendrecv += nsendrecv;
+	data->stats->nr_columns_text += ntext;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start_time);
+	data->stats->write_tuple_time += INSTR_TIME_GET_MICROSEC(duration);
+}
+
+/*
+ * Send the large binary varlena values of a tuple in pieces of at most
+ * value_chunk_size bytes, each in a message of its own ('V'), ahead of the
+ * change they belong to. The client reassembles them and uses them for the
+ * columns write_tuple() marks as chunked ('c'), in order.
+ *
+ * That way a large value is copied into the output buffer piece by piece,
+ * instead of growing the buffer - and the client's receive buffer - to the
+ * size of the whole change.
+ *
+ * Only values write_tuple() would send in binary qualify. Large values are
+ * always toasted, so only tuples with external values need a closer look;
+ * the decoded tuple points to their reassembled form in memory.
+ *
+ * Returns the set of attribute numbers whose values were sent.
+ */
+static Bitmapset *
+write_value_chunks(LogicalDecodingContext *ctx, BDRRelation *rel,
+				   HeapTuple tuple, HeapTuple oldtuple)
+{
+	BdrOutputData *data = ctx->output_plugin_private;
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	BDRAttOutputPlan *plan;
+	Datum		values[MaxTupleAttributeNumber];
+	bool		isnull[MaxTupleAttributeNumber];
+	Datum	   *oldvalues = NULL;
+	bool	   *oldisnull = NULL;
+	Bitmapset  *chunked = NULL;
+	int			i;
+
+	if (!HeapTupleHasExternal(tuple))
+		return NULL;
+
+	plan = get_output_plan(data, rel);
+
+	heap_deform_tuple(tuple, desc, values, isnull);
+
+	if (oldtuple != NULL)
+	{
+		oldvalues = palloc(desc->natts * sizeof(Datum));
+		oldisnull = palloc(desc->natts * sizeof(bool));
+		heap_deform_tuple(oldtuple, desc, oldvalues, oldisnull);
+	}
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		BDRAttOutputPlan *attplan = &plan[i];
+		struct varatt_indirect redirect;
+		char	   *value;
+		Size		len;
+		Size		off;
+
+		/* the same columns write_tuple() sends with binary data */
+		if (attplan->kind != 'b' || attplan->attlen != -1 || isnull[i])
+			continue;
+		if (rel->computed_columns != NULL &&
+			!bms_is_member(i + 1, rel->computed_columns))
+			continue;
+		if (!VARATT_IS_EXTERNAL_INDIRECT(values[i]))
+			continue;
+		if (oldtuple != NULL && !oldisnull[i] &&
+			datumIsEqual(values[i], oldvalues[i],
+						 attplan->attbyval, attplan->attlen))
+			continue;
+
+		VARATT_EXTERNAL_GET_POINTER(redirect, DatumGetPointer(values[i]));
+		value = (char *) redirect.pointer;
+		Assert(!VARATT_IS_EXTERNAL(value));
+
+		len = VARSIZE_ANY(value);
+		if (len <= data->value_chunk_size)
+			continue;
+
+		for (off = 0; off < len; off += data->value_chunk_size)
+		{
+			Size		chunklen = Min(len - off, data->value_chunk_size);
+
+			bdr_prepare_write(ctx, false);
+			pq_sendbyte(ctx->out, 'V');		/* value chunk */
+			pq_sendint(ctx->out, len, 4);		/* length of the whole value */
+			pq_sendint(ctx->out, chunklen, 4);	/* length of this chunk */
+			appendBinaryStringInfo(ctx->out, value + off, chunklen);
+			/* don't let chunks pile up in a batch */
+			bdr_write(ctx, false, true);
+		}
+
+		chunked = bms_add_member(chunked, i + 1);
+	}
+
+	return chunked;
+}
+
+/*
+ * Write the attributes of a tuple all of whose columns are sent in binary.
+ *
+ * This produces the same output as write_tuple(), but walks the tuple's null
+ * bitmap and data area itself instead of using heap_deform_tuple(), copying
+ * each attribute's on-disk representation directly into the output buffer.
+ * That's the same thing write_tuple() ends up doing for binary columns, minus
+ * the detour through the values/isnull arrays. The caller has already sent
+ * the tuple header.
+ *
+ * Returns the number of columns sent with data.
+ */
+static int
+write_tuple_binary(StringInfo out, BDRRelation *rel, HeapTuple tuple)
+{
+	TupleDesc	desc = RelationGetDescr(rel->rel);
+	BDRAttOutputPlan *plan = rel->output_plan;
+	HeapTupleHeader tup = tuple->t_data;
+	bool		hasnulls = HeapTupleHasNulls(tuple);
+	bits8	   *bp = tup->t_bits;
+	char	   *tp = (char *) tup + tup->t_hoff;
+	long		off = 0;
+	bool		slow = false;	/* can we use/set attcacheoff? */
+	int			natts;
+	int			nsent = 0;
+	int			i;
+
+	Assert(rel->output_plan_binary);
+
+	/* tuples written before an ALTER TABLE ... ADD COLUMN may be shorter */
+	natts = Min(HeapTupleHeaderGetNatts(tup), desc->natts);
+
+	for (i = 0; i < natts; i++)
+	{
+		Form_pg_attribute thisatt = desc->attrs[i];
+		BDRAttOutputPlan *attplan = &plan[i];
+		char	   *attptr;
+
+		if (hasnulls && att_isnull(i, bp))
+		{
+			pq_sendbyte(out, 'n');	/* null column */
+			slow = true;		/* can't use attcacheoff anymore */
+			continue;
+		}
+
+		/* same offset computation as in heap_deform_tuple() */
+		if (!slow && thisatt->attcacheoff >= 0)
+			off = thisatt->attcacheoff;
+		else if (thisatt->attlen == -1)
+		{
+			off = att_align_pointer(off, thisatt->attalign, -1, tp + off);
+			slow = true;
+		}
+		else
+			off = att_align_nominal(off, thisatt->attalign);
+
+		attptr = tp + off;
+
+		off = att_addlength_pointer(off, thisatt->attlen, attptr);
+		if (thisatt->attlen <= 0)
+			slow = true;
+
+		/* dropped columns still take up space in old tuples */
+		if (attplan->kind == 'n')
+		{
+			pq_sendbyte(out, 'n');	/* null column */
+			continue;
+		}
+
+		Assert(attplan->kind == 'b');
+
+		if (attplan->attlen == -1)
+		{
+			char	   *data = attptr;
+
+			if (VARATT_IS_EXTERNAL_ONDISK(data))
+			{
+				pq_sendbyte(out, 'u');	/* unchanged toast column */
+				continue;
+			}
+
+			/* send indirect datums inline */
+			if (VARATT_IS_EXTERNAL_INDIRECT(data))
+			{
+				struct varatt_indirect redirect;
+				VARATT_EXTERNAL_GET_POINTER(redirect, data);
+				data = (char *) redirect.pointer;
+			}
+
+			Assert(!VARATT_IS_EXTERNAL(data));
+
+			pq_sendbyte(out, 'b');	/* binary data follows */
+			pq_sendint(out, VARSIZE_ANY(data), 4); /* length */
+			appendBinaryStringInfo(out, data, VARSIZE_ANY(data));
+			nsent++;
+		}
+		else
+		{
+			/*
+			 * Pass-by-value attributes are stored in their native width, so
+			 * the on-disk bytes are what store_att_byval() would produce.
+			 */
+			pq_sendbyte(out, 'b');	/* binary data follows */
+			pq_sendint(out, attplan->attlen, 4); /* length */
+			appendBinaryStringInfo(out, attptr, attplan->attlen);
+			nsent++;
+		}
 	}
+
+	/* attributes missing from the tuple are null */
+	for (; i < desc->natts; i++)
+		pq_sendbyte(out, 'n');
+
+	return nsent;
 }
 
 static void
@@ -1125,16 +2702,48 @@ pg_decode_message(LogicalDecodingContext *ctx,
 				  bool transactional, Size sz,
 				  const char *message)
 {
+	BdrOutputData *data = ctx->output_plugin_private;
+
 	/*
-	 * TODO: at some point we'll need several channels and filtering here..
+	 * BDR's own messages always go out; those on other channels only if the
+	 * client subscribed to their channel. Clients that didn't say get all.
 	 */
-	OutputPluginPrepareWrite(ctx, true);
+	if (data->num_message_channels >= 0)
+	{
+		StringInfoData msg;
+		int			chanlen;
+		char	   *chan;
+
+		/* skip anything not framed like bdr_prepare_message() does */
+		if (sz < 4)
+			return;
+
+		msg.data = (char *) message;
+		msg.len = sz;
+		msg.cursor = 0;
+		chanlen = pq_getmsgint(&msg, 4);
+		if (chanlen < 0 || chanlen > msg.len - msg.cursor)
+			return;
+
+		chan = pnstrdup(pq_getmsgbytes(&msg, chanlen), chanlen);
+
+		if (strcmp(chan, "bdr") != 0 &&
+			bsearch(&chan, data->message_channels, data->num_message_channels,
+					sizeof(char *), pg_qsort_strcmp) == NULL)
+		{
+			pfree(chan);
+			return;
+		}
+		pfree(chan);
+	}
+
+	bdr_prepare_write(ctx, true);
 	pq_sendbyte(ctx->out, 'M');	/* message follows */
 	pq_sendbyte(ctx->out, transactional);
 	pq_sendint64(ctx->out, lsn);
 	pq_sendint(ctx->out, sz, 4);
 	pq_sendbytes(ctx->out, message, sz);
-	OutputPluginWrite(ctx, true);
+	bdr_write(ctx, true, true);
 }
 
 /*
@@ -478,7 +478,8 @@ bdr_maintain_db_workers(void)
 			"  conn_sysid, conn_timeline, conn_dboid, "
 			"  conn_is_unidirectional, "
 			"  conn_origin_dboid <> 0 AS origin_is_my_id, "
-			"  node_status "
+			"  node_status, "
+			"  " BDR_CONN_RELAYED_EXPR " AS relayed "
 			"FROM bdr.bdr_connections "
 			"    JOIN bdr.bdr_nodes ON ("
 			"          conn_sysid = node_sysid AND "
@@ -524,6 +525,7 @@ bdr_maintain_db_workers(void)
 		char*					tmp_sysid;
 		bool					origin_is_my_id;
 		char					node_status;
+		bool					relayed;
 
 		tuple = SPI_tuptable->vals[i];
 
@@ -569,10 +571,16 @@ bdr_maintain_db_workers(void)
 		Assert(!isnull);
 		node_status = DatumGetChar(temp_datum);
 
-		elog(DEBUG1, "Found bdr_connections entry for "BDR_LOCALID_FORMAT" (origin specific: %d, status: %c)",
+		temp_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc,
+								   getattno("relayed"),
+								   &isnull);
+		Assert(!isnull);
+		relayed = DatumGetBool(temp_datum);
+
+		elog(DEBUG1, "Found bdr_connections entry for "BDR_LOCALID_FORMAT" (origin specific: %d, status: %c, relayed: %d)",
 			 target_sysid, target_timeline, target_dboid,
 			 EMPTY_REPLICATION_NAME,
-			 (int) origin_is_my_id, node_status);
+			 (int) origin_is_my_id, node_status, (int) relayed);
 
 		if(node_status == 'k')
 		{
@@ -608,6 +616,21 @@ bdr_maintain_db_workers(void)
 			continue;
 		}
 
+		/*
+		 * Changes from this node reach us through a relay node. It still
+		 * counts towards nnodes, but we don't connect to it. A worker that's
+		 * still running for it has just been woken above and unregisters
+		 * itself once it sees the new configuration.
+		 */
+		if (relayed)
+		{
+			elog(DEBUG2, "Skipping registration of worker for node "BDR_LOCALID_FORMAT" on db oid=%u: changes are exchanged through a relay node",
+				 target_sysid, target_timeline, target_dboid,
+				 EMPTY_REPLICATION_NAME, MyDatabaseId);
+			LWLockRelease(BdrWorkerCtl->lock);
+			continue;
+		}
+
 		/* We're going to resister a new worker for this connection */
 
 		/* Set the display name in 'ps' etc */
@@ -640,6 +663,7 @@ bdr_maintain_db_workers(void)
 		apply->remote_timeline = target_timeline;
 		apply->remote_dboid = target_dboid;
 		apply->replay_stop_lsn = InvalidXLogRecPtr;
+		apply->parallel_resume_lsn = InvalidXLogRecPtr;
 		apply->forward_changesets = false;
 		apply->perdb = bdr_worker_slot;
 		LWLockRelease(BdrWorkerCtl->lock);
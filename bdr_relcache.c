@@ -18,10 +18,21 @@
 
 #include "access/genam.h"
 #include "access/heapam.h"
+#include "access/sysattr.h"
 #include "access/xact.h"
 
 #include "commands/seclabel.h"
 
+#include "nodes/makefuncs.h"
+
+#include "optimizer/clauses.h"
+
+#include "parser/parse_coerce.h"
+#include "parser/parse_collate.h"
+#include "parser/parse_expr.h"
+#include "parser/parse_relation.h"
+#include "parser/parser.h"
+
 #include "utils/builtins.h"
 #include "utils/catcache.h"
 #include "utils/fmgroids.h"
@@ -29,9 +40,68 @@
 #include "utils/jsonapi.h"
 #include "utils/json.h"
 #include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/relcache.h"
 
 static HTAB *BDRRelcacheHash = NULL;
 
+/* some output plan depends on a composite type, see below */
+static bool BDRRelcacheHaveTypeDeps = false;
+
+/*
+ * Copy of bdr.bdr_replication_set_config, keyed by set name. It's loaded once
+ * per decoding session and afterwards kept current from the configuration
+ * changes passing through the decoded change stream, see
+ * bdr_replication_set_config_changed().
+ */
+typedef struct BDRReplicationSetConfig
+{
+	NameData	set_name;		/* hash key */
+	bool		replicate_insert;
+	bool		replicate_update;
+	bool		replicate_delete;
+} BDRReplicationSetConfig;
+
+static HTAB *BDRReplicationSetConfigHash = NULL;
+
+/*
+ * Forget everything bdr_heap_compute_replication_settings() derived for the
+ * relation, including the output plugin's plan, which depends on it.
+ */
+static void
+BDRRelcacheHashResetComputed(BDRRelation *entry)
+{
+	list_free(entry->computed_filter_insert);
+	list_free(entry->computed_filter_update);
+	list_free(entry->computed_filter_delete);
+	bms_free(entry->computed_columns);
+
+	if (entry->output_plan_cxt != NULL)
+		MemoryContextDelete(entry->output_plan_cxt);
+
+	entry->computed_repl_valid = false;
+	entry->computed_repl_insert = false;
+	entry->computed_repl_update = false;
+	entry->computed_repl_delete = false;
+	entry->computed_filter_insert = NIL;
+	entry->computed_filter_update = NIL;
+	entry->computed_filter_delete = NIL;
+	entry->computed_columns = NULL;
+
+	entry->output_plan_cxt = NULL;
+	entry->output_plan = NULL;
+	entry->output_plan_binary = false;
+	entry->output_plan_typrelids = NIL;
+	entry->output_filters_valid = false;
+	entry->output_filter_insert = NULL;
+	entry->output_filter_update = NULL;
+	entry->output_filter_delete = NULL;
+	entry->output_filter_update_attrs = NULL;
+	entry->output_filter_delete_attrs = NULL;
+	entry->output_filter_slot = NULL;
+}
+
 static void
 BDRRelcacheHashInvalidateEntry(BDRRelation *entry)
 {
@@ -47,6 +117,35 @@ BDRRelcacheHashInvalidateEntry(BDRRelation *entry)
 
 		pfree(entry->replication_sets);
 	}
+
+	if (entry->num_row_filters > 0)
+	{
+		for (i = 0; i < entry->num_row_filters; i++)
+		{
+			pfree(entry->row_filter_sets[i]);
+			pfree(entry->row_filters[i]);
+		}
+
+		pfree(entry->row_filter_sets);
+		pfree(entry->row_filters);
+	}
+
+	if (entry->num_column_lists > 0)
+	{
+		for (i = 0; i < entry->num_column_lists; i++)
+		{
+			pfree(entry->column_list_sets[i]);
+			list_free_deep(entry->column_lists[i]);
+		}
+
+		pfree(entry->column_list_sets);
+		pfree(entry->column_lists);
+	}
+
+	if (entry->apply_plan_cxt != NULL)
+		MemoryContextDelete(entry->apply_plan_cxt);
+
+	BDRRelcacheHashResetComputed(entry);
 }
 
 void
@@ -84,9 +183,40 @@ BDRRelcacheHashInvalidateCallback(Datum arg, Oid relid)
 		{
 			entry->valid = false;
 		}
+
+		/*
+		 * The relation might also be the row type of a composite column in
+		 * another relation, whose output plan then has to be rebuilt: ALTER
+		 * TYPE can change whether the type is safe to send with send/recv.
+		 */
+		if (BDRRelcacheHaveTypeDeps)
+		{
+			hash_seq_init(&status, BDRRelcacheHash);
+
+			while ((entry = (BDRRelation *) hash_seq_search(&status)) != NULL)
+			{
+				if (list_member_oid(entry->output_plan_typrelids, relid))
+					entry->valid = false;
+			}
+		}
 	}
 }
 
+/*
+ * Note that the output plan of a relation depends on the composite type whose
+ * pg_type.typrelid is typrelid, see BDRRelcacheHashInvalidateCallback().
+ * Must be called in the relation's output_plan_cxt.
+ */
+void
+bdr_relcache_add_type_dependency(BDRRelation *entry, Oid typrelid)
+{
+	Assert(CurrentMemoryContext == entry->output_plan_cxt);
+
+	entry->output_plan_typrelids =
+		list_append_unique_oid(entry->output_plan_typrelids, typrelid);
+	BDRRelcacheHaveTypeDeps = true;
+}
+
 static void
 bdr_relcache_initialize()
 {
@@ -167,6 +297,9 @@ bdr_parse_relation_options(const char *label, BDRRelation *rel)
 	JsonbValue	v;
 	int			r;
 	bool		parsing_sets = false;
+	bool		parsing_filters = false;
+	bool		parsing_columns = false;
+	char	   *filter_set = NULL;
 	int			level = 0;
 	Jsonb	*data = NULL;
 
@@ -184,17 +317,34 @@ bdr_parse_relation_options(const char *label, BDRRelation *rel)
 	{
 		if (level == 0 && r != WJB_BEGIN_OBJECT)
 			elog(ERROR, "root element needs to be an object");
-		else if (level == 0 && it->nElems > 1)
-			elog(ERROR, "only 'sets' allowed on root level");
+		else if (level == 0 && it->nElems > 3)
+			elog(ERROR, "only 'sets', 'row_filters' and 'column_lists' allowed on root level");
 		else if (level == 1 && r == WJB_KEY)
 		{
-			if (strncmp(v.val.string.val, "sets", v.val.string.len) != 0)
+			if (strncmp(v.val.string.val, "sets", v.val.string.len) == 0)
+			{
+				parsing_sets = true;
+
+				if (rel != NULL)
+					rel->num_replication_sets = 0;
+			}
+			else if (strncmp(v.val.string.val, "row_filters", v.val.string.len) == 0)
+			{
+				parsing_filters = true;
+
+				if (rel != NULL)
+					rel->num_row_filters = 0;
+			}
+			else if (strncmp(v.val.string.val, "column_lists", v.val.string.len) == 0)
+			{
+				parsing_columns = true;
+
+				if (rel != NULL)
+					rel->num_column_lists = 0;
+			}
+			else
 				elog(ERROR, "unexpected key: %s",
 					 pnstrdup(v.val.string.val, v.val.string.len));
-			parsing_sets = true;
-
-			if (rel != NULL)
-				rel->num_replication_sets = 0;
 		}
 		else if (r == WJB_BEGIN_ARRAY || r == WJB_BEGIN_OBJECT)
 		{
@@ -204,12 +354,44 @@ bdr_parse_relation_options(const char *label, BDRRelation *rel)
 					MemoryContextAlloc(CacheMemoryContext,
 									   sizeof(char *) * it->nElems);
 			}
+			else if (parsing_filters && level != 1)
+				elog(ERROR, "row_filters needs to be an object");
+			else if (parsing_filters && rel != NULL)
+			{
+				rel->row_filter_sets =
+					MemoryContextAlloc(CacheMemoryContext,
+									   sizeof(char *) * it->nElems);
+				rel->row_filters =
+					MemoryContextAlloc(CacheMemoryContext,
+									   sizeof(char *) * it->nElems);
+			}
+			/* an object of arrays of column names */
+			else if (parsing_columns &&
+					 ((level == 1 && r != WJB_BEGIN_OBJECT) ||
+					  (level == 2 && r != WJB_BEGIN_ARRAY) ||
+					  level > 2))
+				elog(ERROR, "column_lists needs to be an object of arrays");
+			else if (parsing_columns && level == 1 && rel != NULL)
+			{
+				rel->column_list_sets =
+					MemoryContextAlloc(CacheMemoryContext,
+									   sizeof(char *) * it->nElems);
+				rel->column_lists =
+					MemoryContextAlloc(CacheMemoryContext,
+									   sizeof(List *) * it->nElems);
+			}
 			level++;
 		}
 		else if (r == WJB_END_ARRAY || r == WJB_END_OBJECT)
 		{
 			level--;
-			parsing_sets = false;
+
+			if (level <= 1)
+			{
+				parsing_sets = false;
+				parsing_filters = false;
+				parsing_columns = false;
+			}
 		}
 		else if (parsing_sets)
 		{
@@ -235,6 +417,78 @@ bdr_parse_relation_options(const char *label, BDRRelation *rel)
 
 			MemoryContextSwitchTo(oldcontext);
 		}
+		else if (parsing_filters)
+		{
+			MemoryContext oldcontext;
+
+			if (level != 2)
+				elog(ERROR, "unexpected level for row filter %d", level);
+
+			oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+
+			/* set name followed by its filter */
+			if (r == WJB_KEY)
+			{
+				filter_set = pnstrdup(v.val.string.val, v.val.string.len);
+				bdr_validate_replication_set_name(filter_set, false);
+			}
+			else if (r == WJB_VALUE && v.type == jbvString)
+			{
+				Assert(filter_set != NULL);
+
+				if (rel != NULL)
+				{
+					rel->row_filter_sets[rel->num_row_filters] = filter_set;
+					rel->row_filters[rel->num_row_filters++] =
+						pnstrdup(v.val.string.val, v.val.string.len);
+				}
+				else
+					pfree(filter_set);
+				filter_set = NULL;
+			}
+			else
+				elog(ERROR, "row filter needs to be a string");
+
+			MemoryContextSwitchTo(oldcontext);
+		}
+		else if (parsing_columns)
+		{
+			char	   *name;
+			MemoryContext oldcontext;
+
+			if (!((level == 2 && r == WJB_KEY) ||
+				  (level == 3 && r == WJB_ELEM && v.type == jbvString)))
+				elog(ERROR, "column list needs to be an array of column names");
+
+			oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+
+			name = pnstrdup(v.val.string.val, v.val.string.len);
+
+			/* set name followed by the array of its columns */
+			if (r == WJB_KEY)
+			{
+				bdr_validate_replication_set_name(name, false);
+
+				if (rel != NULL)
+				{
+					rel->column_list_sets[rel->num_column_lists] = name;
+					rel->column_lists[rel->num_column_lists++] = NIL;
+				}
+				else
+					pfree(name);
+			}
+			else if (rel != NULL)
+			{
+				List	  **columns;
+
+				columns = &rel->column_lists[rel->num_column_lists - 1];
+				*columns = lappend(*columns, name);
+			}
+			else
+				pfree(name);
+
+			MemoryContextSwitchTo(oldcontext);
+		}
 		else
 			elog(ERROR, "unexpected content: %u at level %d", r, level);
 	}
@@ -247,6 +501,185 @@ bdr_parse_relation_options(const char *label, BDRRelation *rel)
 
 }
 
+/*
+ * Transform a row filter into an expression over the relation's columns.
+ *
+ * Row filters are evaluated inside the walsender for each change, with only
+ * the changed row at hand. So only expressions referring to nothing but the
+ * row's columns and immutable functions are allowed; the restrictions on
+ * CHECK constraints (no subqueries, aggregates, ...) apply as well.
+ */
+Node *
+bdr_row_filter_expr(Relation rel, const char *filter)
+{
+	List	   *raw;
+	SelectStmt *stmt;
+	ParseState *pstate;
+	RangeTblEntry *rte;
+	Node	   *expr;
+
+	raw = raw_parser(psprintf("SELECT 1 WHERE %s", filter));
+
+	/* the filter must not have added anything but the WHERE clause */
+	stmt = list_length(raw) == 1 ? (SelectStmt *) linitial(raw) : NULL;
+	if (stmt == NULL || !IsA(stmt, SelectStmt) ||
+		stmt->op != SETOP_NONE || stmt->whereClause == NULL ||
+		stmt->groupClause != NIL || stmt->havingClause != NULL ||
+		stmt->windowClause != NIL || stmt->sortClause != NIL ||
+		stmt->limitOffset != NULL || stmt->limitCount != NULL ||
+		stmt->lockingClause != NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("invalid row filter \"%s\"", filter)));
+
+	pstate = make_parsestate(NULL);
+	rte = addRangeTableEntryForRelation(pstate, rel, NULL, false, false);
+	addRTEtoQuery(pstate, rte, false, true, true);
+
+	expr = transformExpr(pstate, stmt->whereClause,
+						 EXPR_KIND_CHECK_CONSTRAINT);
+	expr = coerce_to_boolean(pstate, expr, "row filter");
+	assign_expr_collations(pstate, expr);
+
+	if (contain_mutable_functions(expr))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+				 errmsg("functions in row filter \"%s\" must be marked IMMUTABLE",
+						filter)));
+
+	free_parsestate(pstate);
+
+	return expr;
+}
+
+/*
+ * Return the attnums of the relation's columns that are part of a unique
+ * index. They're needed to apply changes and detect conflicts, so they're
+ * always replicated, whatever the column lists say.
+ */
+static Bitmapset *
+relation_key_columns(Relation rel)
+{
+	Bitmapset  *indexattrs;
+	Bitmapset  *keycols = NULL;
+	int			attno;
+
+	indexattrs = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_KEY);
+
+	while ((attno = bms_first_member(indexattrs)) >= 0)
+	{
+		attno += FirstLowInvalidHeapAttributeNumber;
+		if (attno > 0)
+			keycols = bms_add_member(keycols, attno);
+	}
+
+	bms_free(indexattrs);
+
+	return keycols;
+}
+
+static void
+check_relation_option_set(BDRRelation *entry, Relation rel,
+						  const char *setname)
+{
+	if (entry->num_replication_sets <= 0 ||
+		!bsearch(&setname,
+				 entry->replication_sets, entry->num_replication_sets,
+				 sizeof(char *), pg_qsort_strcmp))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("relation \"%s\" is not a member of replication set \"%s\"",
+						RelationGetRelationName(rel), setname),
+				 errhint("Row filters and column lists can only be defined for the replication sets of a relation.")));
+}
+
+/*
+ * Check a relation's bdr security label before it's set.
+ *
+ * In addition to the syntax checks done by bdr_parse_relation_options() the
+ * row filters have to be valid expressions for the relation and the column
+ * lists have to name existing columns. Both may only refer to replication
+ * sets the relation is a member of.
+ */
+void
+bdr_validate_relation_options(Oid relid, const char *label)
+{
+	BDRRelation	entry;
+	Relation	rel;
+	int			i;
+
+	memset(&entry, 0, sizeof(BDRRelation));
+	entry.num_replication_sets = -1;
+
+	bdr_parse_relation_options(label, &entry);
+
+	if (entry.num_row_filters > 0 || entry.num_column_lists > 0)
+	{
+		TupleDesc	desc;
+		Bitmapset  *keycols;
+
+		rel = heap_open(relid, AccessShareLock);
+		desc = RelationGetDescr(rel);
+
+		for (i = 0; i < entry.num_row_filters; i++)
+		{
+			check_relation_option_set(&entry, rel, entry.row_filter_sets[i]);
+			(void) bdr_row_filter_expr(rel, entry.row_filters[i]);
+		}
+
+		keycols = relation_key_columns(rel);
+
+		for (i = 0; i < entry.num_column_lists; i++)
+		{
+			Bitmapset  *columns = NULL;
+			ListCell   *lc;
+			int			attno;
+
+			check_relation_option_set(&entry, rel, entry.column_list_sets[i]);
+
+			foreach(lc, entry.column_lists[i])
+			{
+				const char *colname = lfirst(lc);
+
+				attno = get_attnum(relid, colname);
+				if (attno <= 0)
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_COLUMN),
+							 errmsg("column \"%s\" of relation \"%s\" does not exist",
+									colname, RelationGetRelationName(rel))));
+
+				columns = bms_add_member(columns, attno);
+			}
+
+			/*
+			 * Columns left out are null in inserted rows on the receiving
+			 * side, so that mustn't be forbidden.
+			 */
+			for (attno = 1; attno <= desc->natts; attno++)
+			{
+				Form_pg_attribute att = desc->attrs[attno - 1];
+
+				if (att->attnotnull && !att->attisdropped &&
+					!bms_is_member(attno, columns) &&
+					!bms_is_member(attno, keycols))
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							 errmsg("column \"%s\" of relation \"%s\" is NOT NULL and must be in the column list of replication set \"%s\"",
+									NameStr(att->attname),
+									RelationGetRelationName(rel),
+									entry.column_list_sets[i])));
+			}
+
+			bms_free(columns);
+		}
+
+		bms_free(keycols);
+		heap_close(rel, AccessShareLock);
+	}
+
+	BDRRelcacheHashInvalidateEntry(&entry);
+}
+
 BDRRelation *
 bdr_heap_open(Oid reloid, LOCKMODE lockmode)
 {
@@ -302,6 +735,24 @@ bdr_heap_close(BDRRelation * rel, LOCKMODE lockmode)
 	rel->rel = NULL;
 }
 
+/*
+ * Return the memory context the apply worker's plan for the relation is kept
+ * in, creating it if necessary. It goes away when the relation is
+ * invalidated, see BDRRelcacheHashInvalidateEntry().
+ */
+MemoryContext
+bdr_apply_plan_context(BDRRelation *rel)
+{
+	if (rel->apply_plan_cxt == NULL)
+		rel->apply_plan_cxt = AllocSetContextCreate(CacheMemoryContext,
+													"bdr apply plan",
+													ALLOCSET_SMALL_MINSIZE,
+													ALLOCSET_SMALL_INITSIZE,
+													ALLOCSET_SMALL_MAXSIZE);
+
+	return rel->apply_plan_cxt;
+}
+
 
 static bool
 relation_in_replication_set(BDRRelation *r, const char *setname)
@@ -327,41 +778,285 @@ relation_in_replication_set(BDRRelation *r, const char *setname)
 	return false;
 }
 
-static HeapTuple
-replset_lookup(Relation rel, const char *cname)
+/*
+ * Read bdr.bdr_replication_set_config into BDRReplicationSetConfigHash. The
+ * table has a handful of rows, so reading all of them once is cheaper than
+ * looking sets up one at a time for every relation.
+ */
+static void
+replset_config_load(void)
 {
-	ScanKey			key;
-	NameData		name;
-	SysScanDesc		scan;
-	HeapTuple		tuple = NULL;
+	HASHCTL		ctl;
+	Relation	rel;
+	TupleDesc	desc;
+	SysScanDesc	scan;
+	HeapTuple	tuple;
 
-	namestrcpy(&name, cname);
+	Assert(BDRReplicationSetConfigHash == NULL);
 
-	key = (ScanKey) palloc(sizeof(ScanKeyData) * 1);
+	/* Make sure we've initialized CacheMemoryContext. */
+	if (CacheMemoryContext == NULL)
+		CreateCacheMemoryContext();
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = NAMEDATALEN;
+	ctl.entrysize = sizeof(BDRReplicationSetConfig);
+	ctl.hcxt = CacheMemoryContext;
+
+	BDRReplicationSetConfigHash =
+		hash_create("BDR replication set configuration", 16, &ctl,
+					HASH_ELEM | HASH_CONTEXT);
 
-	ScanKeyInit(&key[0],
-				1,
-				BTEqualStrategyNumber, F_NAMEEQ,
-				NameGetDatum(&name)
-		);
+	rel = heap_open(BdrReplicationSetConfigRelid, AccessShareLock);
+	desc = RelationGetDescr(rel);
 
-	/* FIXME: should use index */
-	scan = systable_beginscan(rel, 0, true, NULL, 1, key);
+	scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
 
 	while ((tuple = systable_getnext(scan)) != NULL)
 	{
-		tuple = heap_copytuple(tuple);
-		break;
+		BDRReplicationSetConfig *config;
+		bool		isnull;
+		Name		setname;
+
+		setname = DatumGetName(fastgetattr(tuple, 1, desc, &isnull));
+
+		config = hash_search(BDRReplicationSetConfigHash, NameStr(*setname),
+							 HASH_ENTER, NULL);
+		config->replicate_insert =
+			DatumGetBool(fastgetattr(tuple, 2, desc, &isnull));
+		config->replicate_update =
+			DatumGetBool(fastgetattr(tuple, 3, desc, &isnull));
+		config->replicate_delete =
+			DatumGetBool(fastgetattr(tuple, 4, desc, &isnull));
 	}
 
 	systable_endscan(scan);
-	return tuple;
+	heap_close(rel, AccessShareLock);
+}
+
+/*
+ * Look up the actions the named set replicates. Sets without configuration
+ * replicate everything.
+ */
+static void
+replset_lookup(const char *setname, bool *replicate_insert,
+			   bool *replicate_update, bool *replicate_delete)
+{
+	NameData	name;
+	BDRReplicationSetConfig *config;
+
+	if (BDRReplicationSetConfigHash == NULL)
+		replset_config_load();
+
+	namestrcpy(&name, setname);
+
+	config = hash_search(BDRReplicationSetConfigHash, NameStr(name),
+						 HASH_FIND, NULL);
+
+	if (config != NULL)
+	{
+		*replicate_insert = config->replicate_insert;
+		*replicate_update = config->replicate_update;
+		*replicate_delete = config->replicate_delete;
+	}
+	else
+	{
+		*replicate_insert = true;
+		*replicate_update = true;
+		*replicate_delete = true;
+	}
+}
+
+/*
+ * Throw away the computed replication settings of all relations that are
+ * members of the named set, they're recomputed on next use.
+ */
+static void
+replset_invalidate_members(const char *setname)
+{
+	HASH_SEQ_STATUS status;
+	BDRRelation *entry;
+
+	if (BDRRelcacheHash == NULL)
+		return;
+
+	hash_seq_init(&status, BDRRelcacheHash);
+
+	while ((entry = (BDRRelation *) hash_seq_search(&status)) != NULL)
+	{
+		/* entries that aren't valid get rebuilt from scratch anyway */
+		if (!entry->valid || !entry->computed_repl_valid)
+			continue;
+
+		if (relation_in_replication_set(entry, setname))
+			BDRRelcacheHashResetComputed(entry);
+	}
+}
+
+/*
+ * Process a decoded change of bdr.bdr_replication_set_config.
+ *
+ * The old tuple, if any, carries at least the key, the new tuple, if any, the
+ * set's new configuration. Applying them to the cached copy of the table
+ * keeps it in step with the decoding position, and only the members of the
+ * changed sets have to recompute their settings.
+ */
+void
+bdr_replication_set_config_changed(Relation rel, HeapTuple oldtuple,
+								   HeapTuple newtuple)
+{
+	TupleDesc	desc = RelationGetDescr(rel);
+	BDRReplicationSetConfig *config;
+	bool		isnull;
+	Name		setname;
+
+	Assert(RelationGetRelid(rel) == BdrReplicationSetConfigRelid);
+
+	if (oldtuple != NULL)
+	{
+		setname = DatumGetName(fastgetattr(oldtuple, 1, desc, &isnull));
+
+		if (BDRReplicationSetConfigHash != NULL)
+			hash_search(BDRReplicationSetConfigHash, NameStr(*setname),
+						HASH_REMOVE, NULL);
+
+		replset_invalidate_members(NameStr(*setname));
+	}
+
+	if (newtuple != NULL)
+	{
+		setname = DatumGetName(fastgetattr(newtuple, 1, desc, &isnull));
+
+		if (BDRReplicationSetConfigHash != NULL)
+		{
+			config = hash_search(BDRReplicationSetConfigHash,
+								 NameStr(*setname), HASH_ENTER, NULL);
+			config->replicate_insert =
+				DatumGetBool(fastgetattr(newtuple, 2, desc, &isnull));
+			config->replicate_update =
+				DatumGetBool(fastgetattr(newtuple, 3, desc, &isnull));
+			config->replicate_delete =
+				DatumGetBool(fastgetattr(newtuple, 4, desc, &isnull));
+		}
+
+		replset_invalidate_members(NameStr(*setname));
+	}
+}
+
+/*
+ * Forget the replication set configuration and everything computed from it,
+ * as well as which relations' metadata the output plugin sent.
+ *
+ * Needs to be called at the end of a decoding session: the next one may
+ * start decoding at an earlier position, replicate different sets or have a
+ * different client.
+ */
+void
+bdr_replication_set_config_reset(void)
+{
+	HASH_SEQ_STATUS status;
+	BDRRelation *entry;
+
+	if (BDRReplicationSetConfigHash != NULL)
+	{
+		hash_destroy(BDRReplicationSetConfigHash);
+		BDRReplicationSetConfigHash = NULL;
+	}
+
+	if (BDRRelcacheHash == NULL)
+		return;
+
+	hash_seq_init(&status, BDRRelcacheHash);
+
+	while ((entry = (BDRRelation *) hash_seq_search(&status)) != NULL)
+	{
+		/* the next session's client hasn't seen any relation metadata yet */
+		entry->output_relmeta_sent = false;
+
+		if (entry->valid)
+			BDRRelcacheHashResetComputed(entry);
+	}
+}
+
+/*
+ * Return the row filter the relation has for the named replication set, if
+ * any.
+ */
+static const char *
+relation_row_filter(BDRRelation *r, const char *setname)
+{
+	int			i;
+
+	for (i = 0; i < r->num_row_filters; i++)
+	{
+		if (strcmp(r->row_filter_sets[i], setname) == 0)
+			return r->row_filters[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the column list the relation has for the named replication set, if
+ * any.
+ */
+static List *
+relation_column_list(BDRRelation *r, const char *setname)
+{
+	int			i;
+
+	for (i = 0; i < r->num_column_lists; i++)
+	{
+		if (strcmp(r->column_list_sets[i], setname) == 0)
+			return r->column_lists[i];
+	}
+
+	return NIL;
+}
+
+/*
+ * Add an action of a replication set to the computed replication settings.
+ *
+ * Once one replication set replicates all rows there's no point in
+ * remembering the other sets' row filters.
+ */
+static void
+add_replicated_action(bool replicated, const char *filter,
+					  bool *computed, bool *unfiltered, List **filters)
+{
+	MemoryContext oldcontext;
+
+	if (!replicated)
+		return;
+
+	*computed = true;
+
+	if (filter == NULL)
+	{
+		*unfiltered = true;
+		list_free(*filters);
+		*filters = NIL;
+	}
+	else if (!*unfiltered)
+	{
+		oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+		*filters = lappend(*filters, (char *) filter);
+		MemoryContextSwitchTo(oldcontext);
+	}
 }
 
 /*
  * Compute whether modifications to this relation should be replicated or not
  * and cache the result in the relation descriptor.
  *
+ * A row is replicated if any of the replication sets replicating the action
+ * either has no row filter for the relation or one that the row passes. The
+ * filters of those sets end up in computed_filter_*.
+ *
+ * Likewise the replicated columns are the union of the column lists of the
+ * sets, plus the columns needed to identify rows. If any of the sets has no
+ * column list, all columns are replicated.
+ *
  * NB: This can only sensibly used from inside logical decoding as we require
  * a constant set of 'to be replicated' sets to be passed in - which happens
  * to be what we need for logical decoding. As there really isn't another need
@@ -375,6 +1070,11 @@ bdr_heap_compute_replication_settings(BDRRelation *r,
 									  char		 **conf_replication_sets)
 {
 	int i;
+	bool		unfiltered_insert = false;
+	bool		unfiltered_update = false;
+	bool		unfiltered_delete = false;
+	bool		all_columns = false;
+	MemoryContext oldcontext;
 
 	Assert(MyReplicationSlot); /* in decoding */
 
@@ -397,49 +1097,76 @@ bdr_heap_compute_replication_settings(BDRRelation *r,
 	 */
 	for (i = 0; i < conf_num_replication_sets; i++)
 	{
-		Relation repl_sets;
-		HeapTuple tuple;
 		const char* setname;
+		const char *filter;
+		bool		replicate_insert;
+		bool		replicate_update;
+		bool		replicate_delete;
 
 		setname = conf_replication_sets[i];
 
 		if (!relation_in_replication_set(r, setname))
 			continue;
 
-		repl_sets = heap_open(BdrReplicationSetConfigRelid, AccessShareLock);
-		tuple = replset_lookup(repl_sets, setname);
+		replset_lookup(setname, &replicate_insert, &replicate_update,
+					   &replicate_delete);
 
-		if (tuple != NULL)
-		{
-			bool		isnull;
-			TupleDesc	desc = RelationGetDescr(repl_sets);
+		filter = relation_row_filter(r, setname);
 
-			if (DatumGetBool(fastgetattr(tuple, 2, desc, &isnull)))
-				r->computed_repl_insert = true;
+		add_replicated_action(replicate_insert, filter,
+							  &r->computed_repl_insert, &unfiltered_insert,
+							  &r->computed_filter_insert);
+		add_replicated_action(replicate_update, filter,
+							  &r->computed_repl_update, &unfiltered_update,
+							  &r->computed_filter_update);
+		add_replicated_action(replicate_delete, filter,
+							  &r->computed_repl_delete, &unfiltered_delete,
+							  &r->computed_filter_delete);
 
-			if (DatumGetBool(fastgetattr(tuple, 3, desc, &isnull)))
-				r->computed_repl_update = true;
+		if (replicate_insert || replicate_update || replicate_delete)
+		{
+			List	   *columns = relation_column_list(r, setname);
+			ListCell   *lc;
 
-			if (DatumGetBool(fastgetattr(tuple, 4, desc, &isnull)))
-				r->computed_repl_delete = true;
+			if (columns == NIL)
+				all_columns = true;
 
-			pfree(tuple);
-		}
-		else
-		{
-			r->computed_repl_insert = true;
-			r->computed_repl_update = true;
-			r->computed_repl_delete = true;
-		}
+			oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+			foreach(lc, columns)
+			{
+				AttrNumber	attno = get_attnum(r->reloid, lfirst(lc));
 
-		heap_close(repl_sets, AccessShareLock);
+				/* ignore columns dropped since */
+				if (attno > 0)
+					r->computed_columns =
+						bms_add_member(r->computed_columns, attno);
+			}
+			MemoryContextSwitchTo(oldcontext);
+		}
 
 		/* no need to look any further, we replicate everything */
-		if (r->computed_repl_insert &&
-			r->computed_repl_update &&
-			r->computed_repl_delete)
+		if (unfiltered_insert && unfiltered_update && unfiltered_delete &&
+			all_columns)
 			break;
 	}
 
+	if (all_columns ||
+		!(r->computed_repl_insert || r->computed_repl_update ||
+		  r->computed_repl_delete))
+	{
+		bms_free(r->computed_columns);
+		r->computed_columns = NULL;
+	}
+	else
+	{
+		Bitmapset  *keycols = relation_key_columns(r->rel);
+
+		oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+		r->computed_columns = bms_add_members(r->computed_columns, keycols);
+		MemoryContextSwitchTo(oldcontext);
+
+		bms_free(keycols);
+	}
+
 	r->computed_repl_valid = true;
 }
@@ -65,6 +65,12 @@ bdr_shmem_init(void)
 	/* initialize other modules that need shared memory. */
 	bdr_count_shmem_init(bdr_max_workers);
 
+	/*
+	 * Every apply worker has a replication identifier, and they're numbered
+	 * densely from 1.
+	 */
+	bdr_node_identity_shmem_init(bdr_max_workers + 1);
+
 	bdr_sequencer_shmem_init(bdr_max_databases);
 
 	bdr_locks_shmem_init();
@@ -184,6 +184,7 @@ BEGIN
   DELETE FROM bdr.bdr_queued_commands;
   DELETE FROM bdr.bdr_queued_drops;
   DELETE FROM bdr.bdr_global_locks;
+  DELETE FROM bdr.bdr_node_relays;
   DELETE FROM bdr.bdr_conflict_handlers;
   DELETE FROM bdr.bdr_conflict_history;
   DELETE FROM bdr.bdr_replication_set_config;
@@ -198,6 +199,395 @@ END;
 $$;
 
 
+--
+-- Row filters and column lists are stored in the relation's security label,
+-- next to its replication sets.
+--
+CREATE FUNCTION bdr.table_set_row_filter(p_relation regclass, p_set text, p_filter text)
+  RETURNS void
+  VOLATILE
+  LANGUAGE 'plpgsql'
+  AS $$
+DECLARE
+    v_label json;
+    v_filters json;
+BEGIN
+    -- emulate STRICT for p_relation and p_set parameters
+    IF p_relation IS NULL OR p_set IS NULL THEN
+        RETURN;
+    END IF;
+
+    -- query current label
+    SELECT label::json INTO v_label
+    FROM pg_seclabel
+    WHERE provider = 'bdr'
+        AND classoid = 'pg_class'::regclass
+        AND objoid = p_relation;
+
+    -- replace the set's old filter with the new one
+    SELECT json_object_agg(key, value) INTO v_filters
+    FROM (
+        SELECT key, value
+        FROM json_each(v_label->'row_filters')
+        WHERE key <> p_set
+      UNION ALL
+        SELECT
+            p_set, to_json(p_filter)
+        WHERE p_filter IS NOT NULL
+    ) d;
+
+    -- replace old 'row_filters' parameter with new value
+    SELECT json_object_agg(key, value) INTO v_label
+    FROM (
+        SELECT key, value
+        FROM json_each(v_label)
+        WHERE key <> 'row_filters'
+      UNION ALL
+        SELECT
+            'row_filters', v_filters
+        WHERE v_filters IS NOT NULL
+    ) d;
+
+    -- and now set the appropriate label
+    EXECUTE format('SECURITY LABEL FOR bdr ON TABLE %s IS %L',
+                   p_relation, v_label) ;
+END;
+$$;
+
+CREATE FUNCTION bdr.table_set_column_list(p_relation regclass, p_set text, p_columns text[])
+  RETURNS void
+  VOLATILE
+  LANGUAGE 'plpgsql'
+  AS $$
+DECLARE
+    v_label json;
+    v_lists json;
+BEGIN
+    -- emulate STRICT for p_relation and p_set parameters
+    IF p_relation IS NULL OR p_set IS NULL THEN
+        RETURN;
+    END IF;
+
+    -- query current label
+    SELECT label::json INTO v_label
+    FROM pg_seclabel
+    WHERE provider = 'bdr'
+        AND classoid = 'pg_class'::regclass
+        AND objoid = p_relation;
+
+    -- replace the set's old column list with the new one
+    SELECT json_object_agg(key, value) INTO v_lists
+    FROM (
+        SELECT key, value
+        FROM json_each(v_label->'column_lists')
+        WHERE key <> p_set
+      UNION ALL
+        SELECT
+            p_set, to_json(p_columns)
+        WHERE p_columns IS NOT NULL
+    ) d;
+
+    -- replace old 'column_lists' parameter with new value
+    SELECT json_object_agg(key, value) INTO v_label
+    FROM (
+        SELECT key, value
+        FROM json_each(v_label)
+        WHERE key <> 'column_lists'
+      UNION ALL
+        SELECT
+            'column_lists', v_lists
+        WHERE v_lists IS NOT NULL
+    ) d;
+
+    -- and now set the appropriate label
+    EXECUTE format('SECURITY LABEL FOR bdr ON TABLE %s IS %L',
+                   p_relation, v_label) ;
+END;
+$$;
+
+CREATE FUNCTION bdr.pg_stat_get_bdr_walsender(
+    OUT pid integer,
+    OUT slot_name name,
+    OUT remote_sysid text,
+    OUT remote_timeline oid,
+    OUT remote_dboid oid,
+    OUT nr_txn_decoded int8,
+    OUT nr_txn_filtered_origin int8,
+    OUT nr_change_decoded int8,
+    OUT nr_change_filtered_origin int8,
+    OUT nr_change_filtered_repset int8,
+    OUT nr_change_filtered_row int8,
+    OUT nr_bytes_sent int8,
+    OUT nr_columns_binary int8,
+    OUT nr_columns_sendrecv int8,
+    OUT nr_columns_text int8,
+    OUT write_tuple_time float8
+)
+RETURNS SETOF record
+LANGUAGE C
+AS 'MODULE_PATHNAME';
+
+REVOKE ALL ON FUNCTION bdr.pg_stat_get_bdr_walsender() FROM PUBLIC;
+
+CREATE VIEW bdr.pg_stat_bdr_walsender AS SELECT * FROM bdr.pg_stat_get_bdr_walsender();
+
+CREATE FUNCTION bdr.pg_stat_get_bdr_walsender_txn(
+    OUT pid integer,
+    OUT slot_name name,
+    OUT metric text,
+    OUT lower_bound int8,
+    OUT upper_bound int8,
+    OUT nr_txn int8
+)
+RETURNS SETOF record
+LANGUAGE C
+AS 'MODULE_PATHNAME';
+
+REVOKE ALL ON FUNCTION bdr.pg_stat_get_bdr_walsender_txn() FROM PUBLIC;
+
+CREATE VIEW bdr.pg_stat_bdr_walsender_txn AS SELECT * FROM bdr.pg_stat_get_bdr_walsender_txn();
+
+--
+-- Relay nodes: a node with an entry here exchanges its changes with the rest
+-- of the group only through its relay node, which forwards them with their
+-- origin intact.
+--
+CREATE TABLE bdr.bdr_node_relays (
+    node_sysid text NOT NULL,
+    node_timeline oid NOT NULL,
+    node_dboid oid NOT NULL,
+    relay_sysid text NOT NULL,
+    relay_timeline oid NOT NULL,
+    relay_dboid oid NOT NULL,
+    PRIMARY KEY (node_sysid, node_timeline, node_dboid)
+);
+
+REVOKE ALL ON TABLE bdr.bdr_node_relays FROM PUBLIC;
+
+-- read by the output plugin during decoding
+ALTER TABLE bdr.bdr_node_relays SET (user_catalog_table = true);
+
+SELECT pg_catalog.pg_extension_config_dump('bdr_node_relays', '');
+
+COMMENT ON TABLE bdr.bdr_node_relays IS 'Nodes that exchange their changes with the other nodes through a relay node instead of connecting to all of them';
+
+--
+-- How far we replayed the transactions a relay node forwarded to us from
+-- other nodes. Those are replayed under the originating node's replication
+-- identifier, so the relay's isn't advanced by them; this is updated in the
+-- same transaction instead, so they aren't replayed again after a crash.
+-- Local to each node, never replicated.
+--
+CREATE TABLE bdr.bdr_relayed_progress (
+    node_sysid text NOT NULL,
+    node_timeline oid NOT NULL,
+    node_dboid oid NOT NULL,
+    remote_lsn pg_lsn NOT NULL,
+    PRIMARY KEY (node_sysid, node_timeline, node_dboid)
+);
+
+REVOKE ALL ON TABLE bdr.bdr_relayed_progress FROM PUBLIC;
+
+COMMENT ON TABLE bdr.bdr_relayed_progress IS 'Replay progress of the transactions relay nodes forwarded from other nodes';
+
+CREATE FUNCTION bdr.bdr_node_set_relay(node_name text, relay_node_name text)
+RETURNS void LANGUAGE plpgsql VOLATILE
+SET search_path = bdr, pg_catalog
+AS $body$
+DECLARE
+    v_node bdr.bdr_nodes;
+    v_relay bdr.bdr_nodes;
+BEGIN
+    IF node_name IS NULL THEN
+        RAISE USING
+            MESSAGE = 'node_name may not be null',
+            ERRCODE = 'invalid_parameter_value';
+    END IF;
+
+    -- concurrency
+    LOCK TABLE bdr.bdr_node_relays IN EXCLUSIVE MODE;
+
+    SELECT * INTO v_node FROM bdr.bdr_nodes n WHERE n.node_name = bdr_node_set_relay.node_name;
+
+    IF NOT FOUND THEN
+        RAISE USING
+            MESSAGE = format('No node named %s found', node_name),
+            ERRCODE = 'no_data_found';
+    END IF;
+
+    DELETE FROM bdr.bdr_node_relays r
+    WHERE (r.node_sysid, r.node_timeline, r.node_dboid)
+        = (v_node.node_sysid, v_node.node_timeline, v_node.node_dboid);
+
+    IF relay_node_name IS NOT NULL THEN
+        SELECT * INTO v_relay FROM bdr.bdr_nodes n WHERE n.node_name = relay_node_name;
+
+        IF NOT FOUND THEN
+            RAISE USING
+                MESSAGE = format('No node named %s found', relay_node_name),
+                ERRCODE = 'no_data_found';
+        END IF;
+
+        IF v_node.node_status <> 'r' OR v_relay.node_status <> 'r' THEN
+            RAISE USING
+                MESSAGE = 'Relays can only be set up between ready nodes',
+                DETAIL = format('Node %s is in state %s, node %s in state %s.',
+                                node_name, v_node.node_status,
+                                relay_node_name, v_relay.node_status),
+                ERRCODE = 'object_not_in_prerequisite_state';
+        END IF;
+
+        IF (v_node.node_sysid, v_node.node_timeline, v_node.node_dboid)
+            = (v_relay.node_sysid, v_relay.node_timeline, v_relay.node_dboid) THEN
+            RAISE USING
+                MESSAGE = 'A node cannot be its own relay',
+                ERRCODE = 'invalid_parameter_value';
+        END IF;
+
+        -- Relays forward only changes they received directly, so they can't
+        -- be chained.
+        IF EXISTS (
+            SELECT 1 FROM bdr.bdr_node_relays r
+            WHERE (r.node_sysid, r.node_timeline, r.node_dboid)
+                = (v_relay.node_sysid, v_relay.node_timeline, v_relay.node_dboid)
+        ) THEN
+            RAISE USING
+                MESSAGE = format('Node %s uses a relay itself', relay_node_name),
+                ERRCODE = 'object_not_in_prerequisite_state';
+        END IF;
+
+        IF EXISTS (
+            SELECT 1 FROM bdr.bdr_node_relays r
+            WHERE (r.relay_sysid, r.relay_timeline, r.relay_dboid)
+                = (v_node.node_sysid, v_node.node_timeline, v_node.node_dboid)
+        ) THEN
+            RAISE USING
+                MESSAGE = format('Node %s is the relay of other nodes', node_name),
+                ERRCODE = 'object_not_in_prerequisite_state';
+        END IF;
+
+        -- Nodes relayed through different relays would never see each
+        -- other's changes.
+        IF EXISTS (
+            SELECT 1 FROM bdr.bdr_node_relays r
+            WHERE (r.relay_sysid, r.relay_timeline, r.relay_dboid)
+                <> (v_relay.node_sysid, v_relay.node_timeline, v_relay.node_dboid)
+        ) THEN
+            RAISE USING
+                MESSAGE = 'Only one relay node is supported',
+                HINT = 'Move the other nodes to the same relay first.',
+                ERRCODE = 'feature_not_supported';
+        END IF;
+
+        INSERT INTO bdr.bdr_node_relays
+            (node_sysid, node_timeline, node_dboid,
+             relay_sysid, relay_timeline, relay_dboid)
+        VALUES
+            (v_node.node_sysid, v_node.node_timeline, v_node.node_dboid,
+             v_relay.node_sysid, v_relay.node_timeline, v_relay.node_dboid);
+    END IF;
+
+    -- Peers are notified when they replay the change
+    PERFORM bdr.bdr_connections_changed();
+END;
+$body$;
+
+REVOKE ALL ON FUNCTION bdr.bdr_node_set_relay(text, text) FROM PUBLIC;
+
+COMMENT ON FUNCTION bdr.bdr_node_set_relay(text, text) IS 'Make a node exchange its changes with the other nodes through a relay node, or connect to all of them directly again if relay_node_name is null';
+
+--
+-- Application messages: sent on named channels with bdr_send_message() and
+-- passed to the handler configured for the channel on each receiving node.
+-- Apply workers subscribe to the channels there's a handler for when they
+-- connect.
+--
+CREATE TABLE bdr.bdr_message_handlers (
+    channel text PRIMARY KEY CHECK (channel ~ '^[a-z0-9_-]+$' AND channel <> 'bdr'),
+    handler text NOT NULL
+);
+
+REVOKE ALL ON TABLE bdr.bdr_message_handlers FROM PUBLIC;
+
+SELECT pg_catalog.pg_extension_config_dump('bdr_message_handlers', '');
+
+COMMENT ON TABLE bdr.bdr_message_handlers IS 'Functions handling the messages received on application message channels';
+COMMENT ON COLUMN bdr.bdr_message_handlers.handler IS 'Handler function signature, resolved on each node when a message arrives';
+
+CREATE FUNCTION bdr.bdr_send_message(channel text, payload bytea, transactional boolean DEFAULT true)
+RETURNS pg_lsn
+LANGUAGE C VOLATILE STRICT
+AS 'MODULE_PATHNAME';
+
+REVOKE ALL ON FUNCTION bdr.bdr_send_message(text, bytea, boolean) FROM PUBLIC;
+
+COMMENT ON FUNCTION bdr.bdr_send_message(text, bytea, boolean) IS 'Send a message on an application channel to the other nodes, with the current transaction if transactional, otherwise immediately';
+
+CREATE FUNCTION bdr.bdr_set_message_handler(channel text, handler regprocedure)
+RETURNS void LANGUAGE plpgsql VOLATILE
+SET search_path = bdr, pg_catalog
+AS $body$
+DECLARE
+    v_proc pg_catalog.pg_proc;
+    v_handler text;
+BEGIN
+    IF channel IS NULL THEN
+        RAISE USING
+            MESSAGE = 'channel may not be null',
+            ERRCODE = 'invalid_parameter_value';
+    END IF;
+
+    IF channel !~ '^[a-z0-9_-]+$' OR channel = 'bdr' THEN
+        RAISE USING
+            MESSAGE = format('Invalid message channel name %s', channel),
+            HINT = 'Message channel names may only contain lower case letters, numbers, the underscore and the dash, and "bdr" is reserved.',
+            ERRCODE = 'invalid_name';
+    END IF;
+
+    IF handler IS NULL THEN
+        DELETE FROM bdr.bdr_message_handlers h
+        WHERE h.channel = bdr_set_message_handler.channel;
+        RETURN;
+    END IF;
+
+    SELECT * INTO v_proc FROM pg_catalog.pg_proc p WHERE p.oid = handler;
+
+    IF v_proc.proargtypes::oid[] <> ARRAY['text', 'text', 'oid', 'oid', 'bytea']::regtype[]::oid[]
+       OR v_proc.prorettype <> 'void'::regtype
+       OR v_proc.proretset THEN
+        RAISE USING
+            MESSAGE = format('Function %s cannot handle messages', handler),
+            DETAIL = 'Message handlers must take the arguments (channel text, origin_sysid text, origin_timeline oid, origin_dboid oid, payload bytea) and return void.',
+            ERRCODE = 'invalid_function_definition';
+    END IF;
+
+    -- Stored by qualified signature so it resolves on each node by itself
+    v_handler := format('%I.%I(text,text,oid,oid,bytea)',
+        (SELECT nspname FROM pg_catalog.pg_namespace WHERE oid = v_proc.pronamespace),
+        v_proc.proname);
+
+    UPDATE bdr.bdr_message_handlers h
+    SET handler = v_handler
+    WHERE h.channel = bdr_set_message_handler.channel;
+
+    IF NOT FOUND THEN
+        INSERT INTO bdr.bdr_message_handlers (channel, handler)
+        VALUES (bdr_set_message_handler.channel, v_handler);
+    END IF;
+END;
+$body$;
+
+REVOKE ALL ON FUNCTION bdr.bdr_set_message_handler(text, regprocedure) FROM PUBLIC;
+
+COMMENT ON FUNCTION bdr.bdr_set_message_handler(text, regprocedure) IS 'Set the function handling the messages received on an application message channel, or remove it if handler is null';
+
+CREATE FUNCTION bdr.bdr_type_capabilities()
+RETURNS text
+LANGUAGE C STABLE STRICT
+AS 'MODULE_PATHNAME', 'bdr_type_capabilities_sql';
+
+COMMENT ON FUNCTION bdr.bdr_type_capabilities() IS 'Description of the builtin types of this node an apply worker sends its upstream with bdr.negotiate_type_transfer enabled';
+
 RESET bdr.permit_unsafe_ddl_commands;
 RESET bdr.skip_ddl_replication;
 RESET search_path;
@@ -0,0 +1,116 @@
+#!/bin/bash
+#
+# Benchmark the BDR output plugin: decode the same set of changes with
+# different output plugin options and report the number of bytes sent and the
+# time spent per change.
+#
+# Run it against a database on a BDR test node, connection parameters are
+# taken from the usual libpq environment variables:
+#
+#   PGDATABASE=bdrdemo scripts/bdr_decode_bench.sh
+#
+# Each argument is a space separated list of output plugin option names and
+# values to compare, the default compares compression off and on:
+#
+#   scripts/bdr_decode_bench.sh "compression none" "compression zlib"
+#
+# To compare the tuple serializer that bypasses heap_deform_tuple() with the
+# generic one:
+#
+#   scripts/bdr_decode_bench.sh "tuple_fast_path false" "tuple_fast_path true"
+#
+# To see how cheaply changes that aren't sent are skipped, as in a mesh where
+# most changes come from other nodes, make FOREIGN_PCT percent of them look
+# like they were replayed from another node, and compare with decoding them
+# all. Changes to relations outside the requested replication sets are
+# skipped the same way:
+#
+#   FOREIGN_PCT=90 scripts/bdr_decode_bench.sh \
+#       "forward_changesets true" "forward_changesets false"
+#   scripts/bdr_decode_bench.sh "replication_sets default" "replication_sets unused"
+#
+# The benchmark table is created with replicated DDL and the changes made to
+# it are replicated to the node's peers too, so don't run this on production
+# nodes.
+#
+
+set -e -u
+
+ROWS="${ROWS:-10000}"
+RUNS="${RUNS:-3}"
+FOREIGN_PCT="${FOREIGN_PCT:-0}"
+PSQL="psql -X -q -v ON_ERROR_STOP=1"
+
+if [ $# -eq 0 ]; then
+    set -- "compression none" "compression zlib"
+fi
+
+# A slot name bdr_parse_slot_name() accepts; the remote node doesn't exist.
+SLOT=$($PSQL -At -c "SELECT 'bdr_' || oid || '_1_1_' || oid || '__' FROM pg_database WHERE datname = current_database()")
+# Replication identifier the "foreign" changes are attributed to
+ORIGIN="bdr_decode_bench_origin"
+LOCAL_ROWS=$((ROWS * (100 - FOREIGN_PCT) / 100))
+
+cleanup() {
+    $PSQL >/dev/null <<SQL
+SELECT pg_drop_replication_slot('$SLOT')
+FROM pg_replication_slots WHERE slot_name = '$SLOT';
+SELECT pg_replication_identifier_drop('$ORIGIN')
+FROM pg_replication_identifier WHERE riname = '$ORIGIN';
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command(\$\$DROP TABLE IF EXISTS public.bdr_decode_bench;\$\$);
+COMMIT;
+SQL
+}
+trap cleanup EXIT
+
+$PSQL >/dev/null <<SQL
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command(\$\$
+	CREATE TABLE public.bdr_decode_bench(id integer PRIMARY KEY, counter integer NOT NULL, payload text);
+\$\$);
+COMMIT;
+
+SELECT pg_create_logical_replication_slot('$SLOT', 'bdr');
+SELECT pg_replication_identifier_create('$ORIGIN');
+
+INSERT INTO bdr_decode_bench
+SELECT g, 0, repeat(md5(g::text), 4) FROM generate_series(1, $LOCAL_ROWS) g;
+UPDATE bdr_decode_bench SET counter = counter + 1;
+DELETE FROM bdr_decode_bench;
+
+SELECT pg_replication_identifier_setup_replaying_from('$ORIGIN');
+INSERT INTO bdr_decode_bench
+SELECT g, 0, repeat(md5(g::text), 4) FROM generate_series($LOCAL_ROWS + 1, $ROWS) g;
+UPDATE bdr_decode_bench SET counter = counter + 1;
+DELETE FROM bdr_decode_bench;
+SELECT pg_replication_identifier_reset_replaying_from();
+SQL
+
+CHANGES=$((ROWS * 3))
+
+echo "decoding $CHANGES changes, $FOREIGN_PCT% from another node, best of $RUNS runs"
+printf "%-40s %10s %14s %14s\n" "options" "messages" "bytes/change" "usec/change"
+
+for opts in "$@"; do
+    optlist=$(echo "$opts" | awk '{ for (i = 1; i <= NF; i++) printf ", '\''%s'\''", $i }')
+
+    $PSQL -At -F ' ' <<SQL | sort -n -k3 | head -n 1 | \
+        awk -v opts="$opts" -v changes="$CHANGES" \
+        '{ printf "%-40s %10d %14.1f %14.2f\n", opts, $1, $2 / changes, $3 * 1000 / changes }'
+CREATE FUNCTION pg_temp.bdr_decode_bench(run integer, OUT messages bigint, OUT bytes bigint, OUT ms double precision)
+LANGUAGE plpgsql AS \$\$
+DECLARE
+	start timestamptz := clock_timestamp();
+BEGIN
+	SELECT count(*), sum(octet_length(data)) INTO messages, bytes
+	FROM pg_logical_slot_peek_binary_changes('$SLOT', NULL, NULL,
+		'interactive', 'true'$optlist);
+	ms := extract(epoch FROM clock_timestamp() - start) * 1000;
+END;
+\$\$;
+SELECT b.* FROM generate_series(1, $RUNS) r, LATERAL pg_temp.bdr_decode_bench(r) b;
+SQL
+done
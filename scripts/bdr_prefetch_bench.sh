@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# Benchmark prefetching in apply workers: replay the same number of random
+# single-row UPDATEs on a table larger than shared_buffers with different
+# settings of bdr.prefetch_depth, and report how long the downstream node
+# takes to catch up.
+#
+# Run it with connection strings for two nodes of a BDR group, the changes
+# are made on UPSTREAM and timed while DOWNSTREAM replays them:
+#
+#   UPSTREAM="port=5432 dbname=bdrdemo" DOWNSTREAM="port=5433 dbname=bdrdemo" \
+#       scripts/bdr_prefetch_bench.sh
+#
+# Each argument is a prefetch depth to compare, the default compares no
+# prefetching with a depth of 32:
+#
+#   scripts/bdr_prefetch_bench.sh 0 8 32 128
+#
+# The table is sized to SIZE_FACTOR times the downstream's shared_buffers.
+# Rows the kernel still has cached are read without waiting for the disk, so
+# for meaningful numbers the table should exceed the downstream's page cache
+# too, or set DROP_CACHES to a command that empties it before each run:
+#
+#   DROP_CACHES="ssh db2 'sync; echo 3 | sudo tee /proc/sys/vm/drop_caches'" \
+#       scripts/bdr_prefetch_bench.sh
+#
+# The downstream's bdr.prefetch_depth is changed with ALTER SYSTEM, which
+# needs a superuser, and reset at the end. The benchmark table is created
+# with replicated DDL and the changes made to it are replicated to all
+# nodes of the group, so don't run this on production nodes.
+#
+
+set -e -u
+
+UPSTREAM="${UPSTREAM:?set UPSTREAM to the connection string of the node making the changes}"
+DOWNSTREAM="${DOWNSTREAM:?set DOWNSTREAM to the connection string of the node replaying them}"
+UPDATES="${UPDATES:-20000}"
+SIZE_FACTOR="${SIZE_FACTOR:-4}"
+DROP_CACHES="${DROP_CACHES:-}"
+PSQL="psql -X -q -v ON_ERROR_STOP=1"
+
+if [ $# -eq 0 ]; then
+    set -- 0 32
+fi
+
+# rows are about 200 bytes including the index entry
+ROWS=$($PSQL -At -d "$DOWNSTREAM" -c "SELECT (setting::bigint * 8192 * $SIZE_FACTOR / 200)::bigint FROM pg_settings WHERE name = 'shared_buffers'")
+
+cleanup() {
+    $PSQL -d "$DOWNSTREAM" >/dev/null <<SQL
+SELECT bdr.bdr_apply_resume();
+ALTER SYSTEM RESET bdr.prefetch_depth;
+SELECT pg_reload_conf();
+SQL
+    $PSQL -d "$UPSTREAM" >/dev/null <<SQL
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command(\$\$DROP TABLE IF EXISTS public.bdr_prefetch_bench;\$\$);
+COMMIT;
+SQL
+}
+trap cleanup EXIT
+
+echo "loading $ROWS rows"
+
+$PSQL -d "$UPSTREAM" >/dev/null <<SQL
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command(\$\$
+	CREATE TABLE public.bdr_prefetch_bench(id integer PRIMARY KEY, counter integer NOT NULL, payload text);
+\$\$);
+COMMIT;
+
+INSERT INTO bdr_prefetch_bench
+SELECT g, 0, repeat(md5(g::text), 4) FROM generate_series(1, $ROWS) g;
+
+SELECT bdr.wait_slot_confirm_lsn(NULL, NULL);
+SQL
+
+echo "replaying $UPDATES random updates of a table of $ROWS rows"
+printf "%-15s %12s %14s\n" "prefetch_depth" "seconds" "changes/sec"
+
+for depth in "$@"; do
+    $PSQL -d "$DOWNSTREAM" >/dev/null <<SQL
+ALTER SYSTEM SET bdr.prefetch_depth = $depth;
+SELECT pg_reload_conf();
+SELECT bdr.bdr_apply_pause();
+SQL
+
+    # one transaction per row, as the changes of an OLTP workload arrive
+    $PSQL -At -d "$UPSTREAM" -c "
+SELECT 'UPDATE bdr_prefetch_bench SET counter = counter + 1 WHERE id = ' ||
+       (1 + floor(random() * $ROWS))::integer || ';'
+FROM generate_series(1, $UPDATES)" | $PSQL -d "$UPSTREAM" >/dev/null
+
+    LSN=$($PSQL -At -d "$UPSTREAM" -c "SELECT pg_current_xlog_location()")
+
+    if [ -n "$DROP_CACHES" ]; then
+        $PSQL -d "$DOWNSTREAM" -c "CHECKPOINT" >/dev/null
+        eval "$DROP_CACHES"
+    fi
+
+    START=$(date +%s.%N)
+    $PSQL -d "$DOWNSTREAM" -c "SELECT bdr.bdr_apply_resume()" >/dev/null
+    $PSQL -d "$UPSTREAM" -c "SELECT bdr.wait_slot_confirm_lsn(NULL, '$LSN')" >/dev/null
+    END=$(date +%s.%N)
+
+    echo "$depth $START $END" | \
+        awk -v changes="$UPDATES" \
+        '{ printf "%-15s %12.2f %14.0f\n", $1, $3 - $2, changes / ($3 - $2) }'
+done
@@ -9,3 +9,26 @@ SELECT
 FROM pg_catalog.pg_attribute
 WHERE attrelid = 'bdr.bdr_connections'::regclass
 ORDER BY attnum;
+
+SELECT
+  attnum, attname, attisdropped
+FROM pg_catalog.pg_attribute
+WHERE attrelid = 'bdr.bdr_node_relays'::regclass
+ORDER BY attnum;
+
+-- relays are validated before anything is changed
+SELECT bdr.bdr_node_set_relay('node-nonexistent', NULL);
+SELECT bdr.bdr_node_set_relay('node-regression', 'node-nonexistent');
+SELECT bdr.bdr_node_set_relay('node-regression', 'node-regression');
+SELECT count(*) FROM bdr.bdr_node_relays;
+
+SELECT
+  attnum, attname, attisdropped
+FROM pg_catalog.pg_attribute
+WHERE attrelid = 'bdr.bdr_message_handlers'::regclass
+ORDER BY attnum;
+
+-- message handlers are validated before anything is changed
+SELECT bdr.bdr_set_message_handler('bdr', 'pg_catalog.now()');
+SELECT bdr.bdr_set_message_handler('cache-inval', 'pg_catalog.now()');
+SELECT count(*) FROM bdr.bdr_message_handlers;
@@ -183,3 +183,65 @@ SELECT * FROM settest_2 ORDER BY data;
 SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication;
 \c regression
 SELECT * FROM settest_2 ORDER BY data;
+
+/*
+ * Test row filters.
+ */
+\c postgres
+CREATE TABLE settest_3(id integer primary key, region text);
+
+SELECT bdr.table_set_replication_sets('settest_3', '{for-node-2}');
+SELECT bdr.table_set_row_filter('settest_3', 'for-node-2', $$region = 'eu'$$);
+INSERT INTO settest_3 VALUES (1, 'eu'), (2, 'us');
+
+-- rows passing the filter of any of the sets are replicated
+SELECT bdr.table_set_replication_sets('settest_3', '{for-node-2,important}');
+SELECT bdr.table_set_row_filter('settest_3', 'important', 'id > 10');
+INSERT INTO settest_3 VALUES (3, 'us'), (11, 'us');
+
+-- all rows are replicated once one of the sets has no filter
+SELECT bdr.table_set_row_filter('settest_3', 'important', NULL);
+INSERT INTO settest_3 VALUES (4, 'us');
+
+-- invalid filters
+SELECT bdr.table_set_row_filter('settest_3', 'for-node-2', 'nosuchcolumn = 1');
+SELECT bdr.table_set_row_filter('settest_3', 'for-node-2', 'random() > 0.5');
+SELECT bdr.table_set_row_filter('settest_3', 'unknown-set', 'true');
+
+SELECT * FROM settest_3 ORDER BY id;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication;
+\c regression
+SELECT * FROM settest_3 ORDER BY id;
+\c postgres
+DROP TABLE settest_3;
+
+/*
+ * Test column lists.
+ */
+\c postgres
+CREATE TABLE settest_4(id integer primary key, a text, b text NOT NULL, c text);
+
+SELECT bdr.table_set_replication_sets('settest_4', '{for-node-2}');
+SELECT bdr.table_set_column_list('settest_4', 'for-node-2', '{a,b}');
+INSERT INTO settest_4 VALUES (1, 'a1', 'b1', 'c1');
+UPDATE settest_4 SET a = 'a2', c = 'c2' WHERE id = 1;
+
+-- invalid column lists
+SELECT bdr.table_set_column_list('settest_4', 'for-node-2', '{a,nosuchcolumn}');
+SELECT bdr.table_set_column_list('settest_4', 'for-node-2', '{a}');
+SELECT bdr.table_set_column_list('settest_4', 'unknown-set', '{a,b}');
+
+SELECT * FROM settest_4 ORDER BY id;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication;
+\c regression
+SELECT * FROM settest_4 ORDER BY id;
+-- a remote INSERT conflicting with a local row keeps the local values of the
+-- columns that aren't replicated
+INSERT INTO settest_4 VALUES (2, 'a-local', 'b-local', 'c-local');
+\c postgres
+INSERT INTO settest_4 VALUES (2, 'a-remote', 'b-remote', 'c-remote');
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), pid) FROM pg_stat_replication;
+\c regression
+SELECT * FROM settest_4 ORDER BY id;
+\c postgres
+DROP TABLE settest_4;
@@ -0,0 +1,69 @@
+-- INSERTs applied in batches, bdr.batch_inserts is set in bdr_regress_bdr.conf
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+SHOW bdr.batch_inserts;
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TABLE public.batch_inserts(id integer PRIMARY KEY, k integer, data text);
+$$);
+COMMIT;
+
+-- a unique index only the second node has
+\c :writedb2
+BEGIN;
+SET LOCAL bdr.skip_ddl_replication = on;
+SET LOCAL bdr.skip_ddl_locking = on;
+CREATE UNIQUE INDEX batch_inserts_k ON batch_inserts(k);
+COMMIT;
+
+\c :writedb1
+-- more rows than fit into one batch
+INSERT INTO batch_inserts SELECT g, g, 'row ' || g FROM generate_series(1, 250) g;
+
+-- a row with the same key of the unique index as one before it in the same
+-- batch conflicts with that, the later row wins
+BEGIN;
+INSERT INTO batch_inserts VALUES (1001, 1000, 'first');
+INSERT INTO batch_inserts VALUES (1002, 1001, 'other');
+INSERT INTO batch_inserts VALUES (1003, 1000, 'second');
+COMMIT;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+SELECT count(*), sum(id), sum(k) FROM batch_inserts WHERE id <= 250;
+SELECT * FROM batch_inserts WHERE id > 1000 ORDER BY id;
+\c :readdb2
+SELECT count(*), sum(id), sum(k) FROM batch_inserts WHERE id <= 250;
+SELECT * FROM batch_inserts WHERE id > 1000 ORDER BY id;
+
+-- the upstream stalls in the middle of a transaction while rows are still
+-- batched, so the apply worker runs out of data and waits for more: a row
+-- filter that sleeps on one row holds up the walsender decoding it
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE FUNCTION public.batch_inserts_stall(id integer) RETURNS boolean
+	LANGUAGE sql IMMUTABLE AS
+	'SELECT CASE WHEN $1 = 2150 THEN (SELECT true FROM pg_sleep(2)) ELSE true END';
+$$);
+SELECT bdr.table_set_replication_sets('batch_inserts', '{for-node-1}');
+SELECT bdr.table_set_row_filter('batch_inserts', 'for-node-1', 'public.batch_inserts_stall(id)');
+COMMIT;
+
+INSERT INTO batch_inserts SELECT g, g, 'row ' || g FROM generate_series(2001, 2300) g;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb2
+SELECT count(*), sum(id), sum(k), bool_and(data = 'row ' || id) FROM batch_inserts WHERE id > 2000;
+
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	DROP TABLE public.batch_inserts;
+	DROP FUNCTION public.batch_inserts_stall(integer);
+$$);
+COMMIT;
@@ -0,0 +1,74 @@
+-- Application messages, passed to the handler of their channel on the
+-- receiving node
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($DDL$
+	CREATE TABLE public.received_messages(id serial PRIMARY KEY, channel text, origin_dboid oid, payload bytea);
+$DDL$);
+SELECT bdr.bdr_replicate_ddl_command($DDL$
+	CREATE FUNCTION public.log_message(channel text, origin_sysid text, origin_timeline oid, origin_dboid oid, payload bytea)
+	RETURNS void LANGUAGE sql AS
+	$$ INSERT INTO public.received_messages(channel, origin_dboid, payload) VALUES ($1, $4, $5) $$;
+$DDL$);
+SELECT bdr.bdr_replicate_ddl_command($DDL$
+	CREATE FUNCTION public.wait_for_new_apply_worker(old_pid integer)
+	RETURNS void LANGUAGE plpgsql AS
+	$$
+	BEGIN
+		WHILE NOT EXISTS (SELECT 1 FROM pg_stat_activity
+						  WHERE datname = current_database()
+							AND application_name LIKE 'bdr (%): apply'
+							AND pid <> old_pid)
+		LOOP
+			PERFORM pg_sleep(0.2);
+			PERFORM pg_stat_clear_snapshot();
+		END LOOP;
+	END;
+	$$;
+$DDL$);
+COMMIT;
+
+SELECT bdr.bdr_set_message_handler('test-channel', 'public.log_message(text,text,oid,oid,bytea)');
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+
+-- apply workers subscribe to the channels with a handler when they connect
+\c :writedb2
+SELECT * FROM bdr.bdr_message_handlers;
+SELECT pid AS apply_pid FROM pg_stat_activity
+WHERE datname = current_database() AND application_name LIKE 'bdr (%): apply'
+\gset
+SELECT bdr.terminate_apply_workers('node-regression');
+SELECT public.wait_for_new_apply_worker(:apply_pid);
+
+\c :writedb1
+BEGIN;
+SELECT bdr.bdr_send_message('test-channel', 'transactional') IS NOT NULL AS sent;
+COMMIT;
+SELECT bdr.bdr_send_message('test-channel', 'immediate', false) IS NOT NULL AS sent;
+-- no handler for that channel, so it isn't sent
+SELECT bdr.bdr_send_message('other-channel', 'ignored') IS NOT NULL AS sent;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+
+-- handlers only run on the receiving node
+\c :readdb1
+SELECT count(*) FROM received_messages;
+\c :readdb2
+SELECT m.channel, d.datname AS origin, convert_from(m.payload, 'UTF8') AS payload
+FROM received_messages m JOIN pg_database d ON d.oid = m.origin_dboid
+ORDER BY m.id;
+
+\c :writedb1
+SELECT bdr.bdr_set_message_handler('test-channel', NULL);
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($DDL$
+	DROP FUNCTION public.wait_for_new_apply_worker(integer);
+	DROP FUNCTION public.log_message(text, text, oid, oid, bytea);
+	DROP TABLE public.received_messages;
+$DDL$);
+COMMIT;
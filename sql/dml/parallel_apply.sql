@@ -0,0 +1,99 @@
+-- Changes of rows with the same key in a unique index besides the replica
+-- identity have to be applied in order, also by parallel apply workers.
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TABLE public.bdr_parallel_apply(id integer PRIMARY KEY, email text UNIQUE, note text);
+$$);
+COMMIT;
+
+INSERT INTO bdr_parallel_apply VALUES (1, 'e', 'first');
+-- move the value to another row, one transaction after the other
+UPDATE bdr_parallel_apply SET email = 'f' WHERE id = 1;
+INSERT INTO bdr_parallel_apply VALUES (2, 'e', 'second');
+DELETE FROM bdr_parallel_apply WHERE id = 2;
+UPDATE bdr_parallel_apply SET email = 'e' WHERE id = 1;
+INSERT INTO bdr_parallel_apply VALUES (3, 'f', 'third');
+-- NULLs don't conflict
+INSERT INTO bdr_parallel_apply VALUES (4, NULL, 'fourth');
+INSERT INTO bdr_parallel_apply VALUES (5, NULL, 'fifth');
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+SELECT * FROM bdr_parallel_apply ORDER BY id;
+\c :readdb2
+SELECT * FROM bdr_parallel_apply ORDER BY id;
+
+-- The apply worker restarts while a transaction changing a relation for the
+-- first time in the session is being applied. It then applies that one
+-- itself, and the relation's metadata have to reach the parallel apply
+-- workers started for the transactions after it.
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TABLE public.bdr_parallel_restart(id integer PRIMARY KEY, note text);
+$$);
+COMMIT;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+
+-- the first row takes a while to apply on the second node
+\c :writedb2
+BEGIN;
+SET LOCAL bdr.skip_ddl_replication = on;
+SET LOCAL bdr.skip_ddl_locking = on;
+CREATE FUNCTION public.bdr_parallel_restart_stall() RETURNS trigger
+LANGUAGE plpgsql AS $$
+BEGIN
+	IF NEW.id = 1 THEN
+		PERFORM pg_sleep(2);
+	END IF;
+	RETURN NEW;
+END;
+$$;
+CREATE TRIGGER bdr_parallel_restart_stall BEFORE INSERT ON bdr_parallel_restart
+FOR EACH ROW EXECUTE PROCEDURE public.bdr_parallel_restart_stall();
+ALTER TABLE bdr_parallel_restart ENABLE ALWAYS TRIGGER bdr_parallel_restart_stall;
+COMMIT;
+
+\c :writedb1
+INSERT INTO bdr_parallel_restart VALUES (1, 'before restart');
+
+-- restart the apply worker once it's applying the row
+\c :writedb2
+DO $$
+BEGIN
+	WHILE NOT EXISTS (SELECT 1 FROM pg_locks
+					  WHERE relation = 'public.bdr_parallel_restart'::regclass
+						AND pid <> pg_backend_pid())
+	LOOP
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END;
+$$;
+SELECT bdr.terminate_apply_workers('node-regression');
+
+\c :writedb1
+INSERT INTO bdr_parallel_restart VALUES (2, 'after restart');
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb2
+SELECT * FROM bdr_parallel_restart ORDER BY id;
+
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	DROP TABLE public.bdr_parallel_apply;
+	DROP TABLE public.bdr_parallel_restart;
+$$);
+COMMIT;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :writedb2
+BEGIN;
+SET LOCAL bdr.skip_ddl_replication = on;
+SET LOCAL bdr.skip_ddl_locking = on;
+DROP FUNCTION public.bdr_parallel_restart_stall();
+COMMIT;
@@ -0,0 +1,37 @@
+-- test replication of tables with REPLICA IDENTITY FULL, for which only
+-- changed columns are sent with bdr.changed_columns_only
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TABLE public.bdr_replident_full(id integer PRIMARY KEY, counter integer NOT NULL, payload text);
+	ALTER TABLE public.bdr_replident_full REPLICA IDENTITY FULL;
+$$);
+COMMIT;
+
+INSERT INTO bdr_replident_full VALUES (1, 0, repeat('a', 100)), (2, 0, 'b');
+UPDATE bdr_replident_full SET counter = counter + 1;
+UPDATE bdr_replident_full SET counter = counter + 1, payload = 'cc' WHERE id = 2;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+
+\c :readdb2
+SELECT id, counter, length(payload) AS payload_len FROM bdr_replident_full ORDER BY id;
+
+-- key changes and deletes have to find the row by its primary key
+\c :writedb2
+UPDATE bdr_replident_full SET id = 3 WHERE id = 1;
+DELETE FROM bdr_replident_full WHERE id = 2;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+
+\c :readdb1
+SELECT id, counter, length(payload) AS payload_len FROM bdr_replident_full ORDER BY id;
+
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$DROP TABLE public.bdr_replident_full;$$);
+COMMIT;
@@ -0,0 +1,50 @@
+-- per type transfer negotiation, bdr.negotiate_type_transfer is enabled in
+-- bdr_regress_bdr.conf
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+SHOW bdr.negotiate_type_transfer;
+
+-- what apply workers send in the type_capabilities option, entries are
+-- oid:typlen:alignment:byval:recv:stable
+SELECT c FROM regexp_split_to_table(bdr.bdr_type_capabilities(), ',') c
+WHERE split_part(c, ':', 1)::oid IN ('bool'::regtype, 'int4'::regtype, 'text'::regtype, 'tid'::regtype)
+ORDER BY split_part(c, ':', 1)::oid;
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TYPE public.type_transfer_pair AS (a integer, b text);
+	CREATE TABLE public.type_transfer (
+		id integer PRIMARY KEY,
+		i8 bigint,
+		f8 float8,
+		n numeric,
+		b boolean,
+		d date,
+		ia integer[],
+		ta text[],
+		p public.type_transfer_pair,
+		u uuid
+	);
+$$);
+COMMIT;
+
+INSERT INTO type_transfer VALUES
+	(1, 9000000000, 1.5, 12345.678, true, '2015-03-04', '{1,2,3}', '{a,"b c"}', '(7,x)', 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'),
+	(2, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+UPDATE type_transfer SET ia = '{4,5}', p = '(8,"y z")' WHERE id = 1;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+\c :readdb2
+SELECT * FROM type_transfer ORDER BY id;
+
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	DROP TABLE public.type_transfer;
+	DROP TYPE public.type_transfer_pair;
+$$);
+COMMIT;
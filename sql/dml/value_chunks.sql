@@ -0,0 +1,39 @@
+-- values sent in chunks ahead of their row, bdr.value_chunk_size is set in
+-- bdr_regress_bdr.conf
+SELECT * FROM public.bdr_regress_variables()
+\gset
+
+\c :writedb1
+
+SHOW bdr.value_chunk_size;
+
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$
+	CREATE TABLE public.value_chunks(id integer PRIMARY KEY, before text, data text, after integer, other text);
+$$);
+SELECT bdr.bdr_replicate_ddl_command($$
+	ALTER TABLE public.value_chunks ALTER COLUMN data SET STORAGE EXTERNAL, ALTER COLUMN other SET STORAGE EXTERNAL;
+$$);
+COMMIT;
+
+-- a value of several chunks between values sent as part of the row
+INSERT INTO value_chunks VALUES (1, 'first', repeat('0123456789', 1000), 42, 'small');
+-- two chunked values in the same row
+INSERT INTO value_chunks VALUES (2, 'second', repeat('abcdefghij', 500), 43, repeat('x', 3000));
+-- the unchanged value isn't sent again
+UPDATE value_chunks SET after = after + 1 WHERE id = 1;
+-- the changed one is, the other is left alone
+UPDATE value_chunks SET data = 'changed:' || data WHERE id = 2;
+SELECT pg_xlog_wait_remote_apply(pg_current_xlog_location(), 0);
+SELECT id, before, length(data), md5(data), after, length(other), md5(other)
+FROM value_chunks ORDER BY id;
+\c :readdb2
+SELECT id, before, length(data), md5(data), after, length(other), md5(other)
+FROM value_chunks ORDER BY id;
+
+\c :writedb1
+BEGIN;
+SET LOCAL bdr.permit_ddl_locking = true;
+SELECT bdr.bdr_replicate_ddl_command($$DROP TABLE public.value_chunks;$$);
+COMMIT;
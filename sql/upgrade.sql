@@ -120,6 +120,9 @@ DROP EXTENSION bdr;
 CREATE EXTENSION bdr VERSION '1.0.7.0';
 DROP EXTENSION bdr;
 
+CREATE EXTENSION bdr VERSION '1.0.7.1';
+DROP EXTENSION bdr;
+
 -- evolve version one by one from the oldest to the newest one
 CREATE EXTENSION bdr VERSION '0.8.0';
 ALTER EXTENSION bdr UPDATE TO '0.8.0.1';
@@ -186,6 +189,7 @@ ALTER EXTENSION bdr UPDATE TO '1.0.4.0';
 ALTER EXTENSION bdr UPDATE TO '1.0.5.0';
 ALTER EXTENSION bdr UPDATE TO '1.0.6.0';
 ALTER EXTENSION bdr UPDATE TO '1.0.7.0';
+ALTER EXTENSION bdr UPDATE TO '1.0.7.1';
 
 -- Should never have to do anything: You missed adding the new version above.
 ALTER EXTENSION bdr UPDATE;